@@ -16,7 +16,11 @@ LOCAL_SRC_FILES := \
     mounts.c \
     extendedcommands.c \
     nandroid.c \
+    nandroid_archive.c \
+    nandroid_compress.c \
+    nandroid_extract.c \
     nandroid_md5.c \
+    nandroid_stream.c \
     reboot.c \
     ../../system/core/toolbox/dynarray.c \
     ../../system/core/toolbox/newfs_msdos.c \
@@ -196,6 +200,19 @@ LOCAL_CFLAGS += -DUSE_F2FS
 LOCAL_STATIC_LIBRARIES += libmake_f2fs libfsck_f2fs libfibmap_f2fs
 endif
 
+# tar.zst and tar.lz4 backup formats
+ifeq ($(BOARD_RECOVERY_USE_ZSTD), true)
+LOCAL_CFLAGS += -DUSE_ZSTD
+LOCAL_C_INCLUDES += external/zstd/lib
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
+
+ifeq ($(BOARD_RECOVERY_USE_LZ4), true)
+LOCAL_CFLAGS += -DUSE_LZ4
+LOCAL_C_INCLUDES += external/lz4/lib
+LOCAL_STATIC_LIBRARIES += liblz4
+endif
+
 LOCAL_STATIC_LIBRARIES += libminzip libunz libmincrypt
 
 LOCAL_STATIC_LIBRARIES += libminizip libminadbd libedify libbusybox libmkyaffs2image libunyaffs liberase_image libdump_image libflash_image
@@ -291,6 +308,48 @@ LOCAL_STATIC_LIBRARIES := libmincrypt libcutils libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
 
+# Host benchmark of the backup/restore formats, see nandroid_bench.c
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    nandroid_bench.c \
+    nandroid_archive.c \
+    nandroid_compress.c \
+    nandroid_extract.c \
+    mmcutils/mmcutils.c \
+    dedupe/dedupe.c \
+    dedupe/blobcodec.c \
+    dedupe/chunker.c \
+    dedupe/copyfile.c \
+    dedupe/digestset.c \
+    dedupe/hashcache.c \
+    dedupe/manifest.c \
+    ../../external/libselinux/src/lsetfilecon.c \
+    ../../external/libselinux/src/lgetfilecon.c
+
+LOCAL_C_INCLUDES += external/openssl/include external/libselinux/include external/zlib
+LOCAL_STATIC_LIBRARIES := libcrypto_static libselinux libcutils libz
+
+ifeq ($(BOARD_RECOVERY_USE_ZSTD), true)
+LOCAL_CFLAGS += -DUSE_ZSTD
+LOCAL_C_INCLUDES += external/zstd/lib
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
+
+ifeq ($(BOARD_RECOVERY_USE_LZ4), true)
+LOCAL_CFLAGS += -DUSE_LZ4
+LOCAL_C_INCLUDES += external/lz4/lib
+LOCAL_STATIC_LIBRARIES += liblz4
+endif
+
+# fallocate() and friends on glibc
+LOCAL_CFLAGS += -D_GNU_SOURCE
+LOCAL_LDLIBS += -lpthread
+LOCAL_MODULE := nandroid_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
 include $(commands_recovery_local_path)/bmlutils/Android.mk
 include $(commands_recovery_local_path)/dedupe/Android.mk
 include $(commands_recovery_local_path)/flashutils/Android.mk
@@ -0,0 +1,192 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "blobcodec.h"
+
+// blobs are written once and read on restore, favour speed over ratio
+#define BLOB_ZLIB_LEVEL 3
+#define BLOB_IO_SIZE (256 * 1024)
+// compressed blobs must save at least 1/8 of the sample
+#define PROBE_MIN_SAVING 8
+
+const char* blob_codec_suffix(int codec) {
+    return codec == BLOB_CODEC_ZLIB ? ".z" : "";
+}
+
+int blob_codec_probe(const unsigned char* sample, size_t len) {
+    unsigned char out[4096];
+    z_stream z;
+    size_t produced = 0;
+    int ret;
+
+    if (len < 512)
+        return BLOB_CODEC_RAW;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit(&z, 1) != Z_OK)
+        return BLOB_CODEC_RAW;
+    z.next_in = (Bytef*)sample;
+    z.avail_in = len;
+    do {
+        z.next_out = out;
+        z.avail_out = sizeof(out);
+        ret = deflate(&z, Z_FINISH);
+        produced += sizeof(out) - z.avail_out;
+        // no point in finishing once it's clearly not worth it
+        if (produced > len - len / PROBE_MIN_SAVING)
+            break;
+    } while (ret == Z_OK);
+    deflateEnd(&z);
+
+    return ret == Z_STREAM_END && produced <= len - len / PROBE_MIN_SAVING ? BLOB_CODEC_ZLIB : BLOB_CODEC_RAW;
+}
+
+static int write_fully(int fd, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Deflates whatever is in |z| into |fd|.
+static int deflate_to(z_stream* z, int fd, unsigned char* out, int flush) {
+    int ret;
+    do {
+        z->next_out = out;
+        z->avail_out = BLOB_IO_SIZE;
+        ret = deflate(z, flush);
+        if (ret == Z_STREAM_ERROR)
+            return -1;
+        if (write_fully(fd, out, BLOB_IO_SIZE - z->avail_out))
+            return -1;
+    } while (z->avail_out == 0);
+    return flush == Z_FINISH && ret != Z_STREAM_END ? -1 : 0;
+}
+
+// Compresses |len| bytes of |data|, or all of |srcfd| when |data| is NULL.
+static int compress_to(int srcfd, const unsigned char* data, size_t len, const char* dst) {
+    z_stream z;
+    unsigned char* in = NULL;
+    unsigned char* out = malloc(BLOB_IO_SIZE);
+    int ret = -1;
+    int fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    memset(&z, 0, sizeof(z));
+    if (fd < 0 || out == NULL || deflateInit(&z, BLOB_ZLIB_LEVEL) != Z_OK) {
+        free(out);
+        if (fd >= 0) {
+            close(fd);
+            unlink(dst);
+        }
+        return -1;
+    }
+
+    if (data != NULL) {
+        z.next_in = (Bytef*)data;
+        z.avail_in = len;
+        ret = deflate_to(&z, fd, out, Z_FINISH);
+    } else if ((in = malloc(BLOB_IO_SIZE)) != NULL) {
+        for (;;) {
+            ssize_t n = read(srcfd, in, BLOB_IO_SIZE);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                break;
+            z.next_in = in;
+            z.avail_in = n;
+            if (deflate_to(&z, fd, out, n == 0 ? Z_FINISH : Z_NO_FLUSH))
+                break;
+            if (n == 0) {
+                ret = 0;
+                break;
+            }
+        }
+    }
+    deflateEnd(&z);
+    free(in);
+    free(out);
+    if (close(fd))
+        ret = -1;
+    if (ret)
+        unlink(dst);
+    return ret;
+}
+
+int blob_compress_file(const char* src, const char* dst) {
+    int srcfd = open(src, O_RDONLY);
+    if (srcfd < 0)
+        return -1;
+    int ret = compress_to(srcfd, NULL, 0, dst);
+    close(srcfd);
+    return ret;
+}
+
+int blob_compress_data(const unsigned char* data, size_t len, const char* dst) {
+    return compress_to(-1, data, len, dst);
+}
+
+int blob_decompress_append(const char* src, int dstfd, off_t* offset) {
+    z_stream z;
+    unsigned char* in = malloc(BLOB_IO_SIZE);
+    unsigned char* out = malloc(BLOB_IO_SIZE);
+    int srcfd = open(src, O_RDONLY);
+    int ret = Z_OK;
+
+    memset(&z, 0, sizeof(z));
+    if (srcfd < 0 || in == NULL || out == NULL || inflateInit(&z) != Z_OK) {
+        if (srcfd >= 0)
+            close(srcfd);
+        free(in);
+        free(out);
+        return -1;
+    }
+
+    while (ret != Z_STREAM_END) {
+        ssize_t n = read(srcfd, in, BLOB_IO_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        // a truncated blob is as bad as an unreadable one
+        if (n <= 0) {
+            ret = Z_DATA_ERROR;
+            break;
+        }
+        z.next_in = in;
+        z.avail_in = n;
+        do {
+            z.next_out = out;
+            z.avail_out = BLOB_IO_SIZE;
+            ret = inflate(&z, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+                goto done;
+            size_t produced = BLOB_IO_SIZE - z.avail_out;
+            size_t written = 0;
+            while (written < produced) {
+                ssize_t w = pwrite(dstfd, out + written, produced - written, *offset);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w <= 0) {
+                    ret = Z_ERRNO;
+                    goto done;
+                }
+                written += w;
+                *offset += w;
+            }
+        } while (z.avail_out == 0 && ret != Z_STREAM_END);
+    }
+
+done:
+    inflateEnd(&z);
+    close(srcfd);
+    free(in);
+    free(out);
+    return ret == Z_STREAM_END ? 0 : -1;
+}
@@ -0,0 +1,30 @@
+#ifndef DEDUPE_BLOBCODEC_H
+#define DEDUPE_BLOBCODEC_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// How a blob is stored. Blobs are still named after the sha256 of their
+// uncompressed content; compressed ones carry the codec suffix, so a raw
+// and a compressed copy of the same content never collide.
+#define BLOB_CODEC_RAW 0
+#define BLOB_CODEC_ZLIB 1
+#define BLOB_CODEC_COUNT 2
+
+// "" or ".z"
+const char* blob_codec_suffix(int codec);
+
+// Returns the codec a blob starting with |sample| should be stored with:
+// zlib when a quick deflate of the sample saves at least an eighth, raw
+// for already compressed media, archives and the like.
+int blob_codec_probe(const unsigned char* sample, size_t len);
+
+// Compresses |src| (a file) or |data| into a new file |dst|. Return 0 on
+// success and leave nothing behind on failure.
+int blob_compress_file(const char* src, const char* dst);
+int blob_compress_data(const unsigned char* data, size_t len, const char* dst);
+
+// Decompresses the blob |src| into |dstfd| at |*offset| and advances it.
+int blob_decompress_append(const char* src, int dstfd, off_t* offset);
+
+#endif
@@ -0,0 +1,64 @@
+#include <pthread.h>
+
+#include "chunker.h"
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// splitmix64 from a fixed seed; the table must never change
+static void init_gear() {
+    uint64_t state = 0x6465647570654344ULL; // "dedupeCD"
+    int i;
+    for (i = 0; i < 256; i++) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// The gear hash shifts left, so its top bits depend on the most bytes;
+// masks select those.
+static uint64_t top_bits(int bits) {
+    return bits <= 0 ? 0 : ~0ULL << (64 - bits);
+}
+
+void chunker_init(chunker* c, uint32_t avg_size) {
+    int bits = 0;
+    pthread_once(&gear_once, init_gear);
+    if (avg_size < CHUNK_MIN_AVG_SIZE)
+        avg_size = CHUNK_MIN_AVG_SIZE;
+    if (avg_size > CHUNK_MAX_AVG_SIZE)
+        avg_size = CHUNK_MAX_AVG_SIZE;
+    while ((1U << (bits + 1)) <= avg_size)
+        bits++;
+    c->avg_size = 1U << bits;
+    c->min_size = c->avg_size / 4;
+    c->max_size = c->avg_size * 8;
+    c->mask_small = top_bits(bits + 2);
+    c->mask_large = top_bits(bits - 2);
+}
+
+size_t chunker_next(const chunker* c, const unsigned char* data, size_t len, int eof) {
+    if (len <= c->min_size)
+        return eof ? len : 0;
+
+    size_t end = len < c->max_size ? len : c->max_size;
+    size_t normal = end < c->avg_size ? end : c->avg_size;
+    size_t i = c->min_size;
+    uint64_t h = 0;
+
+    for (; i < normal; i++) {
+        h = (h << 1) + gear[data[i]];
+        if (!(h & c->mask_small))
+            return i + 1;
+    }
+    for (; i < end; i++) {
+        h = (h << 1) + gear[data[i]];
+        if (!(h & c->mask_large))
+            return i + 1;
+    }
+    if (end == c->max_size || eof)
+        return end;
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef DEDUPE_CHUNKER_H
+#define DEDUPE_CHUNKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Content defined chunking (FastCDC style gear hash with normalized
+// chunking). Boundaries only depend on the bytes around them, so an edit in
+// the middle of a large file only changes the chunks it touches.
+//
+// The gear table and the masks are part of the on disk format: changing
+// them changes every chunk boundary and defeats dedupe against older
+// backups.
+
+#define CHUNK_MIN_AVG_SIZE (16 * 1024)
+#define CHUNK_MAX_AVG_SIZE (4 * 1024 * 1024)
+#define CHUNK_DEFAULT_AVG_SIZE (256 * 1024)
+
+typedef struct {
+    uint32_t min_size;      // avg / 4
+    uint32_t avg_size;      // power of two
+    uint32_t max_size;      // avg * 8
+    uint64_t mask_small;    // used before avg_size, harder to match
+    uint64_t mask_large;    // used after avg_size, easier to match
+} chunker;
+
+// |avg_size| is rounded down to a power of two and clamped to the limits
+// above.
+void chunker_init(chunker* c, uint32_t avg_size);
+
+// Returns the length of the first chunk in |data|, or 0 when |len| is too
+// short to tell and more data should be read first. With |eof| set, all of
+// |data| is available and a (possibly short) chunk is always returned for
+// |len| > 0.
+size_t chunker_next(const chunker* c, const unsigned char* data, size_t len, int eof);
+
+#endif
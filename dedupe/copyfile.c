@@ -0,0 +1,232 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "copyfile.h"
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+// largest chunk handed to the kernel at once; copy_file_range and sendfile
+// both stop at about 2GB per call anyway
+#define COPY_CHUNK (64 * 1024 * 1024)
+// read/write fallback buffer, at most this and at least a page
+#define COPY_BUFFER_MAX (1024 * 1024)
+#define COPY_BUFFER_ALIGN 4096
+
+// Set once the running kernel turned out not to have the syscall, so every
+// file doesn't have to find out again. Racy but only ever goes 1 -> 0.
+static int have_copy_range = 1;
+static int have_sendfile = 1;
+
+// The copy methods below copy from |*pos| until the end of |srcfd| to
+// |dst_base| + |*pos| and advance |*pos|, so a failed method can be resumed
+// by the next one. They return 0 at EOF and -1 with errno set.
+
+static int copy_with_range(int srcfd, int dstfd, off_t dst_base, off_t *pos) {
+#ifdef __NR_copy_file_range
+    for (;;) {
+        loff_t in = *pos;
+        loff_t out = dst_base + *pos;
+        ssize_t n = syscall(__NR_copy_file_range, srcfd, &in, dstfd, &out, COPY_CHUNK, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOSYS)
+                have_copy_range = 0;
+            return -1;
+        }
+        if (n == 0)
+            return 0;
+        *pos += n;
+    }
+#else
+    have_copy_range = 0;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int copy_with_sendfile(int srcfd, int dstfd, off_t dst_base, off_t *pos) {
+    // sendfile writes at the current dst offset
+    if (lseek(dstfd, dst_base + *pos, SEEK_SET) != dst_base + *pos)
+        return -1;
+    for (;;) {
+        off_t in = *pos;
+        ssize_t n = sendfile(dstfd, srcfd, &in, COPY_CHUNK);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOSYS)
+                have_sendfile = 0;
+            return -1;
+        }
+        if (n == 0)
+            return 0;
+        *pos += n;
+    }
+}
+
+static int copy_with_readwrite(int srcfd, int dstfd, off_t dst_base, off_t *pos, off_t size) {
+    size_t len = COPY_BUFFER_MAX;
+    // small files don't need a megabyte each
+    if (size >= 0 && size < COPY_BUFFER_MAX)
+        len = ((size_t)size + COPY_BUFFER_ALIGN - 1) & ~(size_t)(COPY_BUFFER_ALIGN - 1);
+    if (len == 0)
+        len = COPY_BUFFER_ALIGN;
+    void *buf;
+    if (posix_memalign(&buf, COPY_BUFFER_ALIGN, len)) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int ret = 0;
+    for (;;) {
+        ssize_t n = pread(srcfd, buf, len, *pos);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = -1;
+            break;
+        }
+        if (n == 0)
+            break;
+        ssize_t written = 0;
+        while (written < n) {
+            ssize_t w = pwrite(dstfd, (char*)buf + written, n - written, dst_base + *pos + written);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0) {
+                if (w == 0)
+                    errno = EIO;
+                ret = -1;
+                break;
+            }
+            written += w;
+        }
+        if (ret)
+            break;
+        *pos += n;
+    }
+    free(buf);
+    return ret;
+}
+
+// Copies all of |srcfd| to |dstfd| at |dst_base|, returns the number of
+// bytes copied in |*copied|.
+static int copy_fds(int srcfd, int dstfd, off_t dst_base, off_t size, copy_method method, off_t *copied) {
+    off_t pos = 0;
+    int ret;
+    *copied = 0;
+    switch (method) {
+        case COPY_REFLINK:
+            if ((ret = ioctl(dstfd, FICLONE, srcfd)) == 0)
+                *copied = size;
+            return ret;
+        case COPY_RANGE:
+            ret = copy_with_range(srcfd, dstfd, dst_base, &pos);
+            break;
+        case COPY_SENDFILE:
+            ret = copy_with_sendfile(srcfd, dstfd, dst_base, &pos);
+            break;
+        case COPY_READWRITE:
+            ret = copy_with_readwrite(srcfd, dstfd, dst_base, &pos, size);
+            break;
+        default:
+            // shares the extents on btrfs/xfs/f2fs-like filesystems, no
+            // data moves; only whole files can be cloned this way
+            if (dst_base == 0 && size > 0 && ioctl(dstfd, FICLONE, srcfd) == 0) {
+                *copied = size;
+                return 0;
+            }
+            // anything that fails part way is picked up by the next method
+            // at |pos|
+            ret = -1;
+            if (have_copy_range)
+                ret = copy_with_range(srcfd, dstfd, dst_base, &pos);
+            if (ret && have_sendfile)
+                ret = copy_with_sendfile(srcfd, dstfd, dst_base, &pos);
+            if (ret)
+                ret = copy_with_readwrite(srcfd, dstfd, dst_base, &pos, size - pos);
+            break;
+    }
+    *copied = pos;
+    return ret;
+}
+
+int copy_file_with(const char *src, const char *dst, copy_method method) {
+    if (src == NULL)
+        return 1;
+    if (dst == NULL)
+        return 2;
+
+    if (method == COPY_LINK) {
+        unlink(dst);
+        if (link(src, dst) == 0)
+            return 0;
+        method = COPY_AUTO;
+    }
+
+    int srcfd = open(src, O_RDONLY);
+    if (srcfd < 0)
+        return 3;
+
+    int dstfd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (dstfd < 0) {
+        close(srcfd);
+        return 4;
+    }
+
+    struct stat st;
+    off_t size = fstat(srcfd, &st) == 0 ? st.st_size : -1;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(srcfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    int ret = 0;
+    off_t copied;
+    if (copy_fds(srcfd, dstfd, 0, size, method, &copied))
+        ret = 5;
+    // close reports delayed write errors on some filesystems
+    if (close(dstfd) && !ret)
+        ret = 6;
+    close(srcfd);
+
+    if (ret)
+        unlink(dst);
+    return ret;
+}
+
+int copy_file_append(const char *src, int dstfd, off_t *offset) {
+    int srcfd = open(src, O_RDONLY);
+    if (srcfd < 0)
+        return 3;
+    struct stat st;
+    off_t size = fstat(srcfd, &st) == 0 ? st.st_size : -1;
+    off_t copied;
+    int ret = copy_fds(srcfd, dstfd, *offset, size, COPY_AUTO, &copied) ? 5 : 0;
+    *offset += copied;
+    close(srcfd);
+    return ret;
+}
+
+const char* copy_method_name(copy_method method) {
+    switch (method) {
+        case COPY_AUTO: return "auto";
+        case COPY_LINK: return "link";
+        case COPY_REFLINK: return "reflink";
+        case COPY_RANGE: return "copy_file_range";
+        case COPY_SENDFILE: return "sendfile";
+        case COPY_READWRITE: return "read/write";
+    }
+    return "unknown";
+}
@@ -0,0 +1,33 @@
+#ifndef DEDUPE_COPYFILE_H
+#define DEDUPE_COPYFILE_H
+
+#include <sys/types.h>
+
+typedef enum {
+    // reflink, then copy_file_range, sendfile and read/write
+    COPY_AUTO,
+    // hard link, falling back to COPY_AUTO when src and dst are on
+    // different or link-less (vfat) filesystems. The copy shares its inode
+    // with |src|, so it is only for files nobody changes afterwards.
+    COPY_LINK,
+    // a single method with no fallback, for benchmarking
+    COPY_REFLINK,
+    COPY_RANGE,
+    COPY_SENDFILE,
+    COPY_READWRITE,
+} copy_method;
+
+// Copies |src| to |dst|, replacing it. Returns 0 on success; on failure
+// nothing is left at |dst|.
+int copy_file_with(const char* src, const char* dst, copy_method method);
+
+static inline int copy_file(const char* src, const char* dst) {
+    return copy_file_with(src, dst, COPY_AUTO);
+}
+
+// Appends |src| to |dstfd| at |*offset| and advances it.
+int copy_file_append(const char* src, int dstfd, off_t* offset);
+
+const char* copy_method_name(copy_method method);
+
+#endif
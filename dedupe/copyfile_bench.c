@@ -0,0 +1,136 @@
+// Compares the copy_file methods on a synthetic tree.
+//
+//   copyfile_bench work_dir [file_count] [max_file_kb]
+//
+// The source files are created under work_dir/src and stay in the page
+// cache, so this measures the cost of moving data from cache to the
+// destination, including a final sync, like a restore from a warm blob dir.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "copyfile.h"
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Mostly small files with a few large ones, like /data.
+static size_t pick_size(size_t max) {
+    uint32_t r = rng() % 100;
+    if (r < 70)
+        return rng() % 16384;
+    if (r < 95)
+        return rng() % (max / 8 + 1);
+    return max / 2 + rng() % (max / 2 + 1);
+}
+
+static int write_file(const char *path, size_t size) {
+    static char buf[65536];
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    while (size > 0) {
+        size_t n = size < sizeof(buf) ? size : sizeof(buf);
+        size_t i;
+        for (i = 0; i < n; i += 4) {
+            uint32_t v = rng();
+            memcpy(buf + i, &v, n - i < 4 ? n - i : 4);
+        }
+        if (write(fd, buf, n) != (ssize_t)n) {
+            close(fd);
+            return -1;
+        }
+        size -= n;
+    }
+    return close(fd);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s work_dir [file_count] [max_file_kb]\n", argv[0]);
+        return 1;
+    }
+    const char *work = argv[1];
+    int count = argc > 2 ? atoi(argv[2]) : 2000;
+    size_t max = (argc > 3 ? (size_t)atoi(argv[3]) : 65536) * 1024;
+    char path[PATH_MAX];
+    char dst[PATH_MAX];
+    uint64_t total = 0;
+    int i;
+
+    mkdir(work, 0755);
+    snprintf(path, sizeof(path), "%s/src", work);
+    mkdir(path, 0755);
+    for (i = 0; i < count; i++) {
+        size_t size = pick_size(max);
+        snprintf(path, sizeof(path), "%s/src/%d", work, i);
+        if (write_file(path, size)) {
+            fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        total += size;
+    }
+    sync();
+    printf("%d files, %llu bytes\n", count, (unsigned long long)total);
+
+    static const copy_method methods[] = {
+        COPY_READWRITE, COPY_SENDFILE, COPY_RANGE, COPY_REFLINK, COPY_LINK, COPY_AUTO,
+    };
+    size_t m;
+    for (m = 0; m < sizeof(methods) / sizeof(methods[0]); m++) {
+        snprintf(dst, sizeof(dst), "%s/dst", work);
+        mkdir(dst, 0755);
+
+        double start = now();
+        int failed = 0;
+        for (i = 0; i < count && !failed; i++) {
+            snprintf(path, sizeof(path), "%s/src/%d", work, i);
+            snprintf(dst, sizeof(dst), "%s/dst/%d", work, i);
+            failed = copy_file_with(path, dst, methods[m]) != 0;
+        }
+        sync();
+        double elapsed = now() - start;
+
+        if (failed)
+            printf("%-16s unsupported\n", copy_method_name(methods[m]));
+        else
+            printf("%-16s %8.3fs %10.1f MB/s\n", copy_method_name(methods[m]), elapsed,
+                   total / 1048576.0 / elapsed);
+
+        for (i = 0; i < count; i++) {
+            snprintf(dst, sizeof(dst), "%s/dst/%d", work, i);
+            unlink(dst);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "%s/src/%d", work, i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/src", work);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/dst", work);
+    rmdir(path);
+    return 0;
+}
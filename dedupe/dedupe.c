@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <dirent.h>
+#include <libgen.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,6 +14,7 @@
 #include <limits.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <signal.h>
@@ -23,50 +25,76 @@
 
 #include <selinux/selinux.h>
 
-#define DEDUPE_VERSION 2
-#define ARRAY_CAPACITY 1000
-
-static int copy_file(const char *src, const char *dst) {
-    char buf[4096];
-    int dstfd, srcfd, bytes_read, bytes_written, total_read = 0;
-    if (src == NULL)
-        return 1;
-    if (dst == NULL)
-        return 2;
-
-    srcfd = open(src, O_RDONLY);
-    if (srcfd < 0)
-        return 3;
-
-    dstfd = open(dst, O_RDWR | O_CREAT | O_TRUNC, 0666);
-    if (dstfd < 0) {
-        close(srcfd);
-        return 4;
-    }
-
-    while (bytes_read = read(srcfd, buf, 4096)) {
-        total_read += bytes_read;
-        if (write(dstfd, buf, bytes_read) != bytes_read)
-            return 5;
-    }
-
-    close(dstfd);
-    close(srcfd);
-
-    return 0;
-}
+#include "blobcodec.h"
+#include "chunker.h"
+#include "copyfile.h"
+#include "digestset.h"
+#include "hashcache.h"
+#include "manifest.h"
+
+#define GC_EXPECTED_BLOBS 4096
+
+// Manifest entries are produced by the directory walker in order, while
+// regular files are hashed and copied into the blob dir by a pool of
+// workers. Entries are written out strictly in walk order once their blob
+// is stored, so the manifest is identical to a single threaded run.
+#define MAX_PENDING_ENTRIES 1024
+#define MAX_WORKERS 16
+// stored next to the blob dir, so gc never sees it
+#define HASH_CACHE_SUFFIX ".hashcache"
+// how much of a new blob is test compressed to pick its codec
+#define CODEC_PROBE_SIZE (64 * 1024)
+
+struct dedupe_entry {
+    char type;
+    struct stat st;
+    char *path;
+    char *selabel;
+    char *link;     // symlinks only
+    int store;      // regular file whose blob still has to be stored
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    int codec;              // how the blob was stored
+    unsigned char *chunks;  // chunk digests, when stored in chunks
+    unsigned char *chunk_codecs;
+    uint32_t chunk_count;
+    int done;
+    int ret;
+    struct dedupe_entry *next;
+    struct dedupe_entry *next_work;
+};
 
 typedef struct DEDUPE_STORE_CONTEXT {
     char blob_dir[PATH_MAX];
-    FILE *output_manifest;
+    manifest_writer *output_manifest;
     const char** excludes;
     int exclude_count;
+    hash_cache *cache;
+    // files of at least max_size are stored in chunks when set
+    int chunking;
+    chunker chunker;
+    // new blobs that compress well are stored with zlib
+    int compress;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t workers[MAX_WORKERS];
+    int worker_count;
+    // all entries not yet written to the manifest, in walk order
+    struct dedupe_entry *head;
+    struct dedupe_entry *tail;
+    // files waiting for a worker
+    struct dedupe_entry *work_head;
+    struct dedupe_entry *work_tail;
+    int pending;
+    int finishing;
+    int error;
+    int next_worker_id;
 };
 
 static void usage(char** argv) {
-    fprintf(stderr, "usage: %s c input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
+    fprintf(stderr, "usage: %s c [-z] [-C avg_chunk_kb] input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
     fprintf(stderr, "usage: %s x input_manifest blob_dir output_directory\n", argv[0]);
-    fprintf(stderr, "usage: %s gc blob_dir input_manifests...\n", argv[0]);
+    fprintf(stderr, "usage: %s gc [-n] blob_dir input_manifests...\n", argv[0]);
 }
 
 static void do_sha256sum(FILE *mfile, unsigned char *rptr) {
@@ -98,74 +126,413 @@ static int do_sha256sum_file(const char* filename, unsigned char *rptr) {
 
 static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s);
 
-void print_stat(struct DEDUPE_STORE_CONTEXT *context, char type, struct stat st, char *selabel, const char *f) {
-    fprintf(context->output_manifest, "%c\t%o\t%lu\t%lu\t%s\t%lu\t%lu\t%lu\t%s\t", type, st.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID), st.st_uid, st.st_gid, selabel, st.st_atime, st.st_mtime, st.st_ctime, f);
-}
-
-static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* f) {
-    printf("%s\n", f);
-    unsigned char sumdata[SHA256_DIGEST_LENGTH];
-    int ret;
-    if (ret = do_sha256sum_file(f, sumdata)) {
-        fprintf(stderr, "Error calculating sha256sum of %s\n", f);
-        return ret;
-    }
-    char psum[128];
-    int j;
-    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
-        sprintf(&psum[(j*2)], "%02x", (int)sumdata[j]);
-    psum[(SHA256_DIGEST_LENGTH * 2)] = '\0';
-
-    // if a hash is abcdefg,
-    // the output blob name is abc/defg
-    // this is to get around vfat having a 64k directory size limit (usually around 20k files)
-    char out_blob[PATH_MAX];
-    char tmp_out_blob[PATH_MAX];
-    char key[SHA256_DIGEST_LENGTH * 2 + 2];
-    // int i = 0;
-    // int keyIndex = 0;
-    // while (psum[i]) {
-    //     key[keyIndex] = psum[i];
-    //     i++;
-    //     keyIndex++;
-    //     if (i % 2 == 0 && psum[i]) {
-    //         key[keyIndex] = '/';
-    //         keyIndex++;
-    //     }
-    // }
-    strcpy(key, psum);
-    key[3] = '/';
-    key[4] = NULL;
-    strcat(key, psum + 3);
+// Fills |out_blob| with the blob path of |digest| and makes sure its shard
+// dir exists.
+static void blob_path(struct DEDUPE_STORE_CONTEXT *context, const unsigned char *digest, char *out_blob) {
+    char key[BLOB_KEY_SIZE];
+    digest_to_key(digest, key);
     sprintf(out_blob, "%s/%s", context->blob_dir, key);
-    sprintf(tmp_out_blob, "%s.tmp", out_blob);
     //when BUILD_HOST_EXECUTABLE, dirname(out_blob) will change out_blob
     char out_blob_dir[PATH_MAX];
     strcpy(out_blob_dir, out_blob);
     mkdir(dirname(out_blob_dir), S_IRWXU | S_IRWXG | S_IRWXO);
+}
 
-    // don't copy the file if it exists? not quite sure how I feel about this.
-    int size = (int)st.st_size;
+// don't copy the file if it exists? not quite sure how I feel about this.
+// Returns the codec of an existing blob for |out_blob|, or -1. Raw blobs
+// are verified by size; compressed ones can't be checked that cheaply, but
+// like all blobs only ever appear by an atomic rename.
+static int find_blob(const char *out_blob, off_t size) {
     struct stat file_info;
+    char path[PATH_MAX];
     // verify the file exists and is of the same size
-    int file_ok = stat(out_blob, &file_info) == 0;
-    if (file_ok) {
-        int existing_size = file_info.st_size;
-        if (existing_size != size)
-            file_ok = 0;
+    if (stat(out_blob, &file_info) == 0 && file_info.st_size == size)
+        return BLOB_CODEC_RAW;
+    snprintf(path, sizeof(path), "%s%s", out_blob, blob_codec_suffix(BLOB_CODEC_ZLIB));
+    if (stat(path, &file_info) == 0)
+        return BLOB_CODEC_ZLIB;
+    return -1;
+}
+
+// Picks the codec for a new blob from its first bytes.
+static int choose_codec(struct DEDUPE_STORE_CONTEXT *context, const unsigned char *sample, size_t len) {
+    if (!context->compress)
+        return BLOB_CODEC_RAW;
+    return blob_codec_probe(sample, len < CODEC_PROBE_SIZE ? len : CODEC_PROBE_SIZE);
+}
+
+// Hashes |f| and copies it into the blob dir unless an identical blob is
+// already there. |sumdata| receives the sha256 of the file and |codec| how
+// its blob is stored.
+static int store_blob(struct DEDUPE_STORE_CONTEXT *context, const char* f, const struct stat *st, unsigned char* sumdata, int *codec, int worker) {
+    int ret;
+    // unchanged since the last backup? then trust the cached hash
+    if (context->cache == NULL || !hash_cache_lookup(context->cache, st, sumdata)) {
+        if (ret = do_sha256sum_file(f, sumdata)) {
+            fprintf(stderr, "Error calculating sha256sum of %s\n", f);
+            return ret;
+        }
+    }
+    if (context->cache != NULL)
+        hash_cache_insert(context->cache, st, sumdata);
+    char out_blob[PATH_MAX];
+    char tmp_out_blob[PATH_MAX];
+    blob_path(context, sumdata, out_blob);
+    // per worker temp name, two workers may be storing the same content
+    sprintf(tmp_out_blob, "%s.tmp%d", out_blob, worker);
+
+    if ((*codec = find_blob(out_blob, st->st_size)) >= 0)
+        return 0;
+
+    *codec = BLOB_CODEC_RAW;
+    if (context->compress) {
+        unsigned char sample[CODEC_PROBE_SIZE];
+        int fd = open(f, O_RDONLY);
+        ssize_t len = fd < 0 ? -1 : pread(fd, sample, sizeof(sample), 0);
+        if (fd >= 0)
+            close(fd);
+        if (len > 0)
+            *codec = choose_codec(context, sample, len);
     }
-    if (!file_ok) {
+    if (*codec == BLOB_CODEC_ZLIB) {
+        strcat(out_blob, blob_codec_suffix(*codec));
+        ret = blob_compress_file(f, tmp_out_blob);
+    } else {
         // copy to the tmp file
-        if ((ret = copy_file(f, tmp_out_blob)) || (ret = rename(tmp_out_blob, out_blob))) {
-            fprintf(stderr, "Error copying blob %s\n", f);
-            return ret;
+        ret = copy_file(f, tmp_out_blob);
+    }
+    if (ret || (ret = rename(tmp_out_blob, out_blob))) {
+        fprintf(stderr, "Error copying blob %s\n", f);
+        return ret;
+    }
+
+    return 0;
+}
+
+static int write_fully(int fd, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int store_chunk(struct DEDUPE_STORE_CONTEXT *context, const unsigned char *data, size_t len,
+                       unsigned char *digest, unsigned char *codec, int worker) {
+    char out_blob[PATH_MAX];
+    char tmp_out_blob[PATH_MAX];
+    int found;
+    SHA256(data, len, digest);
+    blob_path(context, digest, out_blob);
+    if ((found = find_blob(out_blob, len)) >= 0) {
+        *codec = found;
+        return 0;
+    }
+
+    sprintf(tmp_out_blob, "%s.tmp%d", out_blob, worker);
+    *codec = choose_codec(context, data, len);
+    if (*codec == BLOB_CODEC_ZLIB) {
+        strcat(out_blob, blob_codec_suffix(*codec));
+        if (blob_compress_data(data, len, tmp_out_blob) || rename(tmp_out_blob, out_blob)) {
+            unlink(tmp_out_blob);
+            return 1;
         }
+        return 0;
     }
 
-    fprintf(context->output_manifest, "%s\t%d\t\n", key, size);
+    int fd = open(tmp_out_blob, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return 1;
+    int ret = write_fully(fd, data, len);
+    if (close(fd) || ret || rename(tmp_out_blob, out_blob)) {
+        unlink(tmp_out_blob);
+        return 1;
+    }
     return 0;
 }
 
+// Splits |f| into content defined chunks and stores each one as a blob, so
+// a small change to a large file only stores the chunks around it.
+static int store_chunks(struct DEDUPE_STORE_CONTEXT *context, struct dedupe_entry *entry, int worker) {
+    const chunker *c = &context->chunker;
+    size_t capacity = c->max_size * 2;
+    unsigned char *buf = malloc(capacity);
+    uint32_t chunk_capacity = (uint32_t)(entry->st.st_size / c->avg_size) + 16;
+    int fd = open(entry->path, O_RDONLY);
+    size_t len = 0;
+    int eof = 0;
+    int ret = 0;
+
+    entry->chunks = malloc((size_t)chunk_capacity * SHA256_DIGEST_LENGTH);
+    entry->chunk_codecs = malloc(chunk_capacity);
+    entry->chunk_count = 0;
+    if (fd < 0 || buf == NULL || entry->chunks == NULL || entry->chunk_codecs == NULL) {
+        fprintf(stderr, "Unable to open file: %s\n", entry->path);
+        ret = 1;
+        goto out;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    while (!eof || len > 0) {
+        // keep at least one max sized chunk buffered
+        while (!eof && len < capacity) {
+            ssize_t n = read(fd, buf + len, capacity - len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0) {
+                fprintf(stderr, "Error reading %s\n", entry->path);
+                ret = 1;
+                goto out;
+            }
+            if (n == 0)
+                eof = 1;
+            len += n;
+        }
+
+        size_t pos = 0;
+        size_t chunk_len;
+        while (pos < len && (chunk_len = chunker_next(c, buf + pos, len - pos, eof)) > 0) {
+            if (entry->chunk_count == chunk_capacity) {
+                unsigned char *chunks = realloc(entry->chunks, (size_t)chunk_capacity * 2 * SHA256_DIGEST_LENGTH);
+                if (chunks != NULL)
+                    entry->chunks = chunks;
+                unsigned char *codecs = chunks == NULL ? NULL : realloc(entry->chunk_codecs, chunk_capacity * 2);
+                if (codecs == NULL) {
+                    fprintf(stderr, "Out of memory\n");
+                    ret = 1;
+                    goto out;
+                }
+                entry->chunk_codecs = codecs;
+                chunk_capacity *= 2;
+            }
+            if (store_chunk(context, buf + pos, chunk_len,
+                            entry->chunks + (size_t)entry->chunk_count * SHA256_DIGEST_LENGTH,
+                            entry->chunk_codecs + entry->chunk_count, worker)) {
+                fprintf(stderr, "Error copying blob %s\n", entry->path);
+                ret = 1;
+                goto out;
+            }
+            entry->chunk_count++;
+            pos += chunk_len;
+            // refill before the chunker runs short of lookahead
+            if (!eof && len - pos < c->max_size)
+                break;
+        }
+        memmove(buf, buf + pos, len - pos);
+        len -= pos;
+    }
+
+out:
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    return ret;
+}
+
+static void* store_worker(void* cookie) {
+    struct DEDUPE_STORE_CONTEXT *context = (struct DEDUPE_STORE_CONTEXT*)cookie;
+    int worker;
+
+    pthread_mutex_lock(&context->lock);
+    worker = context->next_worker_id++;
+    for (;;) {
+        while (context->work_head == NULL && !context->finishing)
+            pthread_cond_wait(&context->cond, &context->lock);
+        struct dedupe_entry *entry = context->work_head;
+        if (entry == NULL)
+            break;
+        context->work_head = entry->next_work;
+        if (context->work_head == NULL)
+            context->work_tail = NULL;
+        int skip = context->error;
+        pthread_mutex_unlock(&context->lock);
+
+        // once something failed, drain the queue without doing more work
+        int ret;
+        if (skip)
+            ret = 1;
+        else if (context->chunking && entry->st.st_size >= context->chunker.max_size)
+            ret = store_chunks(context, entry, worker);
+        else
+            ret = store_blob(context, entry->path, &entry->st, entry->digest, &entry->codec, worker);
+
+        pthread_mutex_lock(&context->lock);
+        entry->ret = ret;
+        entry->done = 1;
+        if (ret)
+            context->error = 1;
+        pthread_cond_broadcast(&context->cond);
+    }
+    pthread_mutex_unlock(&context->lock);
+    return NULL;
+}
+
+static int default_worker_count() {
+    // storing and restoring is mostly waiting on I/O, so oversubscribe the
+    // cores a bit
+    long count = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    if (count < 2)
+        count = 2;
+    if (count > MAX_WORKERS)
+        count = MAX_WORKERS;
+    return (int)count;
+}
+
+static int start_workers(struct DEDUPE_STORE_CONTEXT *context) {
+    int count = default_worker_count();
+
+    pthread_mutex_init(&context->lock, NULL);
+    pthread_cond_init(&context->cond, NULL);
+    context->head = context->tail = NULL;
+    context->work_head = context->work_tail = NULL;
+    context->pending = 0;
+    context->finishing = 0;
+    context->error = 0;
+    context->worker_count = 0;
+    context->next_worker_id = 0;
+
+    pthread_mutex_lock(&context->lock);
+    while (context->worker_count < count) {
+        if (pthread_create(&context->workers[context->worker_count], NULL, store_worker, context))
+            break;
+        context->worker_count++;
+    }
+    pthread_mutex_unlock(&context->lock);
+
+    if (context->worker_count == 0) {
+        fprintf(stderr, "Unable to start workers\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Writes all leading entries that are complete. With |wait_all| set, blocks
+// until every queued entry has been written. Returns non-zero if any entry
+// failed to store.
+static int flush_entries(struct DEDUPE_STORE_CONTEXT *context, int wait_all) {
+    int ret = 0;
+    pthread_mutex_lock(&context->lock);
+    for (;;) {
+        struct dedupe_entry *entry = context->head;
+        if (entry == NULL)
+            break;
+        if (!entry->done) {
+            if (!wait_all)
+                break;
+            pthread_cond_wait(&context->cond, &context->lock);
+            continue;
+        }
+        context->head = entry->next;
+        if (context->head == NULL)
+            context->tail = NULL;
+        context->pending--;
+
+        if (entry->ret) {
+            ret = entry->ret;
+        } else if (!ret) {
+            int added;
+            if (entry->chunks != NULL)
+                added = manifest_writer_add_chunks(context->output_manifest, &entry->st, entry->selabel,
+                                                   entry->path, entry->chunks, entry->chunk_codecs,
+                                                   entry->chunk_count);
+            else
+                added = manifest_writer_add(context->output_manifest, entry->type, &entry->st, entry->selabel,
+                                            entry->path, entry->link, entry->store ? entry->digest : NULL,
+                                            entry->codec);
+            if (added) {
+                fprintf(stderr, "Error adding %s to the manifest\n", entry->path);
+                ret = 1;
+            }
+        }
+        free(entry->path);
+        free(entry->selabel);
+        free(entry->link);
+        free(entry->chunks);
+        free(entry->chunk_codecs);
+        free(entry);
+    }
+    pthread_mutex_unlock(&context->lock);
+    return ret;
+}
+
+// Queues a manifest entry. Regular files have their blob stored by a worker
+// before the entry can be written.
+static int queue_entry(struct DEDUPE_STORE_CONTEXT *context, char type, const struct stat *st,
+                       const char *selabel, const char *path, const char *link) {
+    struct dedupe_entry *entry = calloc(1, sizeof(struct dedupe_entry));
+    if (entry == NULL)
+        goto oom;
+    entry->type = type;
+    entry->st = *st;
+    entry->store = type == 'f';
+    entry->done = !entry->store;
+    if ((entry->path = strdup(path)) == NULL || (entry->selabel = strdup(selabel)) == NULL)
+        goto oom;
+    if (link != NULL && (entry->link = strdup(link)) == NULL)
+        goto oom;
+
+    pthread_mutex_lock(&context->lock);
+    if (context->tail != NULL)
+        context->tail->next = entry;
+    else
+        context->head = entry;
+    context->tail = entry;
+    context->pending++;
+    if (entry->store) {
+        if (context->work_tail != NULL)
+            context->work_tail->next_work = entry;
+        else
+            context->work_head = entry;
+        context->work_tail = entry;
+        pthread_cond_broadcast(&context->cond);
+    }
+    // bound memory use when the walker is far ahead of the workers
+    while (context->pending >= MAX_PENDING_ENTRIES && context->head->done == 0)
+        pthread_cond_wait(&context->cond, &context->lock);
+    pthread_mutex_unlock(&context->lock);
+
+    return flush_entries(context, 0);
+
+oom:
+    fprintf(stderr, "Out of memory\n");
+    if (entry != NULL) {
+        free(entry->path);
+        free(entry->selabel);
+        free(entry);
+    }
+    return 1;
+}
+
+// Waits for all queued entries, stops the workers and returns non-zero if
+// anything failed.
+static int finish_workers(struct DEDUPE_STORE_CONTEXT *context) {
+    int i;
+    int ret = flush_entries(context, 1);
+
+    pthread_mutex_lock(&context->lock);
+    context->finishing = 1;
+    pthread_cond_broadcast(&context->cond);
+    pthread_mutex_unlock(&context->lock);
+    for (i = 0; i < context->worker_count; i++)
+        pthread_join(context->workers[i], NULL);
+
+    pthread_mutex_destroy(&context->lock);
+    pthread_cond_destroy(&context->cond);
+    return ret;
+}
+
+static int store_file(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char *selabel, const char* f) {
+    printf("%s\n", f);
+    return queue_entry(context, 'f', &st, selabel, f, NULL);
+}
+
 static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* d) {
     char full_path[PATH_MAX];
     printf("%s\n", d);
@@ -206,40 +573,41 @@ static int store_dir(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const
     return 0;
 }
 
-static int store_link(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* l) {
+static int store_link(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char *selabel, const char* l) {
     printf("%s\n", l);
     char link[PATH_MAX];
-    int ret = readlink(l, link, PATH_MAX);
+    int ret = readlink(l, link, PATH_MAX - 1);
     if (ret < 0) {
         fprintf(stderr, "Error reading symlink\n");
         return errno;
     }
     link[ret] = '\0';
-    fprintf(context->output_manifest, "%s\t\n", link);
-    return 0;
+    return queue_entry(context, 'l', &st, selabel, l, link);
 }
 
 static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const char* s) {
     char* selabel = NULL;
+    int ret;
     if (lgetfilecon(s, &selabel) < 0) {
         fprintf(stderr, "Can't get %s context\n", s);
         selabel = strdup("unlabel");
     }
     if (S_ISREG(st.st_mode)) {
-        print_stat(context, 'f', st, selabel, s);
+        ret = store_file(context, st, selabel, s);
         freecon(selabel);
-        return store_file(context, st, s);
+        return ret;
     }
     else if (S_ISDIR(st.st_mode)) {
-        print_stat(context, 'd', st, selabel, s);
-        fprintf(context->output_manifest, "\n");
+        ret = queue_entry(context, 'd', &st, selabel, s, NULL);
         freecon(selabel);
+        if (ret)
+            return ret;
         return store_dir(context, st, s);
     }
     else if (S_ISLNK(st.st_mode)) {
-        print_stat(context, 'l', st, selabel, s);
+        ret = store_link(context, st, selabel, s);
         freecon(selabel);
-        return store_link(context, st, s);
+        return ret;
     }
     else {
         fprintf(stderr, "Skipping special: %s\n", s);
@@ -248,82 +616,326 @@ static int store_st(struct DEDUPE_STORE_CONTEXT *context, struct stat st, const
     }
 }
 
-static char* tokenize(char *out, const char* line, const char sep) {
-    while (*line != sep) {
-        if (*line == '\0') {
-            return NULL;
-        }
+// Restores run in three passes: directories and symlinks are created in
+// manifest order, regular files are copied by a pool of workers, and then
+// ownership, modes, labels and times are applied in a final pass. Directory
+// times are set last, once nothing more is created inside them.
+struct restore_entry {
+    char type;
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    long atime;
+    long mtime;
+    char *path;
+    char *selabel;
+    char *link;     // symlinks only
+    char *key;      // files only, NULL when chunked
+    int codec;
+    unsigned char *chunks;
+    unsigned char *chunk_codecs;
+    uint32_t chunk_count;
+};
+
+struct restore_context {
+    char blob_dir[PATH_MAX];
+    struct restore_entry *entries;
+    int count;
+    pthread_mutex_t lock;
+    int next;       // next entry the workers look at
+    int error;
+};
 
-        *out = *line;
-        out++;
-        line++;
+static void free_restore_entries(struct restore_context *context) {
+    int i;
+    for (i = 0; i < context->count; i++) {
+        free(context->entries[i].path);
+        free(context->entries[i].selabel);
+        free(context->entries[i].link);
+        free(context->entries[i].key);
+        free(context->entries[i].chunks);
+        free(context->entries[i].chunk_codecs);
     }
+    free(context->entries);
+    context->entries = NULL;
+    context->count = 0;
+}
 
-    *out = '\0';
-    // resume at the next char
-    return ++line;
+static int load_restore_entries(struct restore_context *context, manifest_reader *reader) {
+    int capacity = 1024;
+    manifest_entry entry;
+    int status;
+    context->entries = malloc(capacity * sizeof(struct restore_entry));
+    context->count = 0;
+    if (context->entries == NULL)
+        goto oom;
+    while ((status = manifest_next(reader, &entry)) > 0) {
+        if (entry.type != 'f' && entry.type != 'd' && entry.type != 'l') {
+            fprintf(stderr, "Unknown type %c\n", entry.type);
+            return 1;
+        }
+        if (context->count == capacity) {
+            struct restore_entry *grown = realloc(context->entries, capacity * 2 * sizeof(struct restore_entry));
+            if (grown == NULL)
+                goto oom;
+            context->entries = grown;
+            capacity *= 2;
+        }
+        struct restore_entry *e = &context->entries[context->count++];
+        memset(e, 0, sizeof(*e));
+        e->type = entry.type;
+        e->mode = entry.mode;
+        e->uid = entry.uid;
+        e->gid = entry.gid;
+        e->atime = entry.atime;
+        e->mtime = entry.mtime;
+        if ((e->path = strdup(entry.path)) == NULL || (e->selabel = strdup(entry.selabel)) == NULL)
+            goto oom;
+        if (e->type == 'l' && (e->link = strdup(entry.link)) == NULL)
+            goto oom;
+        if (e->type == 'f' && entry.chunks != NULL) {
+            size_t size = (size_t)entry.chunk_count * SHA256_DIGEST_LENGTH;
+            if ((e->chunks = malloc(size + 1)) == NULL || (e->chunk_codecs = malloc(entry.chunk_count + 1)) == NULL)
+                goto oom;
+            memcpy(e->chunks, entry.chunks, size);
+            memcpy(e->chunk_codecs, entry.chunk_codecs, entry.chunk_count);
+            e->chunk_count = entry.chunk_count;
+        }
+        else if (e->type == 'f' && (e->key = strdup(entry.key)) == NULL)
+            goto oom;
+        e->codec = entry.codec;
+    }
+    return status < 0 ? -1 : 0;
+
+oom:
+    fprintf(stderr, "Out of memory\n");
+    return 1;
 }
 
-static int dec_to_oct(int dec) {
+// Concatenates the chunk blobs of |e| into its file.
+static int restore_chunks(struct restore_context *context, const struct restore_entry *e) {
+    char blob_file[PATH_MAX];
+    char key[BLOB_KEY_SIZE];
+    off_t offset = 0;
+    uint32_t i;
     int ret = 0;
-    int mult = 1;
-    while (dec != 0) {
-        int rem = dec % 10;
-        ret += (rem * mult);
-        dec /= 10;
-        mult *= 8;
+    int fd = open(e->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return 4;
+    for (i = 0; i < e->chunk_count && !ret; i++) {
+        digest_to_key(e->chunks + (size_t)i * SHA256_DIGEST_LENGTH, key);
+        snprintf(blob_file, sizeof(blob_file), "%s/%s%s", context->blob_dir, key,
+                 blob_codec_suffix(e->chunk_codecs[i]));
+        if (e->chunk_codecs[i] == BLOB_CODEC_ZLIB)
+            ret = blob_decompress_append(blob_file, fd, &offset) ? 5 : 0;
+        else
+            ret = copy_file_append(blob_file, fd, &offset);
     }
+    if (close(fd) && !ret)
+        ret = 6;
+    if (ret)
+        unlink(e->path);
+    return ret;
+}
 
+static int restore_compressed(struct restore_context *context, const struct restore_entry *e) {
+    char blob_file[PATH_MAX];
+    off_t offset = 0;
+    int ret = 0;
+    int fd = open(e->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return 4;
+    snprintf(blob_file, sizeof(blob_file), "%s/%s%s", context->blob_dir, e->key, blob_codec_suffix(e->codec));
+    if (blob_decompress_append(blob_file, fd, &offset))
+        ret = 5;
+    if (close(fd) && !ret)
+        ret = 6;
+    if (ret)
+        unlink(e->path);
     return ret;
 }
 
-struct array {
-    void** data;
-    int size;
-    int capacity;
-};
+static void* restore_worker(void* cookie) {
+    struct restore_context *context = (struct restore_context*)cookie;
+    for (;;) {
+        pthread_mutex_lock(&context->lock);
+        while (context->next < context->count && context->entries[context->next].type != 'f')
+            context->next++;
+        if (context->error || context->next >= context->count) {
+            pthread_mutex_unlock(&context->lock);
+            break;
+        }
+        struct restore_entry *e = &context->entries[context->next++];
+        pthread_mutex_unlock(&context->lock);
+
+        char blob_file[PATH_MAX];
+        int ret;
+        if (e->chunks != NULL) {
+            ret = restore_chunks(context, e);
+        } else if (e->codec == BLOB_CODEC_ZLIB) {
+            ret = restore_compressed(context, e);
+        } else {
+            snprintf(blob_file, sizeof(blob_file), "%s/%s", context->blob_dir, e->key);
+            // a reflink where the filesystem has them; never a hard link,
+            // the final pass changes owner and mode of what it restores
+            ret = copy_file(blob_file, e->path);
+        }
+        if (ret) {
+            fprintf(stderr, "Unable to copy file %s\n", e->path);
+            pthread_mutex_lock(&context->lock);
+            if (!context->error)
+                context->error = ret;
+            pthread_mutex_unlock(&context->lock);
+            break;
+        }
+        printf("%s\n", e->path);
+    }
+    return NULL;
+}
 
-static void array_init(struct array* arr, int capacity) {
-    arr->data = malloc(sizeof(void*) * capacity);
-    assert(arr->data != NULL);
-    arr->size = 0;
-    arr->capacity = capacity;
+static int restore_files(struct restore_context *context) {
+    pthread_t workers[MAX_WORKERS];
+    int count = default_worker_count();
+    int started = 0;
+    int i;
+
+    pthread_mutex_init(&context->lock, NULL);
+    context->next = 0;
+    context->error = 0;
+    for (i = 0; i < count; i++) {
+        if (pthread_create(&workers[started], NULL, restore_worker, context))
+            break;
+        started++;
+    }
+    // no threads? do it here
+    if (started == 0)
+        restore_worker(context);
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&context->lock);
+    return context->error;
 }
 
-static void array_free(struct array* arr, int free_members) {
-    if (free_members) {
-        int i;
-        for (i = 0; i < arr->size; i++) {
-            free(arr->data[i]);
+static void restore_times(const struct restore_entry *e) {
+    struct timespec times[2];
+    times[0].tv_sec = e->atime;
+    times[0].tv_nsec = 0;
+    times[1].tv_sec = e->mtime;
+    times[1].tv_nsec = 0;
+    utimensat(AT_FDCWD, e->path, times, AT_SYMLINK_NOFOLLOW);
+}
+
+static int restore_manifest(struct restore_context *context, int with_times) {
+    int i;
+    int ret;
+
+    for (i = 0; i < context->count; i++) {
+        struct restore_entry *e = &context->entries[i];
+        if (e->type == 'd') {
+            // the final mode may not allow creating the contents
+            mkdir(e->path, S_IRWXU);
+            printf("%s\n", e->path);
+        }
+        else if (e->type == 'l') {
+            symlink(e->link, e->path);
+            printf("%s\n", e->path);
         }
     }
 
-    if (arr->data != NULL) {
-        free(arr->data);
-        arr->data = NULL;
+    if (ret = restore_files(context))
+        return ret;
+
+    for (i = 0; i < context->count; i++) {
+        struct restore_entry *e = &context->entries[i];
+        if (e->type == 'l') {
+            // Android has no lchmod, and chmod follows symlinks
+            lchown(e->path, e->uid, e->gid);
+        }
+        else {
+            chown(e->path, e->uid, e->gid);
+            chmod(e->path, e->mode);
+        }
+        if (lsetfilecon(e->path, e->selabel) < 0) {
+            fprintf(stderr, "Can't setfilecon %s\n", e->path);
+        }
+        if (with_times && e->type != 'd')
+            restore_times(e);
+    }
+
+    // deepest first, though nothing is created past this point anyway
+    if (with_times) {
+        for (i = context->count - 1; i >= 0; i--) {
+            if (context->entries[i].type == 'd')
+                restore_times(&context->entries[i]);
+        }
     }
-    arr->size = 0;
-    arr->capacity = 0;
+    return 0;
 }
 
-static void array_add(struct array* arr, void* val) {
-    if (arr->size == arr->capacity) {
-        // Expand array
-        arr->capacity *= 2;
-        arr->data = realloc(arr->data, sizeof(void*) * arr->capacity);
-        assert(arr->data != NULL);
+struct gc_context {
+    digest_set *used;
+    int dry_run;
+    unsigned int deleted;
+    uint64_t reclaimed;
+};
+
+static int gc_add_used(const char *key, const unsigned char *digest, void *cookie) {
+    struct gc_context *gc = (struct gc_context*)cookie;
+    if (digest == NULL) {
+        fprintf(stderr, "Unexpected blob name: %s\n", key);
+        return 1;
+    }
+    if (digest_set_insert(gc->used, digest, 0, NULL) < 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Blobs are "abc/defg...", anything else in the blob dir is garbage
+// (e.g. temp files left behind by an interrupted backup).
+static int gc_is_used(struct gc_context *gc, const char *shard, const char *name) {
+    char key[BLOB_KEY_SIZE];
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    size_t len = SHA256_DIGEST_LENGTH * 2 - 3;
+    int codec;
+    if (shard == NULL || strlen(shard) != 3 || strlen(name) < len)
+        return 0;
+    // any stored form of a referenced digest is kept
+    for (codec = 0; codec < BLOB_CODEC_COUNT; codec++) {
+        if (strcmp(name + len, blob_codec_suffix(codec)) == 0)
+            break;
     }
-    arr->data[arr->size++] = val;
+    if (codec == BLOB_CODEC_COUNT)
+        return 0;
+    snprintf(key, sizeof(key), "%s/%.*s", shard, (int)len, name);
+    return key_to_digest(key, digest) == 0 && digest_set_contains(gc->used, digest);
 }
 
-static int string_compare(const void* a, const void* b) {
-    return strcmp(*(char**) a, *(char **) b);
+static void gc_delete(struct gc_context *gc, int dfd, const char *dir, const char *name) {
+    struct stat st;
+    if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+        fprintf(stderr, "Error opening: %s/%s\n", dir, name);
+        return;
+    }
+    if (!gc->dry_run && unlinkat(dfd, name, 0)) {
+        fprintf(stderr, "Error removing: %s/%s\n", dir, name);
+        return;
+    }
+    printf("%s: %s/%s\n", gc->dry_run ? "Would delete" : "Delete", dir, name);
+    gc->deleted++;
+    gc->reclaimed += st.st_size;
 }
 
-static void recursive_list_dir(char* d, struct array *arr) {
-    DIR *dp = opendir(d);
+// Streams |name| (relative to |parent_fd|) and deletes every file in it that
+// isn't a referenced blob. |dir| is only used for messages.
+static void gc_scan_dir(struct gc_context *gc, int parent_fd, const char *name, const char *dir, int depth) {
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY);
+    DIR *dp = fd < 0 ? NULL : fdopendir(fd);
     if (dp == NULL) {
-        fprintf(stderr, "Error opening directory: %s\n", d);
+        fprintf(stderr, "Error opening directory: %s\n", dir);
+        if (fd >= 0)
+            close(fd);
         return;
     }
     struct dirent *ep;
@@ -332,21 +944,20 @@ static void recursive_list_dir(char* d, struct array *arr) {
             continue;
         if (strcmp(ep->d_name, "..") == 0)
             continue;
-        struct stat cst;
-        int ret;
-        char blob[PATH_MAX];
-        sprintf(blob, "%s/%s", d, ep->d_name);
-        if ((ret = lstat(blob, &cst))) {
-            fprintf(stderr, "Error opening: %s\n", ep->d_name);
-            continue;
+        int is_dir = ep->d_type == DT_DIR;
+        if (ep->d_type == DT_UNKNOWN) {
+            struct stat cst;
+            is_dir = fstatat(dirfd(dp), ep->d_name, &cst, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(cst.st_mode);
         }
-
-        if (S_ISDIR(cst.st_mode)) {
-            recursive_list_dir(blob, arr);
+        if (is_dir) {
+            char sub[PATH_MAX];
+            snprintf(sub, sizeof(sub), "%s/%s", dir, ep->d_name);
+            gc_scan_dir(gc, dirfd(dp), ep->d_name, sub, depth + 1);
             continue;
         }
-
-        array_add(arr, strdup(blob));
+        if (depth == 1 && gc_is_used(gc, name, ep->d_name))
+            continue;
+        gc_delete(gc, dirfd(dp), dir, ep->d_name);
     }
     closedir(dp);
 }
@@ -363,269 +974,157 @@ int dedupe_main(int argc, char** argv) {
     }
 
     if (strcmp(argv[1], "c") == 0) {
-        if (argc < 5) {
+        int argi = 2;
+        int chunk_size = 0;
+        int compress = 0;
+        for (;;) {
+            if (argc > argi && strcmp(argv[argi], "-z") == 0) {
+                compress = 1;
+                argi++;
+            } else if (argc > argi + 1 && strcmp(argv[argi], "-C") == 0) {
+                chunk_size = atoi(argv[argi + 1]) * 1024;
+                argi += 2;
+            } else {
+                break;
+            }
+        }
+        if (argc < argi + 3) {
             usage(argv);
             return 1;
         }
 
         struct stat st;
         int ret;
-        if (0 != (ret = lstat(argv[2], &st))) {
+        if (0 != (ret = lstat(argv[argi], &st))) {
             fprintf(stderr, "Error opening input_file/input_directory.\n");
             return ret;
         }
 
         if (!S_ISDIR(st.st_mode)) {
-            fprintf(stderr, "%s must be a directory.\n", argv[2]);
+            fprintf(stderr, "%s must be a directory.\n", argv[argi]);
             return 1;
         }
 
         struct DEDUPE_STORE_CONTEXT context;
-        context.output_manifest = fopen(argv[4], "wb");
-        fprintf(context.output_manifest, "dedupe\t%d\n", DEDUPE_VERSION);
+        context.output_manifest = manifest_writer_open(argv[argi + 2]);
         if (context.output_manifest == NULL) {
-            fprintf(stderr, "Unable to open output file %s\n", argv[4]);
+            fprintf(stderr, "Unable to open output file %s\n", argv[argi + 2]);
             return 1;
         }
-        mkdir(argv[3], S_IRWXU | S_IRWXG | S_IRWXO);
-        realpath(argv[3], context.blob_dir);
-        chdir(argv[2]);
-        context.excludes = argv + 5;
-        context.exclude_count = argc - 5;
-
-        return store_dir(&context, st, ".");
+        mkdir(argv[argi + 1], S_IRWXU | S_IRWXG | S_IRWXO);
+        realpath(argv[argi + 1], context.blob_dir);
+        chdir(argv[argi]);
+        context.excludes = argv + argi + 3;
+        context.exclude_count = argc - argi - 3;
+        context.compress = compress;
+        context.chunking = chunk_size > 0;
+        if (context.chunking)
+            chunker_init(&context.chunker, chunk_size);
+
+        char cache_path[PATH_MAX];
+        snprintf(cache_path, sizeof(cache_path), "%s%s", context.blob_dir, HASH_CACHE_SUFFIX);
+        context.cache = hash_cache_load(cache_path);
+
+        if (ret = start_workers(&context)) {
+            hash_cache_free(context.cache);
+            return ret;
+        }
+        ret = store_dir(&context, st, ".");
+        int finish_ret = finish_workers(&context);
+        if (!ret)
+            ret = finish_ret;
+        // a failed run has not seen every file, keep the old cache then
+        if (!ret && context.cache != NULL)
+            hash_cache_save(context.cache, st.st_dev);
+        hash_cache_free(context.cache);
+        if (manifest_writer_close(context.output_manifest) && !ret) {
+            fprintf(stderr, "Error writing output file %s\n", argv[argi + 2]);
+            ret = 1;
+        }
+        return ret;
     }
     else if (strcmp(argv[1], "x") == 0) {
-        if (argc != 5) {
+        int argi = 2;
+        if (argc != argi + 3) {
             usage(argv);
             return 1;
         }
 
-        FILE *input_manifest = fopen(argv[2], "rb");
-        if (input_manifest == NULL) {
-            fprintf(stderr, "Unable to open input manifest %s\n", argv[2]);
+        manifest_reader *input_manifest = manifest_open(argv[argi]);
+        if (input_manifest == NULL)
+            return 1;
+        int version = manifest_version(input_manifest);
+
+        struct restore_context context;
+        char *output_dir = argv[argi + 2];
+        memset(&context, 0, sizeof(context));
+        realpath(argv[argi + 1], context.blob_dir);
+
+        int ret = load_restore_entries(&context, input_manifest);
+        manifest_close(input_manifest);
+        if (ret) {
+            if (ret < 0)
+                fprintf(stderr, "Malformed dedupe manifest: %s\n", argv[argi]);
+            free_restore_entries(&context);
             return 1;
         }
 
-        char blob_dir[PATH_MAX];
-        char *output_dir = argv[4];
-        realpath(argv[3], blob_dir);
-
         printf("%s\n" , output_dir);
         mkdir(output_dir, S_IRWXU | S_IRWXG | S_IRWXO);
         if (chdir(output_dir)) {
             fprintf(stderr, "Unable to open output directory %s\n", output_dir);
+            free_restore_entries(&context);
             return 1;
         }
 
-        char line[PATH_MAX];
-        fgets(line, PATH_MAX, input_manifest);
-        int version = 1;
-        if (sscanf(line, "dedupe\t%d", &version) != 1) {
-            fseek(input_manifest, 0, SEEK_SET);
-        }
-        if (version > DEDUPE_VERSION) {
-            fprintf(stderr, "Attempting to restore newer dedupe file: %s\n", argv[2]);
-            return 1;
-        }
-        while (fgets(line, PATH_MAX, input_manifest)) {
-            //printf("%s", line);
-
-            char type[4];
-            char mode[8];
-            char uid[32];
-            char gid[32];
-            char selabel[PATH_MAX];
-            char at[32];
-            char mt[32];
-            char ct[32];
-            char filename[PATH_MAX];
-
-            char *token = line;
-            token = tokenize(type, token, '\t');
-            token = tokenize(mode, token, '\t');
-            token = tokenize(uid, token, '\t');
-            token = tokenize(gid, token, '\t');
-            token = tokenize(selabel, token, '\t');
-            if (version >= 2) {
-                token = tokenize(at, token, '\t');
-                token = tokenize(mt, token, '\t');
-                token = tokenize(ct, token, '\t');
-            }
-            token = tokenize(filename, token, '\t');
-
-            int mode_oct = dec_to_oct(atoi(mode));
-            int uid_int = atoi(uid);
-            int gid_int = atoi(gid);
-            int ret;
-            //printf("%s\t%s\t%s\t%s\t%s\t%s\t", type, mode, uid, gid, selabel, filename);
-            printf("%s\n", filename);
-            if (strcmp(type, "f") == 0) {
-                char sha256[128];
-                token = tokenize(sha256, token, '\t');
-                char sizeStr[32];
-                token = tokenize(sizeStr, token, '\t');
-                int size = atoi(sizeStr);
-                // printf("%s\t%d\n", sha256, size);
-
-                char blob_file[PATH_MAX];
-                sprintf(blob_file, "%s/%s", blob_dir, sha256);
-                if (ret = copy_file(blob_file, filename)) {
-                    fprintf(stderr, "Unable to copy file %s\n", filename);
-                    fclose(input_manifest);
-                    return ret;
-                }
-
-                chown(filename, uid_int, gid_int);
-                chmod(filename, mode_oct);
-            }
-            else if (strcmp(type, "l") == 0) {
-                char link[41];
-                token = tokenize(link, token, '\t');
-                // printf("%s\n", link);
-
-                symlink(link, filename);
-
-                // Android has no lchmod, and chmod follows symlinks
-                //chmod(filename, mode_oct);
-                lchown(filename, uid_int, gid_int);
-            }
-            else if (strcmp(type, "d") == 0) {
-                // printf("\n");
-
-                mkdir(filename, mode_oct);
-
-                chown(filename, uid_int, gid_int);
-                chmod(filename, mode_oct);
-            }
-            else {
-                fprintf(stderr, "Unknown type %s\n", type);
-                fclose(input_manifest);
-                return 1;
-            }
-            if (lsetfilecon(filename, selabel) < 0) {
-                fprintf(stderr, "Can't setfilecon %s\n", filename);
-            }
-            if (version >= 2) {
-                struct timeval times[2];
-                times[0].tv_sec = atol(at);
-                times[1].tv_sec = atol(mt);
-                utimes(filename, times);
-            }
-        }
-
-        fclose(input_manifest);
-        return 0;
+        ret = restore_manifest(&context, version >= 2);
+        free_restore_entries(&context);
+        return ret;
     }
     else if (strcmp(argv[1], "gc") == 0) {
-        if (argc < 3) {
+        int argi = 2;
+        int dry_run = 0;
+        if (argc > argi && strcmp(argv[argi], "-n") == 0) {
+            dry_run = 1;
+            argi++;
+        }
+        if (argc <= argi) {
             usage(argv);
             return 1;
         }
-        
+
         char blob_dir[PATH_MAX];
-        realpath(argv[2], blob_dir);
+        realpath(argv[argi], blob_dir);
         if (check_file(blob_dir)) {
             fprintf(stderr, "Unable to open blobs dir: %s\n", blob_dir);
             return 1;
         }
 
-        struct array used_files;
-        struct array all_files;
-        array_init(&used_files, ARRAY_CAPACITY);
-        array_init(&all_files, ARRAY_CAPACITY);
+        struct gc_context gc;
+        memset(&gc, 0, sizeof(gc));
+        gc.dry_run = dry_run;
+        gc.used = digest_set_create(GC_EXPECTED_BLOBS, 0);
+        if (gc.used == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
 
-        char blob[PATH_MAX];
         int i;
         int failure = 0;
-        for (i = 3; i < argc; i++) {
-            FILE *input_manifest = fopen(argv[i], "rb");
-            if (input_manifest == NULL) {
-                fprintf(stderr, "Unable to open input manifest %s\n", argv[i]);
+        for (i = argi + 1; i < argc; i++) {
+            if (manifest_for_each_blob(argv[i], gc_add_used, &gc)) {
+                fprintf(stderr, "Unable to gc using manifest: %s\n", argv[i]);
                 failure = 1;
                 goto out;
             }
-
-            char line[PATH_MAX];
-            fgets(line, PATH_MAX, input_manifest);
-            int version = 1;
-            if (sscanf(line, "dedupe\t%d", &version) != 1) {
-                fseek(input_manifest, 0, SEEK_SET);
-            }
-            if (version > DEDUPE_VERSION) {
-                fprintf(stderr, "Attempting to gc newer dedupe file: %s\n", argv[2]);
-                failure = 1;
-                fclose(input_manifest);
-                break;
-            }
-            while (fgets(line, PATH_MAX, input_manifest)) {
-                char type[4];
-                char mode[8];
-                char uid[32];
-                char gid[32];
-                char selabel[PATH_MAX];
-                char at[32];
-                char mt[32];
-                char ct[32];
-                char filename[PATH_MAX];
-
-                char *token = line;
-                token = tokenize(type, token, '\t');
-                token = tokenize(mode, token, '\t');
-                token = tokenize(uid, token, '\t');
-                token = tokenize(gid, token, '\t');
-                token = tokenize(selabel, token, '\t');
-                if (version >= 2) {
-                    token = tokenize(at, token, '\t');
-                    token = tokenize(mt, token, '\t');
-                    token = tokenize(ct, token, '\t');
-                }
-                token = tokenize(filename, token, '\t');
-
-                int mode_oct = dec_to_oct(atoi(mode));
-                int uid_int = atoi(uid);
-                int gid_int = atoi(gid);
-                int ret;
-                // printf("%s\n", filename);
-                if (strcmp(type, "f") == 0) {
-                    char key[128];
-                    token = tokenize(key, token, '\t');
-                    char sizeStr[32];
-                    token = tokenize(sizeStr, token, '\t');
-                    int size = atoi(sizeStr);
-
-                    sprintf(blob, "%s/%s", blob_dir, key);
-                    array_add(&used_files, strdup(blob));
-                }
-            }
-            fclose(input_manifest);
         }
 
-        recursive_list_dir(blob_dir, &all_files);
-
-        qsort(used_files.data, used_files.size, sizeof(void*), string_compare);
-        qsort(all_files.data, all_files.size, sizeof(void*), string_compare);
-
-        // Search for unused files
-        int j = 0;
-        for (i = 0; i < all_files.size; i++) {
-            int cmp;
-            while (j < used_files.size &&
-                (cmp = strcmp(used_files.data[j], all_files.data[i])) < 0) {
-                j++;
-            }
-
-            if (cmp > 0 || j >= used_files.size) {
-                if (remove(all_files.data[i])) {
-                    fprintf(stderr, "Error removing: %s\n", all_files.data[i]);
-                }
-                printf("Delete: %s\n", all_files.data[i]);
-            }
-        }
+        gc_scan_dir(&gc, AT_FDCWD, blob_dir, blob_dir, 0);
+        printf("%s %u blobs, %llu bytes\n", dry_run ? "Would reclaim" : "Reclaimed",
+               gc.deleted, (unsigned long long)gc.reclaimed);
 
         out:
-        array_free(&used_files, 1);
-        array_free(&all_files, 1);
+        digest_set_free(gc.used);
 
         return failure;
     }
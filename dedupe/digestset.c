@@ -0,0 +1,124 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "digestset.h"
+
+struct digest_set {
+    unsigned char* digests; // capacity * SHA256_DIGEST_LENGTH
+    uint32_t* values;       // NULL unless created with values
+    unsigned char* used;    // one bit per slot
+    size_t capacity;        // power of two
+    size_t count;
+};
+
+static size_t slot_hash(const unsigned char* digest) {
+    size_t h;
+    memcpy(&h, digest, sizeof(h));
+    return h;
+}
+
+static int slot_used(const digest_set* set, size_t i) {
+    return set->used[i >> 3] & (1 << (i & 7));
+}
+
+static int alloc_slots(digest_set* set, size_t capacity, int with_values) {
+    set->digests = malloc(capacity * SHA256_DIGEST_LENGTH);
+    set->used = calloc((capacity + 7) / 8, 1);
+    set->values = with_values ? malloc(capacity * sizeof(uint32_t)) : NULL;
+    if (set->digests == NULL || set->used == NULL || (with_values && set->values == NULL)) {
+        free(set->digests);
+        free(set->used);
+        free(set->values);
+        return -1;
+    }
+    set->capacity = capacity;
+    set->count = 0;
+    return 0;
+}
+
+// Returns the slot holding |digest| or the empty slot it would go in.
+static size_t find_slot(const digest_set* set, const unsigned char* digest) {
+    size_t mask = set->capacity - 1;
+    size_t i = slot_hash(digest) & mask;
+    while (slot_used(set, i)) {
+        if (memcmp(set->digests + i * SHA256_DIGEST_LENGTH, digest, SHA256_DIGEST_LENGTH) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void put_slot(digest_set* set, size_t i, const unsigned char* digest, uint32_t value) {
+    memcpy(set->digests + i * SHA256_DIGEST_LENGTH, digest, SHA256_DIGEST_LENGTH);
+    if (set->values != NULL)
+        set->values[i] = value;
+    set->used[i >> 3] |= 1 << (i & 7);
+    set->count++;
+}
+
+static int grow(digest_set* set) {
+    digest_set old = *set;
+    size_t i;
+    if (alloc_slots(set, old.capacity * 2, old.values != NULL) != 0) {
+        *set = old;
+        return -1;
+    }
+    for (i = 0; i < old.capacity; i++) {
+        if (!slot_used(&old, i))
+            continue;
+        const unsigned char* digest = old.digests + i * SHA256_DIGEST_LENGTH;
+        put_slot(set, find_slot(set, digest), digest, old.values != NULL ? old.values[i] : 0);
+    }
+    free(old.digests);
+    free(old.used);
+    free(old.values);
+    return 0;
+}
+
+digest_set* digest_set_create(size_t expected, int with_values) {
+    size_t capacity = 64;
+    digest_set* set = calloc(1, sizeof(digest_set));
+    if (set == NULL)
+        return NULL;
+    // keep the load factor under 3/4
+    while (capacity * 3 / 4 < expected)
+        capacity *= 2;
+    if (alloc_slots(set, capacity, with_values) != 0) {
+        free(set);
+        return NULL;
+    }
+    return set;
+}
+
+int digest_set_insert(digest_set* set, const unsigned char* digest, uint32_t value, uint32_t* existing) {
+    size_t i = find_slot(set, digest);
+    if (slot_used(set, i)) {
+        if (existing != NULL && set->values != NULL)
+            *existing = set->values[i];
+        return 0;
+    }
+    if ((set->count + 1) * 4 > set->capacity * 3) {
+        if (grow(set) != 0)
+            return -1;
+        i = find_slot(set, digest);
+    }
+    put_slot(set, i, digest, value);
+    return 1;
+}
+
+int digest_set_contains(const digest_set* set, const unsigned char* digest) {
+    return slot_used(set, find_slot(set, digest)) != 0;
+}
+
+size_t digest_set_count(const digest_set* set) {
+    return set->count;
+}
+
+void digest_set_free(digest_set* set) {
+    if (set == NULL)
+        return;
+    free(set->digests);
+    free(set->used);
+    free(set->values);
+    free(set);
+}
@@ -0,0 +1,26 @@
+#ifndef DEDUPE_DIGESTSET_H
+#define DEDUPE_DIGESTSET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+
+// Open addressing hash set of sha256 digests, optionally mapping each one to
+// a 32 bit value. Digests are already uniformly distributed, so their first
+// bytes are used as the hash.
+typedef struct digest_set digest_set;
+
+digest_set* digest_set_create(size_t expected, int with_values);
+
+// Adds |digest| with |value|. Returns 1 if it was added, 0 if it was already
+// present (|existing|, if non-NULL, receives the stored value) and -1 when
+// out of memory.
+int digest_set_insert(digest_set* set, const unsigned char* digest, uint32_t value, uint32_t* existing);
+
+int digest_set_contains(const digest_set* set, const unsigned char* digest);
+
+size_t digest_set_count(const digest_set* set);
+
+void digest_set_free(digest_set* set);
+
+#endif
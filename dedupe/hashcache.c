@@ -0,0 +1,227 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hashcache.h"
+
+#define HASH_CACHE_MAGIC 0x43484444 // "DDHC"
+#define HASH_CACHE_VERSION 1
+
+struct cache_record {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+    int64_t ctime;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+};
+
+// On disk: header followed by |count| records sorted by (dev, ino).
+// The magic is stored in native byte order, so a cache written by a
+// different endianness simply fails to load.
+struct cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t record_size;
+    unsigned char checksum[SHA256_DIGEST_LENGTH]; // sha256 of the records
+};
+
+struct hash_cache {
+    char path[PATH_MAX];
+    // entries loaded from disk, sorted
+    struct cache_record* old;
+    uint32_t old_count;
+    // entries seen in this run
+    pthread_mutex_t lock;
+    struct cache_record* seen;
+    uint32_t seen_count;
+    uint32_t seen_capacity;
+};
+
+static int record_compare(const void* a, const void* b) {
+    const struct cache_record* ra = (const struct cache_record*)a;
+    const struct cache_record* rb = (const struct cache_record*)b;
+    if (ra->dev != rb->dev)
+        return ra->dev < rb->dev ? -1 : 1;
+    if (ra->ino != rb->ino)
+        return ra->ino < rb->ino ? -1 : 1;
+    return 0;
+}
+
+static void checksum_records(const struct cache_record* records, uint32_t count, unsigned char* out) {
+    SHA256_CTX c;
+    SHA256_Init(&c);
+    SHA256_Update(&c, records, (size_t)count * sizeof(struct cache_record));
+    SHA256_Final(out, &c);
+}
+
+static void load_records(hash_cache* cache) {
+    struct cache_header header;
+    unsigned char checksum[SHA256_DIGEST_LENGTH];
+    FILE* f = fopen(cache->path, "rb");
+    if (f == NULL)
+        return;
+
+    if (fread(&header, sizeof(header), 1, f) != 1
+            || header.magic != HASH_CACHE_MAGIC
+            || header.version != HASH_CACHE_VERSION
+            || header.record_size != sizeof(struct cache_record)) {
+        fprintf(stderr, "Ignoring unknown hash cache %s\n", cache->path);
+        goto out;
+    }
+
+    cache->old = malloc((size_t)header.count * sizeof(struct cache_record) + 1);
+    if (cache->old == NULL
+            || fread(cache->old, sizeof(struct cache_record), header.count, f) != header.count
+            || fgetc(f) != EOF) {
+        fprintf(stderr, "Ignoring truncated hash cache %s\n", cache->path);
+        goto error;
+    }
+    checksum_records(cache->old, header.count, checksum);
+    if (memcmp(checksum, header.checksum, sizeof(checksum)) != 0) {
+        fprintf(stderr, "Ignoring corrupt hash cache %s\n", cache->path);
+        goto error;
+    }
+    cache->old_count = header.count;
+    goto out;
+
+error:
+    free(cache->old);
+    cache->old = NULL;
+out:
+    fclose(f);
+}
+
+hash_cache* hash_cache_load(const char* path) {
+    hash_cache* cache = calloc(1, sizeof(hash_cache));
+    if (cache == NULL)
+        return NULL;
+    strncpy(cache->path, path, sizeof(cache->path) - 1);
+    pthread_mutex_init(&cache->lock, NULL);
+    load_records(cache);
+    return cache;
+}
+
+static void fill_key(struct cache_record* r, const struct stat* st) {
+    memset(r, 0, sizeof(*r));
+    r->dev = st->st_dev;
+    r->ino = st->st_ino;
+    r->size = st->st_size;
+    r->mtime = st->st_mtime;
+    r->ctime = st->st_ctime;
+}
+
+int hash_cache_lookup(hash_cache* cache, const struct stat* st, unsigned char* digest) {
+    struct cache_record key;
+    // no cache yet, and bsearch() of a NULL array is undefined
+    if (cache->old_count == 0)
+        return 0;
+    fill_key(&key, st);
+    const struct cache_record* r = bsearch(&key, cache->old, cache->old_count,
+                                           sizeof(struct cache_record), record_compare);
+    if (r == NULL || r->size != key.size || r->mtime != key.mtime || r->ctime != key.ctime)
+        return 0;
+    memcpy(digest, r->digest, SHA256_DIGEST_LENGTH);
+    return 1;
+}
+
+void hash_cache_insert(hash_cache* cache, const struct stat* st, const unsigned char* digest) {
+    pthread_mutex_lock(&cache->lock);
+    if (cache->seen_count == cache->seen_capacity) {
+        uint32_t capacity = cache->seen_capacity ? cache->seen_capacity * 2 : 1024;
+        struct cache_record* seen = realloc(cache->seen, capacity * sizeof(struct cache_record));
+        if (seen == NULL) {
+            // losing cache entries only costs a rehash next time
+            pthread_mutex_unlock(&cache->lock);
+            return;
+        }
+        cache->seen = seen;
+        cache->seen_capacity = capacity;
+    }
+    struct cache_record* r = &cache->seen[cache->seen_count++];
+    fill_key(r, st);
+    memcpy(r->digest, digest, SHA256_DIGEST_LENGTH);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+int hash_cache_save(hash_cache* cache, dev_t scanned_dev) {
+    struct cache_header header;
+    char tmp_path[PATH_MAX];
+    uint32_t i;
+    uint32_t count = 0;
+    int ret = 1;
+
+    if (cache->seen_count > 0)
+        qsort(cache->seen, cache->seen_count, sizeof(struct cache_record), record_compare);
+
+    struct cache_record* records = malloc(((size_t)cache->seen_count + cache->old_count + 1) * sizeof(struct cache_record));
+    if (records == NULL)
+        return 1;
+    for (i = 0; i < cache->seen_count; i++) {
+        // hard links show up once per name
+        if (count > 0 && record_compare(&records[count - 1], &cache->seen[i]) == 0)
+            continue;
+        records[count++] = cache->seen[i];
+    }
+    for (i = 0; i < cache->old_count; i++) {
+        if (cache->old[i].dev == (uint64_t)scanned_dev)
+            continue;
+        if (cache->seen_count > 0 && bsearch(&cache->old[i], cache->seen, cache->seen_count, sizeof(struct cache_record), record_compare))
+            continue;
+        records[count++] = cache->old[i];
+    }
+    qsort(records, count, sizeof(struct cache_record), record_compare);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = HASH_CACHE_MAGIC;
+    header.version = HASH_CACHE_VERSION;
+    header.count = count;
+    header.record_size = sizeof(struct cache_record);
+    checksum_records(records, count, header.checksum);
+
+    // write a temp file and rename it over the old one, so a crash never
+    // leaves a half written cache behind
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache->path) >= (int)sizeof(tmp_path)) {
+        fprintf(stderr, "Hash cache path %s is too long\n", cache->path);
+        goto out;
+    }
+    FILE* f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to write hash cache %s\n", tmp_path);
+        goto out;
+    }
+    if (fwrite(&header, sizeof(header), 1, f) != 1
+            || fwrite(records, sizeof(struct cache_record), count, f) != count
+            || fflush(f) != 0
+            || fsync(fileno(f)) != 0) {
+        fprintf(stderr, "Error writing hash cache %s\n", tmp_path);
+        fclose(f);
+        unlink(tmp_path);
+        goto out;
+    }
+    if (fclose(f) != 0 || rename(tmp_path, cache->path) != 0) {
+        fprintf(stderr, "Error replacing hash cache %s\n", cache->path);
+        unlink(tmp_path);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    free(records);
+    return ret;
+}
+
+void hash_cache_free(hash_cache* cache) {
+    if (cache == NULL)
+        return;
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->old);
+    free(cache->seen);
+    free(cache);
+}
@@ -0,0 +1,31 @@
+#ifndef DEDUPE_HASHCACHE_H
+#define DEDUPE_HASHCACHE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <openssl/sha.h>
+
+// Remembers the sha256 of files from previous "dedupe c" runs, keyed on
+// (dev, inode, size, mtime, ctime), so unchanged files don't have to be
+// read again.
+typedef struct hash_cache hash_cache;
+
+// Loads the cache stored at |path|. A missing, truncated, corrupt or
+// foreign cache yields an empty one. Returns NULL only when out of memory.
+hash_cache* hash_cache_load(const char* path);
+
+// Returns 1 and fills |digest| when |st| matches a cached entry.
+int hash_cache_lookup(hash_cache* cache, const struct stat* st, unsigned char* digest);
+
+// Records the digest of a file seen in this run. Safe to call from
+// several threads.
+void hash_cache_insert(hash_cache* cache, const struct stat* st, const unsigned char* digest);
+
+// Atomically replaces the cache file. Entries of |scanned_dev| that were not
+// seen in this run are dropped; entries of other devices (other partitions
+// sharing the blob dir) are kept. Returns 0 on success.
+int hash_cache_save(hash_cache* cache, dev_t scanned_dev);
+
+void hash_cache_free(hash_cache* cache);
+
+#endif
@@ -0,0 +1,678 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blobcodec.h"
+#include "digestset.h"
+#include "manifest.h"
+
+#define MANIFEST_MAGIC 0x334d4444 // "DDM3"
+#define NO_INDEX 0xffffffff
+// interned selinux labels; there are only a few dozen distinct ones
+#define MAX_INTERNED_LABELS 128
+
+struct manifest_header {
+    uint32_t magic;
+    uint32_t record_size;
+    uint32_t entry_count;
+    uint32_t digest_count;
+    uint32_t strings_size;
+    uint32_t chunks_size;   // in words, always 0 in version 3
+    unsigned char body_checksum[SHA256_DIGEST_LENGTH];    // records + strings + chunks
+    unsigned char digests_checksum[SHA256_DIGEST_LENGTH];
+};
+
+// Chunked files have RECORD_CHUNKED set and |digest| is the offset of their
+// chunk list in the chunk section: a word holding the number of chunks
+// followed by that many digest indices, each with the chunk's blob codec in
+// the top bits (version 5).
+#define RECORD_CHUNKED 0x01
+#define CHUNK_CODEC_SHIFT 28
+#define CHUNK_INDEX_MASK ((1U << CHUNK_CODEC_SHIFT) - 1)
+
+struct manifest_record {
+    uint8_t type;
+    uint8_t flags;
+    uint8_t codec;      // blob codec of unchunked files, version 5
+    uint8_t reserved;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+    uint64_t size;
+    uint32_t path;      // offsets into the string table
+    uint32_t selabel;
+    uint32_t link;      // NO_INDEX unless a symlink
+    uint32_t digest;    // index into the digest section, NO_INDEX unless a file
+};
+
+void digest_to_key(const unsigned char* digest, char* key) {
+    static const char hex[] = "0123456789abcdef";
+    int i;
+    int o = 0;
+    for (i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+        // if a hash is abcdefg, the blob name is abc/defg
+        // this is to get around vfat having a 64k directory size limit
+        if (o == 3)
+            key[o++] = '/';
+        key[o++] = hex[digest[i] >> 4];
+        if (o == 3)
+            key[o++] = '/';
+        key[o++] = hex[digest[i] & 0xf];
+    }
+    key[o] = '\0';
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+int key_to_digest(const char* key, unsigned char* digest) {
+    int nibbles = 0;
+    for (; *key; key++) {
+        if (*key == '/')
+            continue;
+        int v = hex_value(*key);
+        if (v < 0 || nibbles >= SHA256_DIGEST_LENGTH * 2)
+            return -1;
+        if (nibbles & 1)
+            digest[nibbles / 2] |= v;
+        else
+            digest[nibbles / 2] = v << 4;
+        nibbles++;
+    }
+    return nibbles == SHA256_DIGEST_LENGTH * 2 ? 0 : -1;
+}
+
+static void checksum(const void* a, size_t alen, const void* b, size_t blen,
+                     const void* c, size_t clen, unsigned char* out) {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, a, alen);
+    if (b != NULL)
+        SHA256_Update(&ctx, b, blen);
+    if (c != NULL)
+        SHA256_Update(&ctx, c, clen);
+    SHA256_Final(out, &ctx);
+}
+
+/*
+ * reader
+ */
+
+struct manifest_reader {
+    FILE* f;
+    int version;
+    // version 1/2
+    char* line;
+    size_t line_size;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    // version 3
+    struct manifest_header header;
+    struct manifest_record* records;
+    unsigned char* digests;
+    char* strings;
+    uint32_t* chunks;
+    uint32_t next;
+    unsigned char* chunk_digests;   // the current entry's, gathered
+    unsigned char* chunk_codecs;
+    uint32_t chunk_capacity;
+};
+
+#define TEXT_LINE_SIZE (PATH_MAX * 3)
+
+// Reads the "dedupe\t<version>\n" line. Version 1 manifests have none.
+static int read_version(FILE* f, const char* path) {
+    char line[64];
+    int version = 1;
+    if (fgets(line, sizeof(line), f) == NULL || sscanf(line, "dedupe\t%d", &version) != 1) {
+        version = 1;
+        fseek(f, 0, SEEK_SET);
+    }
+    if (version > DEDUPE_VERSION) {
+        fprintf(stderr, "Attempting to read newer dedupe file: %s\n", path);
+        return -1;
+    }
+    return version;
+}
+
+static int read_header(FILE* f, struct manifest_header* header, const char* path) {
+    if (fread(header, sizeof(*header), 1, f) != 1
+            || header->magic != MANIFEST_MAGIC
+            || header->record_size != sizeof(struct manifest_record)) {
+        fprintf(stderr, "Invalid dedupe manifest: %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int check_chunk_list(const manifest_reader* r, uint32_t offset) {
+    const struct manifest_header* h = &r->header;
+    uint32_t i;
+    if (offset >= h->chunks_size || r->chunks[offset] > h->chunks_size - offset - 1)
+        return -1;
+    for (i = 1; i <= r->chunks[offset]; i++) {
+        uint32_t word = r->chunks[offset + i];
+        if ((word & CHUNK_INDEX_MASK) >= h->digest_count || (word >> CHUNK_CODEC_SHIFT) >= BLOB_CODEC_COUNT)
+            return -1;
+    }
+    return 0;
+}
+
+static int load_binary(manifest_reader* r, const char* path) {
+    struct manifest_header* h = &r->header;
+    unsigned char sum[SHA256_DIGEST_LENGTH];
+    uint32_t i;
+
+    if (read_header(r->f, h, path))
+        return -1;
+    size_t records_size = (size_t)h->entry_count * sizeof(struct manifest_record);
+    size_t digests_size = (size_t)h->digest_count * SHA256_DIGEST_LENGTH;
+    r->records = malloc(records_size + 1);
+    r->digests = malloc(digests_size + 1);
+    r->strings = malloc((size_t)h->strings_size + 1);
+    if (r->version < 4)
+        h->chunks_size = 0;
+    size_t chunks_size = (size_t)h->chunks_size * sizeof(uint32_t);
+    r->chunks = malloc(chunks_size + 1);
+    if (r->records == NULL || r->digests == NULL || r->strings == NULL || r->chunks == NULL) {
+        fprintf(stderr, "Out of memory reading %s\n", path);
+        return -1;
+    }
+    if (fread(r->records, 1, records_size, r->f) != records_size
+            || fread(r->digests, 1, digests_size, r->f) != digests_size
+            || fread(r->strings, 1, h->strings_size, r->f) != h->strings_size
+            || fread(r->chunks, 1, chunks_size, r->f) != chunks_size) {
+        fprintf(stderr, "Truncated dedupe manifest: %s\n", path);
+        return -1;
+    }
+    checksum(r->records, records_size, r->strings, h->strings_size, r->chunks, chunks_size, sum);
+    if (memcmp(sum, h->body_checksum, sizeof(sum)) != 0) {
+        fprintf(stderr, "Corrupt dedupe manifest: %s\n", path);
+        return -1;
+    }
+    checksum(r->digests, digests_size, NULL, 0, NULL, 0, sum);
+    if (memcmp(sum, h->digests_checksum, sizeof(sum)) != 0) {
+        fprintf(stderr, "Corrupt dedupe manifest: %s\n", path);
+        return -1;
+    }
+
+    // the checksums catch bit rot, this catches a buggy writer
+    r->strings[h->strings_size] = '\0';
+    for (i = 0; i < h->entry_count; i++) {
+        struct manifest_record* rec = &r->records[i];
+        if (r->version < 5)
+            rec->codec = BLOB_CODEC_RAW;
+        if (rec->codec >= BLOB_CODEC_COUNT || rec->path >= h->strings_size || rec->selabel >= h->strings_size
+                || (rec->link != NO_INDEX && rec->link >= h->strings_size)
+                || (rec->digest != NO_INDEX && !(rec->flags & RECORD_CHUNKED) && rec->digest >= h->digest_count)
+                || ((rec->flags & RECORD_CHUNKED) && check_chunk_list(r, rec->digest))) {
+            fprintf(stderr, "Invalid dedupe manifest entry %u: %s\n", i, path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+manifest_reader* manifest_open(const char* path) {
+    manifest_reader* r = calloc(1, sizeof(manifest_reader));
+    if (r == NULL)
+        return NULL;
+    r->f = fopen(path, "rb");
+    if (r->f == NULL) {
+        fprintf(stderr, "Unable to open input manifest %s\n", path);
+        free(r);
+        return NULL;
+    }
+    if ((r->version = read_version(r->f, path)) < 0)
+        goto error;
+
+    if (r->version >= 3) {
+        if (load_binary(r, path))
+            goto error;
+        fclose(r->f);
+        r->f = NULL;
+    } else {
+        r->line_size = TEXT_LINE_SIZE;
+        if ((r->line = malloc(r->line_size)) == NULL)
+            goto error;
+    }
+    return r;
+
+error:
+    manifest_close(r);
+    return NULL;
+}
+
+int manifest_version(const manifest_reader* r) {
+    return r->version;
+}
+
+// Splits off the next tab terminated field in place.
+static char* next_field(char** cursor) {
+    char* field = *cursor;
+    if (field == NULL)
+        return NULL;
+    char* tab = strchr(field, '\t');
+    if (tab == NULL) {
+        *cursor = NULL;
+        return NULL;
+    }
+    *tab = '\0';
+    *cursor = tab + 1;
+    return field;
+}
+
+static int next_text(manifest_reader* r, manifest_entry* e) {
+    char* fields[9];
+    int count = r->version >= 2 ? 9 : 6;
+    int i;
+
+    if (fgets(r->line, r->line_size, r->f) == NULL)
+        return 0;
+
+    char* cursor = r->line;
+    for (i = 0; i < count; i++) {
+        if ((fields[i] = next_field(&cursor)) == NULL)
+            return -1;
+    }
+    e->type = fields[0][0];
+    e->mode = strtoul(fields[1], NULL, 8);
+    e->uid = strtoul(fields[2], NULL, 10);
+    e->gid = strtoul(fields[3], NULL, 10);
+    e->selabel = fields[4];
+    if (r->version >= 2) {
+        e->atime = atol(fields[5]);
+        e->mtime = atol(fields[6]);
+        e->ctime = atol(fields[7]);
+    }
+    e->path = fields[count - 1];
+
+    if (e->type == 'f') {
+        char* key = next_field(&cursor);
+        char* size = next_field(&cursor);
+        if (key == NULL || size == NULL || strlen(key) >= sizeof(e->key))
+            return -1;
+        strcpy(e->key, key);
+        e->size = strtoull(size, NULL, 10);
+        e->digest = key_to_digest(key, r->digest) == 0 ? r->digest : NULL;
+    } else if (e->type == 'l') {
+        if ((e->link = next_field(&cursor)) == NULL)
+            return -1;
+    }
+    return 1;
+}
+
+static int next_binary(manifest_reader* r, manifest_entry* e) {
+    if (r->next >= r->header.entry_count)
+        return 0;
+    const struct manifest_record* rec = &r->records[r->next++];
+    e->type = rec->type;
+    e->mode = rec->mode;
+    e->uid = rec->uid;
+    e->gid = rec->gid;
+    e->atime = rec->atime;
+    e->mtime = rec->mtime;
+    e->ctime = rec->ctime;
+    e->size = rec->size;
+    e->path = r->strings + rec->path;
+    e->selabel = r->strings + rec->selabel;
+    if (rec->link != NO_INDEX)
+        e->link = r->strings + rec->link;
+    if (rec->flags & RECORD_CHUNKED) {
+        const uint32_t* list = r->chunks + rec->digest;
+        uint32_t i;
+        if (list[0] > r->chunk_capacity) {
+            unsigned char* digests = realloc(r->chunk_digests, (size_t)list[0] * SHA256_DIGEST_LENGTH);
+            if (digests == NULL)
+                return -1;
+            r->chunk_digests = digests;
+            unsigned char* codecs = realloc(r->chunk_codecs, list[0]);
+            if (codecs == NULL)
+                return -1;
+            r->chunk_codecs = codecs;
+            r->chunk_capacity = list[0];
+        }
+        for (i = 0; i < list[0]; i++) {
+            uint32_t index = list[i + 1] & CHUNK_INDEX_MASK;
+            memcpy(r->chunk_digests + (size_t)i * SHA256_DIGEST_LENGTH,
+                   r->digests + (size_t)index * SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH);
+            r->chunk_codecs[i] = list[i + 1] >> CHUNK_CODEC_SHIFT;
+        }
+        e->chunk_count = list[0];
+        e->chunks = r->chunk_digests;
+        e->chunk_codecs = r->chunk_codecs;
+    }
+    else if (rec->digest != NO_INDEX) {
+        e->digest = r->digests + (size_t)rec->digest * SHA256_DIGEST_LENGTH;
+        e->codec = rec->codec;
+        digest_to_key(e->digest, e->key);
+    }
+    return 1;
+}
+
+int manifest_next(manifest_reader* r, manifest_entry* e) {
+    memset(e, 0, sizeof(*e));
+    if (r->version >= 3)
+        return next_binary(r, e);
+    return next_text(r, e);
+}
+
+void manifest_close(manifest_reader* r) {
+    if (r == NULL)
+        return;
+    if (r->f != NULL)
+        fclose(r->f);
+    free(r->line);
+    free(r->records);
+    free(r->digests);
+    free(r->strings);
+    free(r->chunks);
+    free(r->chunk_digests);
+    free(r->chunk_codecs);
+    free(r);
+}
+
+int manifest_for_each_blob(const char* path, manifest_blob_fn fn, void* cookie) {
+    int ret = 0;
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open input manifest %s\n", path);
+        return -1;
+    }
+    int version = read_version(f, path);
+    if (version < 0) {
+        fclose(f);
+        return -1;
+    }
+
+    if (version >= 3) {
+        struct manifest_header h;
+        unsigned char sum[SHA256_DIGEST_LENGTH];
+        uint32_t i;
+        if (read_header(f, &h, path)) {
+            fclose(f);
+            return -1;
+        }
+        size_t digests_size = (size_t)h.digest_count * SHA256_DIGEST_LENGTH;
+        unsigned char* digests = malloc(digests_size + 1);
+        if (digests == NULL
+                || fseek(f, (long)h.entry_count * sizeof(struct manifest_record), SEEK_CUR) != 0
+                || fread(digests, 1, digests_size, f) != digests_size) {
+            fprintf(stderr, "Truncated dedupe manifest: %s\n", path);
+            free(digests);
+            fclose(f);
+            return -1;
+        }
+        fclose(f);
+        checksum(digests, digests_size, NULL, 0, NULL, 0, sum);
+        if (memcmp(sum, h.digests_checksum, sizeof(sum)) != 0) {
+            fprintf(stderr, "Corrupt dedupe manifest: %s\n", path);
+            free(digests);
+            return -1;
+        }
+        char key[BLOB_KEY_SIZE];
+        for (i = 0; i < h.digest_count && ret == 0; i++) {
+            digest_to_key(digests + (size_t)i * SHA256_DIGEST_LENGTH, key);
+            ret = fn(key, digests + (size_t)i * SHA256_DIGEST_LENGTH, cookie);
+        }
+        free(digests);
+        return ret;
+    }
+
+    fclose(f);
+    manifest_reader* r = manifest_open(path);
+    manifest_entry e;
+    int status;
+    if (r == NULL)
+        return -1;
+    while (ret == 0 && (status = manifest_next(r, &e)) > 0) {
+        if (e.type == 'f')
+            ret = fn(e.key, e.digest, cookie);
+    }
+    if (ret == 0 && status < 0) {
+        fprintf(stderr, "Malformed dedupe manifest: %s\n", path);
+        ret = -1;
+    }
+    manifest_close(r);
+    return ret;
+}
+
+/*
+ * writer
+ */
+
+struct manifest_writer {
+    FILE* f;
+    struct manifest_record* records;
+    uint32_t count;
+    uint32_t capacity;
+    char* strings;
+    size_t strings_size;
+    size_t strings_capacity;
+    unsigned char* digests;
+    uint32_t digest_count;
+    uint32_t digest_capacity;
+    uint32_t* chunks;
+    uint32_t chunks_size;
+    uint32_t chunks_capacity;
+    digest_set* digest_index;
+    uint32_t labels[MAX_INTERNED_LABELS];
+    int label_count;
+    int uses_codecs;
+    int error;
+};
+
+manifest_writer* manifest_writer_open(const char* path) {
+    manifest_writer* w = calloc(1, sizeof(manifest_writer));
+    if (w == NULL)
+        return NULL;
+    w->f = fopen(path, "wb");
+    w->digest_index = digest_set_create(1024, 1);
+    if (w->f == NULL || w->digest_index == NULL) {
+        if (w->f != NULL)
+            fclose(w->f);
+        digest_set_free(w->digest_index);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+static uint32_t add_string(manifest_writer* w, const char* s) {
+    size_t len = strlen(s) + 1;
+    if (w->strings_size + len > UINT32_MAX) {
+        w->error = 1;
+        return 0;
+    }
+    if (w->strings_size + len > w->strings_capacity) {
+        size_t capacity = w->strings_capacity ? w->strings_capacity * 2 : 64 * 1024;
+        while (capacity < w->strings_size + len)
+            capacity *= 2;
+        char* strings = realloc(w->strings, capacity);
+        if (strings == NULL) {
+            w->error = 1;
+            return 0;
+        }
+        w->strings = strings;
+        w->strings_capacity = capacity;
+    }
+    uint32_t offset = w->strings_size;
+    memcpy(w->strings + offset, s, len);
+    w->strings_size += len;
+    return offset;
+}
+
+static uint32_t add_label(manifest_writer* w, const char* label) {
+    int i;
+    for (i = 0; i < w->label_count; i++) {
+        if (strcmp(w->strings + w->labels[i], label) == 0)
+            return w->labels[i];
+    }
+    uint32_t offset = add_string(w, label);
+    if (w->label_count < MAX_INTERNED_LABELS)
+        w->labels[w->label_count++] = offset;
+    return offset;
+}
+
+static uint32_t add_digest(manifest_writer* w, const unsigned char* digest) {
+    uint32_t index;
+    int ret = digest_set_insert(w->digest_index, digest, w->digest_count, &index);
+    if (ret == 0)
+        return index;
+    if (ret < 0) {
+        w->error = 1;
+        return NO_INDEX;
+    }
+    if (w->digest_count == w->digest_capacity) {
+        uint32_t capacity = w->digest_capacity ? w->digest_capacity * 2 : 1024;
+        unsigned char* digests = realloc(w->digests, (size_t)capacity * SHA256_DIGEST_LENGTH);
+        if (digests == NULL) {
+            w->error = 1;
+            return NO_INDEX;
+        }
+        w->digests = digests;
+        w->digest_capacity = capacity;
+    }
+    memcpy(w->digests + (size_t)w->digest_count * SHA256_DIGEST_LENGTH, digest, SHA256_DIGEST_LENGTH);
+    return w->digest_count++;
+}
+
+static struct manifest_record* add_record(manifest_writer* w, char type, const struct stat* st,
+                                          const char* selabel, const char* path, const char* link) {
+    if (w->count == w->capacity) {
+        uint32_t capacity = w->capacity ? w->capacity * 2 : 1024;
+        struct manifest_record* records = realloc(w->records, (size_t)capacity * sizeof(struct manifest_record));
+        if (records == NULL) {
+            w->error = 1;
+            return NULL;
+        }
+        w->records = records;
+        w->capacity = capacity;
+    }
+
+    struct manifest_record* rec = &w->records[w->count++];
+    memset(rec, 0, sizeof(*rec));
+    rec->type = type;
+    rec->mode = st->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISUID | S_ISGID);
+    rec->uid = st->st_uid;
+    rec->gid = st->st_gid;
+    rec->atime = st->st_atime;
+    rec->mtime = st->st_mtime;
+    rec->ctime = st->st_ctime;
+    rec->size = type == 'f' ? (uint64_t)st->st_size : 0;
+    rec->path = add_string(w, path);
+    rec->selabel = add_label(w, selabel);
+    rec->link = link != NULL ? add_string(w, link) : NO_INDEX;
+    rec->digest = NO_INDEX;
+    return rec;
+}
+
+int manifest_writer_add(manifest_writer* w, char type, const struct stat* st,
+                        const char* selabel, const char* path, const char* link,
+                        const unsigned char* digest, int codec) {
+    struct manifest_record* rec = add_record(w, type, st, selabel, path, link);
+    if (rec == NULL)
+        return -1;
+    if (digest != NULL) {
+        rec->digest = add_digest(w, digest);
+        rec->codec = codec;
+        if (codec != BLOB_CODEC_RAW)
+            w->uses_codecs = 1;
+    }
+    return w->error ? -1 : 0;
+}
+
+int manifest_writer_add_chunks(manifest_writer* w, const struct stat* st, const char* selabel,
+                               const char* path, const unsigned char* digests,
+                               const unsigned char* codecs, uint32_t count) {
+    uint32_t i;
+    if ((uint64_t)w->chunks_size + count + 1 > UINT32_MAX) {
+        w->error = 1;
+        return -1;
+    }
+    if (w->chunks_size + count + 1 > w->chunks_capacity) {
+        uint32_t capacity = w->chunks_capacity ? w->chunks_capacity : 4096;
+        while (capacity < w->chunks_size + count + 1)
+            capacity *= 2;
+        uint32_t* chunks = realloc(w->chunks, (size_t)capacity * sizeof(uint32_t));
+        if (chunks == NULL) {
+            w->error = 1;
+            return -1;
+        }
+        w->chunks = chunks;
+        w->chunks_capacity = capacity;
+    }
+
+    struct manifest_record* rec = add_record(w, 'f', st, selabel, path, NULL);
+    if (rec == NULL)
+        return -1;
+    rec->flags |= RECORD_CHUNKED;
+    rec->digest = w->chunks_size;
+    w->chunks[w->chunks_size++] = count;
+    for (i = 0; i < count; i++) {
+        uint32_t index = add_digest(w, digests + (size_t)i * SHA256_DIGEST_LENGTH);
+        if (index > CHUNK_INDEX_MASK)
+            w->error = 1;
+        if (codecs[i] != BLOB_CODEC_RAW)
+            w->uses_codecs = 1;
+        w->chunks[w->chunks_size++] = index | (uint32_t)codecs[i] << CHUNK_CODEC_SHIFT;
+    }
+    return w->error ? -1 : 0;
+}
+
+// Empty arrays were never allocated, and fwrite() from NULL is undefined
+// even for no bytes.
+static int write_array(FILE* f, const void* data, size_t size) {
+    if (size == 0)
+        return 0;
+    return fwrite(data, 1, size, f) == size ? 0 : -1;
+}
+
+int manifest_writer_close(manifest_writer* w) {
+    struct manifest_header h;
+    size_t records_size = (size_t)w->count * sizeof(struct manifest_record);
+    size_t digests_size = (size_t)w->digest_count * SHA256_DIGEST_LENGTH;
+    size_t chunks_size = (size_t)w->chunks_size * sizeof(uint32_t);
+    int ret = w->error ? -1 : 0;
+
+    if (ret == 0) {
+        memset(&h, 0, sizeof(h));
+        h.magic = MANIFEST_MAGIC;
+        h.record_size = sizeof(struct manifest_record);
+        h.entry_count = w->count;
+        h.digest_count = w->digest_count;
+        h.strings_size = w->strings_size;
+        h.chunks_size = w->chunks_size;
+        checksum(w->records, records_size, w->strings, w->strings_size, w->chunks, chunks_size, h.body_checksum);
+        checksum(w->digests, digests_size, NULL, 0, NULL, 0, h.digests_checksum);
+
+        // only require as new a reader as the features used need
+        int version = w->uses_codecs ? 5 : w->chunks_size ? 4 : 3;
+        if (fprintf(w->f, "dedupe\t%d\n", version) < 0
+                || fwrite(&h, sizeof(h), 1, w->f) != 1
+                || write_array(w->f, w->records, records_size) != 0
+                || write_array(w->f, w->digests, digests_size) != 0
+                || write_array(w->f, w->strings, w->strings_size) != 0
+                || write_array(w->f, w->chunks, chunks_size) != 0)
+            ret = -1;
+    }
+    if (fclose(w->f) != 0)
+        ret = -1;
+
+    digest_set_free(w->digest_index);
+    free(w->records);
+    free(w->strings);
+    free(w->digests);
+    free(w->chunks);
+    free(w);
+    return ret;
+}
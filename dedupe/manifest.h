@@ -0,0 +1,86 @@
+#ifndef DEDUPE_MANIFEST_H
+#define DEDUPE_MANIFEST_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
+// Version 1 and 2 manifests are tab separated text, version 3 and later are
+// binary:
+//
+//   "dedupe\t5\n"
+//   struct manifest_header
+//   struct manifest_record[entry_count]   fixed width, in walk order
+//   digests[digest_count][32]             unique blobs referenced
+//   strings[strings_size]                 NUL terminated, interned labels
+//   chunks[chunks_size]                   version 4, chunk lists of files
+//
+// The digest section doubles as the list of blob references, so gc can
+// read it without touching the entries. Version 4 adds chunked files and
+// version 5 compressed blobs; manifests are written with the oldest version
+// that can hold them.
+#define DEDUPE_VERSION 5
+
+// "abc/defg...": sha256 in hex with a slash after the third character
+#define BLOB_KEY_SIZE (SHA256_DIGEST_LENGTH * 2 + 2)
+
+void digest_to_key(const unsigned char* digest, char* key);
+// Parses a blob key back into a digest, returns -1 if it isn't one.
+int key_to_digest(const char* key, unsigned char* digest);
+
+typedef struct {
+    char type;                      // 'f', 'd' or 'l'
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    long atime;                     // times are 0 in version 1 manifests
+    long mtime;
+    long ctime;
+    uint64_t size;                  // files only
+    const char* path;
+    const char* selabel;
+    const char* link;               // symlinks only
+    const unsigned char* digest;    // files only, NULL if the key is not a digest
+    char key[BLOB_KEY_SIZE + 64];   // files only, blob name inside the blob dir
+                                    // without the codec suffix
+    int codec;                      // BLOB_CODEC_*
+    // chunked files have no digest or key, their content is the
+    // concatenation of these blobs
+    uint32_t chunk_count;
+    const unsigned char* chunks;    // chunk_count digests
+    const unsigned char* chunk_codecs;
+} manifest_entry;
+
+typedef struct manifest_reader manifest_reader;
+
+// Opens a manifest of any supported version. Prints an error and returns
+// NULL if it can't be read or is newer than DEDUPE_VERSION.
+manifest_reader* manifest_open(const char* path);
+int manifest_version(const manifest_reader* reader);
+// Returns 1 and fills |entry| (valid until the next call), 0 at the end and
+// -1 on a malformed manifest.
+int manifest_next(manifest_reader* reader, manifest_entry* entry);
+void manifest_close(manifest_reader* reader);
+
+// Calls |fn| for every blob referenced by the manifest at |path|. |digest|
+// is NULL for old manifests whose key does not parse as a digest. Codecs are
+// not reported; any stored form of a referenced digest counts as used.
+// Version 3 manifests only have their digest section read.
+typedef int (*manifest_blob_fn)(const char* key, const unsigned char* digest, void* cookie);
+int manifest_for_each_blob(const char* path, manifest_blob_fn fn, void* cookie);
+
+typedef struct manifest_writer manifest_writer;
+
+// Entries are kept in memory and written as a version 3 manifest on close.
+manifest_writer* manifest_writer_open(const char* path);
+int manifest_writer_add(manifest_writer* writer, char type, const struct stat* st,
+                        const char* selabel, const char* path, const char* link,
+                        const unsigned char* digest, int codec);
+// Adds a regular file stored as |count| chunks.
+int manifest_writer_add_chunks(manifest_writer* writer, const struct stat* st, const char* selabel,
+                               const char* path, const unsigned char* digests,
+                               const unsigned char* codecs, uint32_t count);
+// Returns 0 if the manifest was written completely.
+int manifest_writer_close(manifest_writer* writer);
+
+#endif
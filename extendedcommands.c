@@ -65,9 +65,9 @@
 
 // number of actions added for each volume by add_nandroid_options_for_volume()
 // these go on top of menu list
-#define NANDROID_ACTIONS_NUM 4
+#define NANDROID_ACTIONS_NUM 5
 // number of fixed bottom entries after volume actions
-#define NANDROID_FIXED_ENTRIES 2
+#define NANDROID_FIXED_ENTRIES 3
 
 #if defined(ENABLE_LOKI) && defined(BOARD_NATIVE_DUALBOOT_SINGLEDATA)
 #define FIXED_ADVANCED_ENTRIES 10
@@ -509,6 +509,47 @@ static void show_nandroid_restore_menu(const char* path) {
     free(file);
 }
 
+static void generate_backup_path(const char* path, char* backup_path) {
+    time_t t = time(NULL);
+    struct tm *tmp = localtime(&t);
+    if (tmp == NULL) {
+        struct timeval tp;
+        gettimeofday(&tp, NULL);
+        sprintf(backup_path, "%s/clockworkmod/backup/%ld", path, tp.tv_sec);
+    } else {
+        char path_fmt[PATH_MAX];
+        strftime(path_fmt, sizeof(path_fmt), "clockworkmod/backup/%F.%H.%M.%S", tmp);
+        // this sprintf results in:
+        // clockworkmod/backup/%F.%H.%M.%S (time values are populated too)
+        sprintf(backup_path, "%s/%s", path, path_fmt);
+    }
+}
+
+static void show_nandroid_incremental_backup_menu(const char* path) {
+    if (ensure_path_mounted(path) != 0) {
+        LOGE("Can't mount %s\n", path);
+        return;
+    }
+
+    static const char* headers[] = { "Choose a backup to build on", "", NULL };
+
+    char tmp[PATH_MAX];
+    sprintf(tmp, "%s/clockworkmod/backup/", path);
+    char* file = choose_file_menu(tmp, NULL, headers);
+    if (file == NULL)
+        return;
+
+    // only what changed since |file| is stored, so it must be kept around
+    if (nandroid_check_backup_parent(file) == 0) {
+        char backup_path[PATH_MAX];
+        generate_backup_path(path, backup_path);
+        nandroid_set_backup_parent(file);
+        nandroid_backup(backup_path);
+    }
+
+    free(file);
+}
+
 static void show_nandroid_delete_menu(const char* path) {
     if (ensure_path_mounted(path) != 0) {
         LOGE("Can't mount %s\n", path);
@@ -523,7 +564,10 @@ static void show_nandroid_delete_menu(const char* path) {
     if (file == NULL)
         return;
 
-    if (confirm_selection("Confirm delete?", "Yes - Delete")) {
+    // incremental backups need their parent to be restored
+    if (nandroid_find_backup_child(file, tmp) == 0) {
+        ui_print("%s builds on this backup.\nDelete it first.\n", tmp);
+    } else if (confirm_selection("Confirm delete?", "Yes - Delete")) {
         sprintf(tmp, "rm -rf %s", file);
         __system(tmp);
     }
@@ -1178,50 +1222,60 @@ static void run_dedupe_gc() {
 
 static void choose_default_backup_format() {
     static const char* headers[] = { "Default Backup Format", "", NULL };
+    static const struct {
+        unsigned int fmt;
+        const char* value;
+        const char* label;
+        const char* name;
+    } formats[] = {
+        { NANDROID_BACKUP_FORMAT_TAR, "tar", "tar", "tar" },
+        { NANDROID_BACKUP_FORMAT_DUP, "dup", "dup", "dedupe" },
+        { NANDROID_BACKUP_FORMAT_TGZ, "tgz", "tar + gzip", "tar + gzip" },
+        { NANDROID_BACKUP_FORMAT_ZST, "zst", "tar + zstd", "tar + zstd" },
+        { NANDROID_BACKUP_FORMAT_LZ4, "lz4", "tar + lz4", "tar + lz4" },
+    };
+    char items[NANDROID_BACKUP_FORMAT_COUNT][32];
+    char* list[NANDROID_BACKUP_FORMAT_COUNT + 1];
+    int shown[NANDROID_BACKUP_FORMAT_COUNT];
+    int count = 0;
+    unsigned int i;
 
-    int fmt = nandroid_get_default_backup_format();
-
-    char **list;
-    char* list_tar_default[] = { "tar (default)",
-                                 "dup",
-                                 "tar + gzip",
-                                 NULL };
-    char* list_dup_default[] = { "tar",
-                                 "dup (default)",
-                                 "tar + gzip",
-                                 NULL };
-    char* list_tgz_default[] = { "tar",
-                                 "dup",
-                                 "tar + gzip (default)",
-                                 NULL };
+    unsigned int fmt = nandroid_get_default_backup_format();
 
-    if (fmt == NANDROID_BACKUP_FORMAT_DUP) {
-        list = list_dup_default;
-    } else if (fmt == NANDROID_BACKUP_FORMAT_TGZ) {
-        list = list_tgz_default;
-    } else {
-        list = list_tar_default;
+    // zstd and lz4 are only offered when recovery was built with them
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        if (!nandroid_backup_format_supported(formats[i].fmt))
+            continue;
+        snprintf(items[count], sizeof(items[count]), "%s%s", formats[i].label,
+                 formats[i].fmt == fmt ? " (default)" : "");
+        list[count] = items[count];
+        shown[count++] = i;
     }
+    list[count] = NULL;
 
     char path[PATH_MAX];
     sprintf(path, "%s%s%s", get_primary_storage_path(), (is_data_media() ? "/0/" : "/"), NANDROID_BACKUP_FORMAT_FILE);
     int chosen_item = get_menu_selection(headers, list, 0, 0);
-    switch (chosen_item) {
-        case 0: {
-            write_string_to_file(path, "tar");
-            ui_print("Default backup format set to tar.\n");
-            break;
-        }
-        case 1: {
-            write_string_to_file(path, "dup");
-            ui_print("Default backup format set to dedupe.\n");
-            break;
-        }
-        case 2: {
-            write_string_to_file(path, "tgz");
-            ui_print("Default backup format set to tar + gzip.\n");
-            break;
-        }
+    if (chosen_item < 0 || chosen_item >= count)
+        return;
+    write_string_to_file(path, formats[shown[chosen_item]].value);
+    ui_print("Default backup format set to %s.\n", formats[shown[chosen_item]].name);
+}
+
+static void choose_backup_digest() {
+    static const char* headers[] = { "Backup Checksum", "", NULL };
+
+    char* list[] = { "md5", "sha256", NULL };
+    char* list_md5_default[] = { "md5 (default)", "sha256", NULL };
+    char* list_sha256_default[] = { "md5", "sha256 (default)", NULL };
+    char** shown = nandroid_get_backup_digest() == NANDROID_DIGEST_SHA256 ? list_sha256_default : list_md5_default;
+
+    char path[PATH_MAX];
+    sprintf(path, "%s%s%s", get_primary_storage_path(), (is_data_media() ? "/0/" : "/"), NANDROID_BACKUP_DIGEST_FILE);
+    int chosen_item = get_menu_selection(headers, shown, 0, 0);
+    if (chosen_item == 0 || chosen_item == 1) {
+        write_string_to_file(path, list[chosen_item]);
+        ui_print("Backup checksum set to %s.\n", list[chosen_item]);
     }
 }
 
@@ -1239,6 +1293,9 @@ static void add_nandroid_options_for_volume(char** menu, char* path, int offset)
 
     sprintf(buf, "advanced restore from %s", path);
     menu[offset + 3] = strdup(buf);
+
+    sprintf(buf, "incremental backup to %s", path);
+    menu[offset + 4] = strdup(buf);
 }
 
 int show_nandroid_menu() {
@@ -1269,6 +1326,7 @@ int show_nandroid_menu() {
     // fixed bottom entries
     list[offset] = "free unused backup data";
     list[offset + 1] = "choose default backup format";
+    list[offset + 2] = "choose backup checksum";
     offset += NANDROID_FIXED_ENTRIES;
 
 #ifdef RECOVERY_EXTEND_NANDROID_MENU
@@ -1290,6 +1348,8 @@ int show_nandroid_menu() {
             run_dedupe_gc();
         } else if (chosen_item == (action_entries_num + 1)) {
             choose_default_backup_format();
+        } else if (chosen_item == (action_entries_num + 2)) {
+            choose_backup_digest();
         } else if (chosen_item < action_entries_num) {
             // get nandroid volume actions path
             if (chosen_item < NANDROID_ACTIONS_NUM) {
@@ -1302,19 +1362,7 @@ int show_nandroid_menu() {
             switch (chosen_subitem) {
                 case 0: {
                     char backup_path[PATH_MAX];
-                    time_t t = time(NULL);
-                    struct tm *tmp = localtime(&t);
-                    if (tmp == NULL) {
-                        struct timeval tp;
-                        gettimeofday(&tp, NULL);
-                        sprintf(backup_path, "%s/clockworkmod/backup/%ld", chosen_path, tp.tv_sec);
-                    } else {
-                        char path_fmt[PATH_MAX];
-                        strftime(path_fmt, sizeof(path_fmt), "clockworkmod/backup/%F.%H.%M.%S", tmp);
-                        // this sprintf results in:
-                        // clockworkmod/backup/%F.%H.%M.%S (time values are populated too)
-                        sprintf(backup_path, "%s/%s", chosen_path, path_fmt);
-                    }
+                    generate_backup_path(chosen_path, backup_path);
                     nandroid_backup(backup_path);
                     break;
                 }
@@ -1327,6 +1375,9 @@ int show_nandroid_menu() {
                 case 3:
                     show_nandroid_advanced_restore_menu(chosen_path);
                     break;
+                case 4:
+                    show_nandroid_incremental_backup_menu(chosen_path);
+                    break;
                 default:
                     break;
             }
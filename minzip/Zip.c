@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
 #include <sys/stat.h>   // for S_ISLNK()
@@ -25,6 +26,17 @@
 
 #define SORT_ENTRIES 1
 
+/*
+ * Stored entries are handed to the process function straight from the
+ * mapping, this much at a time.
+ */
+#define STORED_CHUNK_SIZE (1024 * 1024)
+
+/*
+ * Most workers MZ_EXTRACT_PARALLEL uses.
+ */
+#define MZ_EXTRACT_MAX_THREADS 8
+
 /*
  * Offset and length constants (java.util.zip naming convention).
  */
@@ -511,6 +523,67 @@ const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
                 itemHash, (char*) entryName, hashcmpZipName, false);
 }
 
+/*
+ * Compare the start of "pEntry"'s name with the "prefixLen" bytes of
+ * "prefix", ordered the way parseZipArchive() sorts the entries.  Returns
+ * zero if the name starts with the prefix.
+ */
+static int comparePrefix(const ZipEntry* pEntry, const char* prefix,
+        unsigned int prefixLen)
+{
+    unsigned int len = pEntry->fileNameLen < prefixLen ?
+            pEntry->fileNameLen : prefixLen;
+    int diff = memcmp(pEntry->fileName, prefix, len);
+    if (diff == 0 && pEntry->fileNameLen < prefixLen) {
+        diff = -1;
+    }
+    return diff;
+}
+
+/*
+ * Find the entries whose names start with "prefix".
+ *
+ * The entries are sorted by name, so they are all next to each other and
+ * two binary searches find them.
+ */
+void mzFindZipEntryRange(const ZipArchive* pArchive, const char* prefix,
+        unsigned int* first, unsigned int* last)
+{
+#if SORT_ENTRIES
+    unsigned int prefixLen = strlen(prefix);
+    unsigned int low, high;
+
+    /* first entry that doesn't sort before the prefix */
+    low = 0;
+    high = pArchive->numEntries;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (comparePrefix(&pArchive->pEntries[mid], prefix, prefixLen) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *first = low;
+
+    /* first entry after it that sorts after the prefix */
+    high = pArchive->numEntries;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (comparePrefix(&pArchive->pEntries[mid], prefix, prefixLen) <= 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *last = low;
+#else
+    /* the entries are in archive order, don't narrow it down */
+    *first = 0;
+    *last = pArchive->numEntries;
+#endif
+}
+
 /*
  * Return true if the entry is a symbolic link.
  */
@@ -522,32 +595,38 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
+/*
+ * The data of "pEntry".  mzOpenZipArchive() maps the whole archive and
+ * parseZipArchive() checks that every entry lies inside the mapping, so
+ * entries are read from memory and never through the shared fd; any number
+ * of them can be read at once.
+ */
+static const unsigned char* entryData(const ZipArchive *pArchive,
+    const ZipEntry *pEntry)
+{
+    return (const unsigned char*)pArchive->map.addr + pEntry->offset;
+}
+
 /* Call processFunction on the uncompressed data of a STORED entry.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
+    const unsigned char* data = entryData(pArchive, pEntry);
     size_t bytesLeft = pEntry->compLen;
     while (bytesLeft > 0) {
-        unsigned char buf[32 * 1024];
-        ssize_t n;
         size_t count;
-        bool ret;
 
+        /* dataLen is an int */
         count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
+        if (count > STORED_CHUNK_SIZE) {
+            count = STORED_CHUNK_SIZE;
         }
-        n = read(pArchive->fd, buf, count);
-        if (n < 0 || (size_t)n != count) {
-            LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
-            return false;
-        }
-        ret = processFunction(buf, n, cookie);
-        if (!ret) {
+        if (!processFunction(data, count, cookie)) {
             return false;
         }
+        data += count;
         bytesLeft -= count;
     }
     return true;
@@ -558,23 +637,19 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     void *cookie)
 {
     long result = -1;
-    unsigned char readBuf[32 * 1024];
     unsigned char procBuf[32 * 1024];
     z_stream zstream;
     int zerr;
-    long compRemaining;
-
-    compRemaining = pEntry->compLen;
 
     /*
-     * Initialize the zlib stream.
+     * Initialize the zlib stream.  All of the input is in the mapping.
      */
     memset(&zstream, 0, sizeof(zstream));
     zstream.zalloc = Z_NULL;
     zstream.zfree = Z_NULL;
     zstream.opaque = Z_NULL;
-    zstream.next_in = NULL;
-    zstream.avail_in = 0;
+    zstream.next_in = (Bytef*) entryData(pArchive, pEntry);
+    zstream.avail_in = pEntry->compLen;
     zstream.next_out = (Bytef*) procBuf;
     zstream.avail_out = sizeof(procBuf);
     zstream.data_type = Z_UNKNOWN;
@@ -598,26 +673,7 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
      * Loop while we have data.
      */
     do {
-        /* read as much as we can */
-        if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
-            LOGVV("+++ reading %ld bytes (%ld left)\n",
-                getSize, compRemaining);
-
-            int cc = read(pArchive->fd, readBuf, getSize);
-            if (cc != (int) getSize) {
-                LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
-                goto z_bail;
-            }
-
-            compRemaining -= getSize;
-
-            zstream.next_in = readBuf;
-            zstream.avail_in = getSize;
-        }
-
-        /* uncompress the data */
+        /* uncompress the data; input that runs out early is a Z_BUF_ERROR */
         zerr = inflate(&zstream, Z_NO_FLUSH);
         if (zerr != Z_OK && zerr != Z_STREAM_END) {
             LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
@@ -674,13 +730,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
 
     switch (pEntry->compression) {
     case STORED:
@@ -695,8 +744,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
@@ -907,6 +954,215 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/* Create the regular file "targetFile" from "pEntry".  Called from the
+ * extraction workers; the SELinux file creation context is per thread.
+ */
+static bool extractFile(const ZipArchive *pArchive, const ZipEntry *pEntry,
+        const char *targetFile, const struct utimbuf *timestamp,
+        struct selabel_handle *sehnd)
+{
+    char *secontext = NULL;
+
+    if (sehnd) {
+        selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
+        setfscreatecon(secontext);
+    }
+
+    int fd = creat(targetFile, UNZIP_FILEMODE);
+
+    if (secontext) {
+        freecon(secontext);
+        setfscreatecon(NULL);
+    }
+
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                targetFile, strerror(errno));
+        return false;
+    }
+
+    bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+    close(fd);
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", targetFile);
+        return false;
+    }
+
+    if (timestamp != NULL && utime(targetFile, timestamp)) {
+        LOGE("Error touching \"%s\"\n", targetFile);
+        return false;
+    }
+
+    LOGD("Extracted file \"%s\"\n", targetFile);
+    return true;
+}
+
+/* One entry to extract.  Regular files stay MZ_JOB_PENDING until a worker
+ * (or the calling thread) has written them.
+ */
+enum { MZ_JOB_PENDING, MZ_JOB_DONE, MZ_JOB_FAILED };
+
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;
+    int state;
+} MzExtractJob;
+
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    struct selabel_handle *sehnd;
+    MzExtractJob *jobs;
+    unsigned int count;
+    unsigned int next;          /* first job a worker may still take */
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} MzExtractPool;
+
+/* Create the directory or symlink "job" stands for.  A regular file only
+ * gets its containing directory and is left MZ_JOB_PENDING.  Returns false,
+ * with the job MZ_JOB_FAILED, on failure.
+ */
+static bool createEntry(const ZipArchive *pArchive, MzExtractJob *job,
+        int flags, const struct utimbuf *timestamp,
+        struct selabel_handle *sehnd)
+{
+    const ZipEntry *pEntry = job->pEntry;
+    const char *targetFile = job->targetFile;
+
+    /* With DRY_RUN set, invoke the callback but don't do anything else.
+     */
+    if (flags & MZ_EXTRACT_DRY_RUN) {
+        job->state = MZ_JOB_DONE;
+        return true;
+    }
+
+    /* Create the file or directory.
+     */
+    job->state = MZ_JOB_FAILED;
+    if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
+        if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
+            int ret = dirCreateHierarchy(
+                    targetFile, UNZIP_DIRMODE, timestamp, false, sehnd);
+            if (ret != 0) {
+                LOGE("Can't create containing directory for \"%s\": %s\n",
+                        targetFile, strerror(errno));
+                return false;
+            }
+            LOGD("Extracted dir \"%s\"\n", targetFile);
+        }
+    } else {
+        /* This is not a directory.  First, make sure that
+         * the containing directory exists.
+         */
+        int ret = dirCreateHierarchy(
+                targetFile, UNZIP_DIRMODE, timestamp, true, sehnd);
+        if (ret != 0) {
+            LOGE("Can't create containing directory for \"%s\": %s\n",
+                    targetFile, strerror(errno));
+            return false;
+        }
+
+        /* With FILES_ONLY set, we need to ignore metadata entirely,
+         * so treat symlinks as regular files.
+         */
+        if (!(flags & MZ_EXTRACT_FILES_ONLY) && mzIsZipEntrySymlink(pEntry)) {
+            /* The entry is a symbolic link.
+             * The relative target of the symlink is in the
+             * data section of this entry.
+             */
+            if (pEntry->uncompLen == 0) {
+                LOGE("Symlink entry \"%s\" has no target\n",
+                        targetFile);
+                return false;
+            }
+            char *linkTarget = malloc(pEntry->uncompLen + 1);
+            if (linkTarget == NULL) {
+                return false;
+            }
+            if (!mzReadZipEntry(pArchive, pEntry, linkTarget,
+                    pEntry->uncompLen)) {
+                LOGE("Can't read symlink target for \"%s\"\n",
+                        targetFile);
+                free(linkTarget);
+                return false;
+            }
+            linkTarget[pEntry->uncompLen] = '\0';
+
+            /* Make the link.
+             */
+            ret = symlink(linkTarget, targetFile);
+            if (ret != 0) {
+                LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
+                        targetFile, linkTarget, strerror(errno));
+                free(linkTarget);
+                return false;
+            }
+            LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
+                    targetFile, linkTarget);
+            free(linkTarget);
+        } else {
+            /* The entry is a regular file, written by the caller.
+             */
+            job->state = MZ_JOB_PENDING;
+            return true;
+        }
+    }
+    job->state = MZ_JOB_DONE;
+    return true;
+}
+
+static void *extractWorker(void *arg)
+{
+    MzExtractPool *pool = (MzExtractPool *)arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop) {
+        while (pool->next < pool->count &&
+                pool->jobs[pool->next].state != MZ_JOB_PENDING) {
+            pool->next++;
+        }
+        if (pool->next == pool->count) {
+            break;
+        }
+        MzExtractJob *job = &pool->jobs[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+
+        bool ok = extractFile(pool->pArchive, job->pEntry, job->targetFile,
+                pool->timestamp, pool->sehnd);
+
+        pthread_mutex_lock(&pool->lock);
+        job->state = ok ? MZ_JOB_DONE : MZ_JOB_FAILED;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* How many workers to extract "files" regular files with; 0 means the
+ * calling thread does it all.
+ */
+static int extractThreadCount(int flags, unsigned int files)
+{
+    long cpus;
+
+    if (!(flags & MZ_EXTRACT_PARALLEL)) {
+        return 0;
+    }
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > MZ_EXTRACT_MAX_THREADS) {
+        cpus = MZ_EXTRACT_MAX_THREADS;
+    }
+    if (cpus > (long)files) {
+        cpus = files;
+    }
+    return cpus > 1 ? cpus : 0;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -977,188 +1233,139 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
-    /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
-     */
-    unsigned int i;
-    bool seenMatch = false;
-    int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
-        ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
+    /* Everything whose path begins with zpath.  If zpath is empty, that is
+     * the whole archive, which is what we want.
 //TODO: look out for a single empty directory entry that matches zpath, but
 //      missing the trailing slash.  Most zip files seem to include
 //      the trailing slash, but I think it's legal to leave it off.
 //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
+     */
+    unsigned int first, last;
+    mzFindZipEntryRange(pArchive, zpath, &first, &last);
+
+    /* +1 so that an empty range still gets an allocation */
+    MzExtractJob *jobs = (MzExtractJob *)calloc(last - first + 1,
+            sizeof(MzExtractJob));
+    if (jobs == NULL) {
+        LOGE("Can't allocate %u extraction jobs\n", last - first);
+        free(zpath);
+        return false;
+    }
+
+    unsigned int i;
+    unsigned int count = 0;
+    unsigned int files = 0;
+    bool collected = true;
+    int ok = true;
+    for (i = first; i < last; i++) {
+        ZipEntry *pEntry = pArchive->pEntries + i;
+        if (pEntry->fileNameLen < zipDirLen ||
+                strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
+            /* Only possible when the entries aren't sorted.
              */
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
             continue;
         }
-        /* If zpath is empty, this strncmp() will match everything,
-         * which is what we want.
-         */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* This entry begins with zipDir, so we'll extract it.
-         */
-        seenMatch = true;
 
         /* Find the target location of the entry.
          */
         const char *targetFile = targetEntryPath(&helper, pEntry);
-        if (targetFile == NULL) {
+        char *copy = targetFile != NULL ? strdup(targetFile) : NULL;
+        if (copy == NULL) {
             LOGE("Can't assemble target path for \"%.*s\"\n",
                     pEntry->fileNameLen, pEntry->fileName);
+            collected = false;
+            break;
+        }
+        jobs[count].pEntry = pEntry;
+        jobs[count].targetFile = copy;
+        count++;
+    }
+
+    /* With MZ_EXTRACT_PARALLEL, create the directories and symlinks up
+     * front, in order, so that the regular files can then be written in any
+     * order.  Otherwise every entry is created in archive order below.
+     */
+    bool parallel = (flags & MZ_EXTRACT_PARALLEL) != 0;
+    for (i = 0; parallel && i < count; i++) {
+        if (!createEntry(pArchive, &jobs[i], flags, timestamp, sehnd)) {
             ok = false;
             break;
         }
+        if (jobs[i].state == MZ_JOB_PENDING) {
+            files++;
+        }
+    }
 
-        /* With DRY_RUN set, invoke the callback but don't do anything else.
-         */
-        if (flags & MZ_EXTRACT_DRY_RUN) {
-            if (callback != NULL) callback(targetFile, cookie);
-            continue;
+    /* Hand the regular files to the workers.  After a failure above the
+     * files before it are still written, one at a time.
+     */
+    MzExtractPool pool;
+    pthread_t threads[MZ_EXTRACT_MAX_THREADS];
+    int threadCount = ok ? extractThreadCount(flags, files) : 0;
+    int t;
+
+    pool.pArchive = pArchive;
+    pool.timestamp = timestamp;
+    pool.sehnd = sehnd;
+    pool.jobs = jobs;
+    pool.count = count;
+    pool.next = 0;
+    pool.stop = false;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    for (t = 0; t < threadCount; t++) {
+        if (pthread_create(&threads[t], NULL, extractWorker, &pool) != 0) {
+            break;
         }
+    }
+    threadCount = t;
 
-        /* Create the file or directory.
-         */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
-        if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
-            if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
-                int ret = dirCreateHierarchy(
-                        targetFile, UNZIP_DIRMODE, timestamp, false, sehnd);
-                if (ret != 0) {
-                    LOGE("Can't create containing directory for \"%s\": %s\n",
-                            targetFile, strerror(errno));
-                    ok = false;
-                    break;
-                }
-                LOGD("Extracted dir \"%s\"\n", targetFile);
-            }
-        } else {
-            /* This is not a directory.  First, make sure that
-             * the containing directory exists.
-             */
-            int ret = dirCreateHierarchy(
-                    targetFile, UNZIP_DIRMODE, timestamp, true, sehnd);
-            if (ret != 0) {
-                LOGE("Can't create containing directory for \"%s\": %s\n",
-                        targetFile, strerror(errno));
+    /* Report the entries in archive order as they are finished.
+     */
+    for (i = 0; i < count; i++) {
+        MzExtractJob *job = &jobs[i];
+
+        if (threadCount == 0) {
+            if (!parallel &&
+                    !createEntry(pArchive, job, flags, timestamp, sehnd)) {
                 ok = false;
                 break;
             }
-
-            /* With FILES_ONLY set, we need to ignore metadata entirely,
-             * so treat symlinks as regular files.
-             */
-            if (!(flags & MZ_EXTRACT_FILES_ONLY) && mzIsZipEntrySymlink(pEntry)) {
-                /* The entry is a symbolic link.
-                 * The relative target of the symlink is in the
-                 * data section of this entry.
-                 */
-                if (pEntry->uncompLen == 0) {
-                    LOGE("Symlink entry \"%s\" has no target\n",
-                            targetFile);
-                    ok = false;
-                    break;
-                }
-                char *linkTarget = malloc(pEntry->uncompLen + 1);
-                if (linkTarget == NULL) {
-                    ok = false;
-                    break;
-                }
-                ok = mzReadZipEntry(pArchive, pEntry, linkTarget,
-                        pEntry->uncompLen);
-                if (!ok) {
-                    LOGE("Can't read symlink target for \"%s\"\n",
-                            targetFile);
-                    free(linkTarget);
-                    break;
-                }
-                linkTarget[pEntry->uncompLen] = '\0';
-
-                /* Make the link.
-                 */
-                ret = symlink(linkTarget, targetFile);
-                if (ret != 0) {
-                    LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
-                            targetFile, linkTarget, strerror(errno));
-                    free(linkTarget);
-                    ok = false;
-                    break;
-                }
-                LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
-                        targetFile, linkTarget);
-                free(linkTarget);
-            } else {
-                /* The entry is a regular file.
-                 * Open the target for writing.
-                 */
-
-                char *secontext = NULL;
-
-                if (sehnd) {
-                    selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
-                    setfscreatecon(secontext);
-                }
-
-                int fd = creat(targetFile, UNZIP_FILEMODE);
-
-                if (secontext) {
-                    freecon(secontext);
-                    setfscreatecon(NULL);
-                }
-
-                if (fd < 0) {
-                    LOGE("Can't create target file \"%s\": %s\n",
-                            targetFile, strerror(errno));
-                    ok = false;
-                    break;
-                }
-
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                LOGD("Extracted file \"%s\"\n", targetFile);
+            if (job->state == MZ_JOB_PENDING) {
+                job->state = extractFile(pArchive, job->pEntry,
+                        job->targetFile, timestamp, sehnd) ?
+                        MZ_JOB_DONE : MZ_JOB_FAILED;
+            }
+        } else {
+            pthread_mutex_lock(&pool.lock);
+            while (job->state == MZ_JOB_PENDING) {
+                pthread_cond_wait(&pool.cond, &pool.lock);
             }
+            pthread_mutex_unlock(&pool.lock);
+        }
+        if (job->state == MZ_JOB_FAILED) {
+            ok = false;
+            break;
         }
 
-        if (callback != NULL) callback(targetFile, cookie);
+        if (callback != NULL) callback(job->targetFile, cookie);
     }
 
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = true;
+    pthread_mutex_unlock(&pool.lock);
+    for (t = 0; t < threadCount; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+
+    for (i = 0; i < count; i++) {
+        free(jobs[i].targetFile);
+    }
+    free(jobs);
     free(helper.buf);
     free(zpath);
 
-    return ok;
+    return ok && collected;
 }
@@ -85,6 +85,15 @@ void mzCloseZipArchive(ZipArchive* pArchive);
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName);
 
+/*
+ * Find the entries whose names start with "prefix" (e.g. "system/"), as
+ * the indexes [*first, *last) for mzGetZipEntryAt().  The range is empty
+ * if there are none.  Names that don't start with the prefix may be
+ * included when the archive isn't sorted, so callers still check each one.
+ */
+void mzFindZipEntryRange(const ZipArchive* pArchive, const char* prefix,
+        unsigned int* first, unsigned int* last);
+
 /*
  * Get the number of entries in the Zip archive.
  */
@@ -152,6 +161,9 @@ typedef bool (*ProcessZipEntryContentsFunction)(const unsigned char *data,
  * mzProcessZipEntryContents() immediately returns false.
  *
  * This is useful for calculating the hash of an entry's uncompressed contents.
+ *
+ * The data comes straight from the archive's mapping, so entries may be
+ * processed from several threads at once.
  */
 bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
@@ -204,14 +216,22 @@ bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
  *
  *     MZ_EXTRACT_FILES_ONLY - only unpack files, not directories or symlinks
  *     MZ_EXTRACT_DRY_RUN - don't do anything, but do invoke the callback
+ *     MZ_EXTRACT_PARALLEL - write the files from one thread per CPU, after
+ *         creating every directory and symlink; without it each entry is
+ *         created in archive order
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
- * If callback is non-NULL, it will be invoked with each unpacked file.
+ * If callback is non-NULL, it will be invoked with each unpacked file, in
+ * archive order and from the calling thread.
  *
  * Returns true on success, false on failure.
  */
-enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+enum {
+    MZ_EXTRACT_FILES_ONLY = 1,
+    MZ_EXTRACT_DRY_RUN = 2,
+    MZ_EXTRACT_PARALLEL = 4,
+};
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
@@ -27,12 +27,15 @@
  * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/reboot.h>
 #include <sys/stat.h>
@@ -418,106 +421,157 @@ mmc_mount_partition(const MmcPartition *partition, const char *mount_point,
     return rv;
 }
 
-int
-mmc_raw_copy (const MmcPartition *partition, char *in_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-    char *out_file = partition->device_index;
-
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
+#define RAW_COPY_BUFFER_SIZE (1024 * 1024)
+// zero runs are detected at this granularity
+#define RAW_COPY_BLOCK_SIZE (64 * 1024)
+
+// from linux/fs.h, whose BLOCK_SIZE clashes with ours
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES _IO(0x12,124)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12,127)
+#endif
+
+enum {
+    RAW_OUT_FILE,   // regular file, zeros become holes
+    RAW_OUT_BLOCK,  // block device, zeros are discarded or zeroed out
+    RAW_OUT_STREAM, // pipe and such, zeros are written
+};
 
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
+static int
+raw_is_zero (const char *buf, size_t len) {
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
 
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
+static int
+raw_write (int fd, int kind, const char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = kind == RAW_OUT_STREAM ? write(fd, buf, len) : pwrite(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
 
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
+// Leaves [offset, offset + len) of |fd| reading back as zeros, without
+// writing them where that is possible.
+static int
+raw_zero_range (int fd, int kind, off_t offset, off_t len, int discard_zeroes, const char *zeros) {
+    if (len == 0 || kind == RAW_OUT_FILE)
+        return 0;
+    if (kind == RAW_OUT_BLOCK && (offset % 512) == 0 && (len % 512) == 0) {
+        uint64_t range[2] = { offset, len };
+        // a discard only counts when the device guarantees zeros after it
+        if (discard_zeroes && ioctl(fd, BLKDISCARD, &range) == 0)
+            return 0;
+        if (ioctl(fd, BLKZEROOUT, &range) == 0)
+            return 0;
     }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
+    while (len > 0) {
+        size_t n = len < RAW_COPY_BLOCK_SIZE ? len : RAW_COPY_BLOCK_SIZE;
+        if (raw_write(fd, kind, zeros, n, offset))
+            return -1;
+        offset += n;
+        len -= n;
     }
-
-    fsync(out);
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
-
+    return 0;
 }
 
-
-int
-mmc_raw_dump_internal (const char* in_file, const char *out_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
+// Copies |in_file| to |out_file| (an image or a partition, either way)
+// skipping runs of zero blocks: a dumped image gets holes instead, a
+// restored partition gets them discarded or zeroed out by the kernel.
+static int
+raw_copy (const char *in_file, const char *out_file) {
+    struct stat st;
+    char *buf = NULL;
+    char *zeros = NULL;
+    off_t offset = 0;
+    off_t zero_start = 0;
+    int discard_zeroes = 0;
+    int kind;
     int ret = -1;
 
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
+    int in = open(in_file, O_RDONLY | O_LARGEFILE);
+    if (in < 0)
+        return -1;
+    int out = open(out_file, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0666);
+    if (out < 0)
         goto ERROR2;
+    buf = malloc(RAW_COPY_BUFFER_SIZE);
+    zeros = calloc(1, RAW_COPY_BLOCK_SIZE);
+    if (buf == NULL || zeros == NULL || fstat(out, &st))
+        goto ERROR1;
 
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
-
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
+    if (S_ISREG(st.st_mode)) {
+        kind = RAW_OUT_FILE;
+    } else if (S_ISBLK(st.st_mode)) {
+        unsigned int zeroes = 0;
+        kind = RAW_OUT_BLOCK;
+        discard_zeroes = ioctl(out, BLKDISCARDZEROES, &zeroes) == 0 && zeroes;
+    } else {
+        kind = RAW_OUT_STREAM;
     }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
+
+    for (;;) {
+        ssize_t n = read(in, buf, RAW_COPY_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            goto ERROR1;
+        if (n == 0)
+            break;
+
+        ssize_t i;
+        for (i = 0; i < n; i += RAW_COPY_BLOCK_SIZE) {
+            size_t len = n - i < RAW_COPY_BLOCK_SIZE ? n - i : RAW_COPY_BLOCK_SIZE;
+            if (raw_is_zero(buf + i, len)) {
+                offset += len;
+                continue;
+            }
+            if (raw_zero_range(out, kind, zero_start, offset - zero_start, discard_zeroes, zeros))
                 goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
+            if (raw_write(out, kind, buf + i, len, offset))
                 goto ERROR1;
+            offset += len;
+            zero_start = offset;
         }
     }
+    if (raw_zero_range(out, kind, zero_start, offset - zero_start, discard_zeroes, zeros))
+        goto ERROR1;
+    // a trailing hole still counts towards the image size
+    if (kind == RAW_OUT_FILE && ftruncate(out, offset))
+        goto ERROR1;
 
     fsync(out);
     ret = 0;
 ERROR1:
-    fclose ( out );
+    free(buf);
+    free(zeros);
+    if (close(out))
+        ret = -1;
 ERROR2:
-    fclose ( in );
-ERROR3:
+    close(in);
     return ret;
+}
 
+int
+mmc_raw_copy (const MmcPartition *partition, char *in_file) {
+    return raw_copy(in_file, partition->device_index);
+}
+
+
+int
+mmc_raw_dump_internal (const char* in_file, const char *out_file) {
+    return raw_copy(in_file, out_file);
 }
 
 // TODO: refactor this to not be a giant copy paste mess
@@ -22,6 +22,7 @@
 #include <libgen.h>
 #include <limits.h>
 #include <linux/input.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,6 +30,7 @@
 #include <sys/limits.h>
 #include <sys/reboot.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/vfs.h>
 #include <sys/wait.h>
@@ -47,12 +49,19 @@
 #include "minzip/DirUtil.h"
 #include "mounts.h"
 #include "nandroid.h"
+#include "nandroid_archive.h"
+#include "nandroid_compress.h"
 #include "nandroid_md5.h"
+#include "nandroid_stream.h"
 #include "recovery_settings.h"
 #include "recovery_ui.h"
 #include "roots.h"
 
 #define NANDROID_FIELD_DEDUPE_CLEARED_SPACE 1
+// name of the backup an incremental backup builds on, see nandroid_read_parent()
+#define NANDROID_PARENT_FILE "nandroid.parent"
+// longest chain of incremental backups a restore follows
+#define NANDROID_MAX_PARENTS 32
 
 typedef void (*file_event_callback)(const char* filename);
 typedef int (*nandroid_backup_handler)(const char* backup_path, const char* backup_file_image, int callback);
@@ -61,6 +70,14 @@ typedef int (*nandroid_restore_handler)(const char* backup_file_image, const cha
 static int nandroid_backup_bitfield = 0;
 static unsigned int nandroid_files_total = 0;
 static unsigned int nandroid_files_count = 0;
+static uint64_t nandroid_bytes_total = 0;
+// checksum algorithm of the backup in progress
+static unsigned int nandroid_backup_digest = NANDROID_DIGEST_MD5;
+// parent of the next backup and of the one in progress, "" for full backups
+static char next_backup_parent[PATH_MAX] = "";
+static char nandroid_backup_parent[PATH_MAX] = "";
+// set once a partition of the current backup was stored against the parent
+static int nandroid_backup_used_parent = 0;
 
 static void nandroid_generate_timestamp_path(char* backup_path) {
     time_t t = time(NULL) + RECOVERY_TZ_OFFSET;
@@ -109,38 +126,120 @@ static void nandroid_callback(const char* filename) {
     }
 }
 
+// What the backups of |backup_path| leave out, as archive excludes. Returns
+// the number of patterns.
+static int nandroid_backup_excludes(const char* backup_path, const char** excludes) {
+    int count = 0;
+    excludes[count++] = "data/data/com.google.android.music/files/*";
+    if (strcmp(backup_path, "/data") == 0 && is_data_media())
+        excludes[count++] = "data/media";
+    return count;
+}
+
+// Sizes the progress bar for backing up |directory|: the file count for
+// handlers that report files, and the bytes the native archive handlers
+// report progress in. A whole filesystem is sized by statfs at no cost;
+// anything else (/data without the data-media sdcard, .android_secure on
+// the sdcard) is walked in process.
 static void compute_directory_stats(const char* directory) {
-    char tmp[PATH_MAX];
-    char count_text[100];
+    struct statfs sfs;
+    struct stat st;
+    struct stat parent_st;
+    char parent[PATH_MAX];
 
     // reset file count if we ever return before setting it
     nandroid_files_count = 0;
     nandroid_files_total = 0;
+    nandroid_bytes_total = 0;
 
-    sprintf(tmp, "find %s | %s wc -l > /tmp/dircount", directory, strcmp(directory, "/data") == 0 && is_data_media() ? "grep -v /data/media |" : "");
-    __system(tmp);
-
-    FILE* f = fopen("/tmp/dircount", "r");
-    if (f == NULL)
-        return;
+    strlcpy(parent, directory, sizeof(parent));
+    strlcat(parent, "/..", sizeof(parent));
+    int is_mount_point = stat(directory, &st) == 0 && stat(parent, &parent_st) == 0
+            && st.st_dev != parent_st.st_dev;
+    int excludes_data = strcmp(directory, "/data") == 0 && is_data_media();
 
-    if (fgets(count_text, sizeof(count_text), f) == NULL) {
-        fclose(f);
-        return;
+    if (is_mount_point && !excludes_data && statfs(directory, &sfs) == 0 && sfs.f_files > 0) {
+        nandroid_files_total = sfs.f_files - sfs.f_ffree;
+        nandroid_bytes_total = (uint64_t)(sfs.f_blocks - sfs.f_bfree) * sfs.f_bsize;
+    } else {
+        const char* excludes[2];
+        archive_options opts;
+        archive_stats stats;
+
+        memset(&opts, 0, sizeof(opts));
+        opts.excludes = excludes;
+        opts.exclude_count = nandroid_backup_excludes(directory, excludes);
+        archive_measure(directory, &opts, &stats);
+        nandroid_files_total = stats.entries;
+        nandroid_bytes_total = stats.bytes;
     }
 
-    size_t len = strlen(count_text);
-    if (count_text[len - 1] == '\n')
-        count_text[len - 1] = '\0';
-
-    fclose(f);
-    nandroid_files_total = atoi(count_text);
     ui_reset_progress();
     ui_show_progress(1, 0);
 }
 
+// What the backup or restore handler that just ran measured, see
+// NANDROID_STATS_FILE. Handlers name their format, the native ones fill in
+// the counters as well.
+static const char* nandroid_stats_format;
+static archive_counters nandroid_counters;
+// raw dumps record theirs from the background threads
+static pthread_mutex_t nandroid_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void nandroid_stats_reset() {
+    nandroid_stats_format = "unknown";
+    memset(&nandroid_counters, 0, sizeof(nandroid_counters));
+}
+
+static int stats_field(char* line, size_t size, int len, const char* name, uint64_t value) {
+    if (value == 0 || len >= (int)size)
+        return len;
+    return len + snprintf(line + len, size - len, " %s=%llu", name, (unsigned long long)value);
+}
+
+static int stats_seconds(char* line, size_t size, int len, const char* name, uint64_t usec) {
+    if (usec == 0 || len >= (int)size)
+        return len;
+    return len + snprintf(line + len, size - len, " %s=%.2f", name, usec / 1000000.0);
+}
+
+// Appends the line for |name| to the stats file in |dir|.
+static void nandroid_write_stats(const char* dir, int restore, const char* name, const char* format,
+                                 uint64_t usec, const archive_counters* c) {
+    char path[PATH_MAX];
+    char line[512];
+    int len;
+
+    if (strcmp(dir, "-") == 0)
+        return;
+    len = snprintf(line, sizeof(line), "%s %s %s seconds=%.2f", restore ? "restore" : "backup",
+                   name, format, usec / 1000000.0);
+    len = stats_field(line, sizeof(line), len, "entries", c->entries);
+    len = stats_field(line, sizeof(line), len, "read", c->bytes_in);
+    len = stats_field(line, sizeof(line), len, "written", c->bytes_out);
+    if (c->bytes_in != 0 && c->bytes_out != 0 && len < (int)sizeof(line)) {
+        double ratio = restore ? (double)c->bytes_in / c->bytes_out : (double)c->bytes_out / c->bytes_in;
+        len += snprintf(line + len, sizeof(line) - len, " ratio=%.3f", ratio);
+    }
+    len = stats_seconds(line, sizeof(line), len, "read_s", c->read_usec);
+    len = stats_seconds(line, sizeof(line), len, "compress_s", c->compress_usec);
+    len = stats_seconds(line, sizeof(line), len, "hash_s", c->hash_usec);
+    len = stats_seconds(line, sizeof(line), len, "write_s", c->write_usec);
+
+    snprintf(path, sizeof(path), "%s/%s", dir, NANDROID_STATS_FILE);
+    pthread_mutex_lock(&nandroid_stats_lock);
+    FILE* f = fopen(path, "a");
+    if (f != NULL) {
+        fprintf(f, "%s\n", line);
+        fclose(f);
+    }
+    pthread_mutex_unlock(&nandroid_stats_lock);
+    LOGI("%s\n", line);
+}
+
 static int mkyaffs2image_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
+    nandroid_stats_format = "yaffs2";
     sprintf(tmp, "cd %s ; mkyaffs2image . %s.img ; exit $?", backup_path, backup_file_image);
 
     FILE *fp = __popen(tmp, "r");
@@ -158,46 +257,203 @@ static int mkyaffs2image_wrapper(const char* backup_path, const char* backup_fil
     return __pclose(fp);
 }
 
-static int do_tar_compress(char* command, int callback) {
-    char buf[PATH_MAX];
+static void nandroid_archive_callback(const char* filename, uint64_t bytes, void* cookie) {
+    if (nandroid_bytes_total == 0) {
+        // no usable byte estimate, fall back to counting files
+        nandroid_callback(filename);
+        return;
+    }
 
-    set_perf_mode(1);
-    FILE *fp = __popen(command, "r");
-    if (fp == NULL) {
-        ui_print("Unable to execute tar command!\n");
-        set_perf_mode(0);
+    if (filename != NULL)
+        LOGI("%s\n", filename);
+    float progress_decimal = (float)((double)bytes / (double)nandroid_bytes_total);
+    if (progress_decimal > 1)
+        progress_decimal = 1;
+    ui_set_progress(progress_decimal);
+}
+
+// CPU budget of a backup: compression workers per archive, 0 = online cores
+static int nandroid_backup_threads() {
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.backup_threads", value, "0");
+    return atoi(value);
+}
+
+// Segment size of backups written to |path|: ro.cwm.backup_split_size bytes
+// when set (0 = never split), otherwise whatever suits its filesystem.
+static uint64_t nandroid_split_size(const char* path) {
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.backup_split_size", value, "");
+    if (value[0] != '\0')
+        return strtoull(value, NULL, 10);
+    return archive_split_size(path);
+}
+
+static void nandroid_segment_callback(const char* path, const unsigned char* md, unsigned int md_len, void* cookie) {
+    nandroid_md5_record(path, nandroid_backup_digest, md);
+}
+
+// Fills |path| with the backup called |label| that lives next to |backup_path|.
+static int nandroid_parent_path(const char* backup_path, const char* label, char* path) {
+    char tmp[PATH_MAX];
+    size_t len;
+
+    if (label[0] == '\0' || strchr(label, '/') != NULL || strcmp(label, ".") == 0 || strcmp(label, "..") == 0)
         return -1;
+    strlcpy(tmp, backup_path, sizeof(tmp));
+    len = strlen(tmp);
+    while (len > 1 && tmp[len - 1] == '/')
+        tmp[--len] = '\0';
+    snprintf(path, PATH_MAX, "%s/%s", dirname(tmp), label);
+    return 0;
+}
+
+// Incremental backups name the backup they build on in nandroid.parent.
+// Fills |parent| with its path and returns 0 if |backup_path| has one.
+static int nandroid_read_parent(const char* backup_path, char* parent) {
+    char tmp[PATH_MAX];
+    char label[PATH_MAX];
+
+    snprintf(tmp, sizeof(tmp), "%s/%s", backup_path, NANDROID_PARENT_FILE);
+    FILE* f = fopen(tmp, "r");
+    if (f == NULL)
+        return -1;
+    int ret = fgets(label, sizeof(label), f) != NULL ? 0 : -1;
+    fclose(f);
+    if (ret == 0) {
+        label[strcspn(label, "\n")] = '\0';
+        ret = nandroid_parent_path(backup_path, label, parent);
     }
+    return ret;
+}
 
-    while (fgets(buf, PATH_MAX, fp) != NULL) {
-        buf[PATH_MAX - 1] = '\0';
-        if (callback)
-            nandroid_callback(buf);
+int nandroid_find_backup_child(const char* backup_path, char* child) {
+    char tmp[PATH_MAX];
+    char dir[PATH_MAX];
+    char label[PATH_MAX];
+    char target[PATH_MAX];
+    char parent[PATH_MAX];
+    struct dirent* de;
+    size_t len;
+    int ret = -1;
+
+    strlcpy(tmp, backup_path, sizeof(tmp));
+    len = strlen(tmp);
+    while (len > 1 && tmp[len - 1] == '/')
+        tmp[--len] = '\0';
+    strlcpy(label, basename(tmp), sizeof(label));
+    if (nandroid_parent_path(tmp, label, target) != 0)
+        return -1;
+    strlcpy(dir, dirname(tmp), sizeof(dir));
+
+    DIR* d = opendir(dir);
+    if (d == NULL)
+        return -1;
+    while (ret != 0 && (de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        snprintf(child, PATH_MAX, "%s/%s", dir, de->d_name);
+        if (nandroid_read_parent(child, parent) == 0 && strcmp(parent, target) == 0)
+            ret = 0;
     }
+    closedir(d);
+    return ret;
+}
 
-    set_perf_mode(0);
-    return __pclose(fp);
+void nandroid_set_backup_parent(const char* parent_path) {
+    size_t len;
+
+    if (parent_path == NULL)
+        parent_path = "";
+    strlcpy(next_backup_parent, parent_path, sizeof(next_backup_parent));
+    // choose_file_menu() hands out directories with a trailing slash
+    len = strlen(next_backup_parent);
+    while (len > 1 && next_backup_parent[len - 1] == '/')
+        next_backup_parent[--len] = '\0';
 }
 
-static int tar_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+static const char* tar_extension(int compression) {
+    switch (compression) {
+        case ARCHIVE_COMPRESS_GZIP:
+            return "tar.gz";
+        case ARCHIVE_COMPRESS_ZSTD:
+            return "tar.zst";
+        case ARCHIVE_COMPRESS_LZ4:
+            return "tar.lz4";
+    }
+    return "tar";
+}
+
+static int tar_native_wrapper(const char* backup_path, const char* backup_file_image, int compression, int callback) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; touch %s.tar ; set -o pipefail ; (tar -cpv --exclude=data/data/com.google.android.music/files/* %s $(basename %s) | split -a 1 -b 1000000000 /proc/self/fd/0 %s.tar.) 2> /proc/self/fd/1 ; exit $?", backup_path, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "--exclude=data/media" : "", backup_path, backup_file_image);
+    char index[PATH_MAX];
+    char parent_index[PATH_MAX];
+    char label[PATH_MAX];
+    const char* excludes[2];
+    archive_options opts;
+    struct stat st;
+    int ret;
 
-    return do_tar_compress(tmp, callback);
+    memset(&opts, 0, sizeof(opts));
+    opts.excludes = excludes;
+    opts.exclude_count = nandroid_backup_excludes(backup_path, excludes);
+    opts.compression = compression;
+    opts.threads = nandroid_backup_threads();
+    if (callback)
+        opts.progress = nandroid_archive_callback;
+    opts.digest = nandroid_digest_md(nandroid_backup_digest);
+    opts.segment_done = nandroid_segment_callback;
+
+    // the index is what the next incremental backup compares against
+    sprintf(index, "%s.idx", backup_file_image);
+    opts.index = index;
+    if (nandroid_backup_parent[0] != '\0') {
+        strcpy(tmp, backup_file_image);
+        sprintf(parent_index, "%s/%s.idx", nandroid_backup_parent, basename(tmp));
+        if (stat(parent_index, &st) == 0) {
+            strcpy(label, nandroid_backup_parent);
+            opts.parent_index = parent_index;
+            opts.parent_label = basename(label);
+        } else {
+            ui_print("No index of %s in the parent backup, backing up all of it.\n", basename(tmp));
+        }
+    }
+
+    nandroid_stats_format = tar_extension(compression);
+    opts.counters = &nandroid_counters;
+
+    // the restore code looks backups up by their unsplit name
+    sprintf(tmp, "%s.%s", backup_file_image, tar_extension(compression));
+    int fd = open(tmp, O_WRONLY | O_CREAT, 0666);
+    if (fd < 0) {
+        ui_print("Unable to create %s\n", tmp);
+        return -1;
+    }
+    close(fd);
+    opts.split_size = nandroid_split_size(tmp);
+
+    set_perf_mode(1);
+    ret = archive_create(backup_path, tmp, &opts);
+    set_perf_mode(0);
+    if (ret == 0 && opts.parent_index != NULL)
+        nandroid_backup_used_parent = 1;
+    return ret;
 }
 
-static int tar_gzip_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; touch %s.tar.gz ; set -o pipefail ; (tar -cpv --exclude=data/data/com.google.android.music/files/* %s $(basename %s) | pigz -c | split -a 1 -b 1000000000 /proc/self/fd/0 %s.tar.gz.) 2> /proc/self/fd/1 ; exit $?", backup_path, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "--exclude=data/media" : "", backup_path, backup_file_image);
+static int tar_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    return tar_native_wrapper(backup_path, backup_file_image, ARCHIVE_COMPRESS_NONE, callback);
+}
 
-    return do_tar_compress(tmp, callback);
+static int tar_gzip_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    return tar_native_wrapper(backup_path, backup_file_image, ARCHIVE_COMPRESS_GZIP, callback);
 }
 
-static int tar_dump_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s); set -o pipefail ; tar -cpv --exclude=data/data/com.google.android.music/files/* %s $(basename %s) 2> /dev/null | cat", backup_path, strcmp(backup_path, "/data") == 0 && is_data_media() ? "--exclude=data/media" : "", backup_path);
+static int tar_zstd_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    return tar_native_wrapper(backup_path, backup_file_image, ARCHIVE_COMPRESS_ZSTD, callback);
+}
 
-    return __system(tmp);
+static int tar_lz4_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    return tar_native_wrapper(backup_path, backup_file_image, ARCHIVE_COMPRESS_LZ4, callback);
 }
 
 void nandroid_dedupe_gc(const char* blob_dir) {
@@ -216,6 +472,7 @@ void nandroid_dedupe_gc(const char* blob_dir) {
 static int dedupe_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
     char blob_dir[PATH_MAX];
+    nandroid_stats_format = "dup";
     strcpy(blob_dir, backup_file_image);
     char *d = dirname(blob_dir);
     strcpy(blob_dir, d);
@@ -258,6 +515,16 @@ void nandroid_force_backup_format(const char* fmt) {
     strcpy(forced_backup_format, fmt);
 }
 
+int nandroid_backup_format_supported(unsigned int fmt) {
+    switch (fmt) {
+        case NANDROID_BACKUP_FORMAT_ZST:
+            return archive_compression_supported(ARCHIVE_COMPRESS_ZSTD);
+        case NANDROID_BACKUP_FORMAT_LZ4:
+            return archive_compression_supported(ARCHIVE_COMPRESS_LZ4);
+    }
+    return fmt < NANDROID_BACKUP_FORMAT_COUNT;
+}
+
 static void refresh_default_backup_handler() {
     char fmt[5];
     if (strlen(forced_backup_format) > 0) {
@@ -281,6 +548,11 @@ static void refresh_default_backup_handler() {
         default_backup_handler = dedupe_compress_wrapper;
     else if (0 == strcmp(fmt, "tgz"))
         default_backup_handler = tar_gzip_compress_wrapper;
+    // a format picked on a build with the codec, then flashed over
+    else if (0 == strcmp(fmt, "zst") && nandroid_backup_format_supported(NANDROID_BACKUP_FORMAT_ZST))
+        default_backup_handler = tar_zstd_compress_wrapper;
+    else if (0 == strcmp(fmt, "lz4") && nandroid_backup_format_supported(NANDROID_BACKUP_FORMAT_LZ4))
+        default_backup_handler = tar_lz4_compress_wrapper;
     else if (0 == strcmp(fmt, "tar"))
         default_backup_handler = tar_compress_wrapper;
     else
@@ -293,11 +565,57 @@ unsigned int nandroid_get_default_backup_format() {
         return NANDROID_BACKUP_FORMAT_DUP;
     } else if (default_backup_handler == tar_gzip_compress_wrapper) {
         return NANDROID_BACKUP_FORMAT_TGZ;
+    } else if (default_backup_handler == tar_zstd_compress_wrapper) {
+        return NANDROID_BACKUP_FORMAT_ZST;
+    } else if (default_backup_handler == tar_lz4_compress_wrapper) {
+        return NANDROID_BACKUP_FORMAT_LZ4;
     } else {
         return NANDROID_BACKUP_FORMAT_TAR;
     }
 }
 
+int nandroid_check_backup_parent(const char* parent_path) {
+    struct dirent* de;
+    int found = 0;
+
+    if (nandroid_get_default_backup_format() == NANDROID_BACKUP_FORMAT_DUP) {
+        ui_print("Dedupe backups can't be incremental, pick a tar format.\n");
+        return NANDROID_ERROR_GENERAL;
+    }
+    DIR* d = opendir(parent_path);
+    if (d == NULL) {
+        ui_print("Unable to open %s\n", parent_path);
+        return NANDROID_ERROR_GENERAL;
+    }
+    while (!found && (de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        found = len > 4 && strcmp(de->d_name + len - 4, ".idx") == 0;
+    }
+    closedir(d);
+    if (!found) {
+        ui_print("%s has no tar index to build on.\n", parent_path);
+        return NANDROID_ERROR_GENERAL;
+    }
+    return 0;
+}
+
+unsigned int nandroid_get_backup_digest() {
+    char path[PATH_MAX];
+    char name[8] = "";
+
+    build_configuration_path(path, NANDROID_BACKUP_DIGEST_FILE);
+    ensure_path_mounted(path);
+    FILE* f = fopen(path, "r");
+    if (NULL == f)
+        return NANDROID_DIGEST_MD5;
+    fgets(name, sizeof(name), f);
+    fclose(f);
+
+    if (0 == strncmp(name, "sha256", 6))
+        return NANDROID_DIGEST_SHA256;
+    return NANDROID_DIGEST_MD5;
+}
+
 static nandroid_backup_handler get_backup_handler(const char *backup_path) {
     Volume *v = volume_for_path(backup_path);
     if (v == NULL) {
@@ -327,6 +645,224 @@ static nandroid_backup_handler get_backup_handler(const char *backup_path) {
     return default_backup_handler;
 }
 
+// Raw image dumps are I/O bound and don't touch the mounted filesystems, so
+// nandroid_backup() queues them to run in the background while /system,
+// /data etc. are archived and compressed. Only block device dumps are
+// queued: mtd and bml dumps go through partition tables shared with mounting.
+#define MAX_RAW_BACKUP_JOBS 8
+// how often the progress bar is refreshed while waiting for the dumps
+#define RAW_BACKUP_PROGRESS_INTERVAL_MS 250
+
+typedef struct {
+    char name[PATH_MAX];
+    const char* fs_type;
+    const char* blk_device;
+    char image[PATH_MAX];
+    uint64_t size;
+    int ret;
+    int finished;
+} raw_backup_job;
+
+typedef struct {
+    raw_backup_job jobs[MAX_RAW_BACKUP_JOBS];
+    int count;
+    int next;
+    int done;
+    int failed;    // ret of the first failed job
+    int closed;    // no more jobs are coming
+    int cancelled; // skip the jobs that haven't started
+    pthread_t threads[MAX_RAW_BACKUP_JOBS];
+    int thread_count;
+    int max_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} raw_backup_queue;
+
+// non-NULL while nandroid_backup() runs with background dumps enabled
+static raw_backup_queue* raw_queue = NULL;
+
+static int nandroid_backup_raw(const char* name, const char* fs_type, const char* blk_device, const char* image) {
+    archive_counters counters;
+    char dir[PATH_MAX];
+    struct stat st;
+    int ret;
+
+    ui_print("Backing up %s image...\n", name);
+    uint64_t start = archive_usec();
+    if (0 != (ret = backup_raw_partition(fs_type, blk_device, image))) {
+        ui_print("Error while backing up %s image!\n", name);
+        return ret;
+    }
+    uint64_t dumped = archive_usec();
+    // hash it now, while it is still cached
+    if (strcmp(image, "/proc/self/fd/1") != 0) {
+        nandroid_md5_record_file(image, nandroid_backup_digest);
+
+        // a dump reads and writes in one go; zero blocks it skipped are
+        // holes in the image and don't count as written
+        memset(&counters, 0, sizeof(counters));
+        counters.write_usec = dumped - start;
+        counters.hash_usec = archive_usec() - dumped;
+        if (stat(image, &st) == 0) {
+            counters.bytes_in = st.st_size;
+            counters.bytes_out = (uint64_t)st.st_blocks * 512 < (uint64_t)st.st_size ?
+                    (uint64_t)st.st_blocks * 512 : (uint64_t)st.st_size;
+        }
+        strlcpy(dir, image, sizeof(dir));
+        nandroid_write_stats(dirname(dir), 0, name, "img", archive_usec() - start, &counters);
+    }
+
+    ui_print("Backup of %s image completed.\n", name);
+    return 0;
+}
+
+static void* raw_backup_worker(void* cookie) {
+    raw_backup_queue* q = (raw_backup_queue*)cookie;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        if (q->cancelled || (q->next == q->count && q->closed))
+            break;
+        if (q->next == q->count) {
+            pthread_cond_wait(&q->cond, &q->lock);
+            continue;
+        }
+        raw_backup_job* job = &q->jobs[q->next++];
+        pthread_mutex_unlock(&q->lock);
+        job->ret = nandroid_backup_raw(job->name, job->fs_type, job->blk_device, job->image);
+        pthread_mutex_lock(&q->lock);
+        if (job->ret != 0 && q->failed == 0)
+            q->failed = job->ret;
+        job->finished = 1;
+        q->done++;
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+// I/O budget: how many raw dumps may run at once, 0 dumps inline
+static void raw_backup_queue_start(raw_backup_queue* q) {
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.backup_io_jobs", value, "1");
+
+    memset(q, 0, sizeof(*q));
+    q->max_threads = atoi(value);
+    if (q->max_threads > MAX_RAW_BACKUP_JOBS)
+        q->max_threads = MAX_RAW_BACKUP_JOBS;
+    if (q->max_threads <= 0)
+        return;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    raw_queue = q;
+}
+
+static uint64_t block_device_size(const char* blk_device) {
+    int fd = open(blk_device, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    off_t size = lseek(fd, 0, SEEK_END);
+    close(fd);
+    return size > 0 ? size : 0;
+}
+
+// Returns 0 if the dump was queued, -1 if it has to be done inline.
+static int raw_backup_queue_add(const char* name, const char* fs_type, const char* blk_device, const char* image) {
+    raw_backup_queue* q = raw_queue;
+    if (q == NULL || strcmp(fs_type, "emmc") != 0 || blk_device[0] != '/'
+            || strcmp(image, "/proc/self/fd/1") == 0)
+        return -1;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count == MAX_RAW_BACKUP_JOBS) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    raw_backup_job* job = &q->jobs[q->count];
+    strlcpy(job->name, name, sizeof(job->name));
+    job->fs_type = fs_type;
+    job->blk_device = blk_device;
+    strlcpy(job->image, image, sizeof(job->image));
+    job->size = block_device_size(blk_device);
+    job->ret = 0;
+    job->finished = 0;
+    q->count++;
+    if (q->thread_count < q->max_threads && q->thread_count < q->count - q->done) {
+        if (pthread_create(&q->threads[q->thread_count], NULL, raw_backup_worker, q) == 0)
+            q->thread_count++;
+    }
+    int queued = q->thread_count > 0;
+    if (!queued)
+        q->count--;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    return queued ? 0 : -1;
+}
+
+// ret of the first background dump that failed, 0 if none did (yet)
+static int raw_backup_failed() {
+    int ret = 0;
+    if (raw_queue != NULL) {
+        pthread_mutex_lock(&raw_queue->lock);
+        ret = raw_queue->failed;
+        pthread_mutex_unlock(&raw_queue->lock);
+    }
+    return ret;
+}
+
+// Waits for the queued dumps, or only for the running ones when |cancel| is
+// set, showing their combined progress. Returns raw_backup_failed().
+static int raw_backup_queue_finish(int cancel) {
+    raw_backup_queue* q = raw_queue;
+    uint64_t total = 0;
+    int i;
+
+    if (q == NULL)
+        return 0;
+    raw_queue = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    q->cancelled = cancel;
+    pthread_cond_broadcast(&q->cond);
+    if (!cancel && q->done < q->count) {
+        ui_print("Waiting for image backups...\n");
+        ui_reset_progress();
+        ui_show_progress(1, 0);
+        for (i = 0; i < q->count; i++)
+            total += q->jobs[i].size;
+    }
+    while (q->done < q->next || (!cancel && q->done < q->count)) {
+        struct timeval now;
+        struct timespec timeout;
+        gettimeofday(&now, NULL);
+        uint64_t ns = (uint64_t)now.tv_usec * 1000 + (uint64_t)RAW_BACKUP_PROGRESS_INTERVAL_MS * 1000000;
+        timeout.tv_sec = now.tv_sec + ns / 1000000000;
+        timeout.tv_nsec = ns % 1000000000;
+        pthread_cond_timedwait(&q->cond, &q->lock, &timeout);
+        if (total == 0)
+            continue;
+        // the dumps report no progress, their images growing will do
+        uint64_t written = 0;
+        for (i = 0; i < q->count; i++) {
+            raw_backup_job* job = &q->jobs[i];
+            struct stat st;
+            if (job->finished)
+                written += job->size;
+            else if (stat(job->image, &st) == 0)
+                written += (uint64_t)st.st_size < job->size ? (uint64_t)st.st_size : job->size;
+        }
+        ui_set_progress((float)((double)written / (double)total));
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    for (i = 0; i < q->thread_count; i++)
+        pthread_join(q->threads[i], NULL);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+    return q->failed;
+}
+
 static int nandroid_backup_partition_extended(const char* backup_path, const char* mount_point, int umount_when_finished) {
     int ret = 0;
     char name[PATH_MAX];
@@ -338,6 +874,10 @@ static int nandroid_backup_partition_extended(const char* backup_path, const cha
     ensure_path_mounted(tmp);
     int callback = stat(tmp, &file_info) != 0;
 
+    // a background image dump failed, no point in going on
+    if (0 != (ret = raw_backup_failed()))
+        return ret;
+
     ui_print("Backing up %s...\n", name);
     if (0 != (ret = ensure_path_mounted(mount_point) != 0)) {
         ui_print("Can't mount %s!\n", mount_point);
@@ -362,7 +902,11 @@ static int nandroid_backup_partition_extended(const char* backup_path, const cha
         ui_print("Error finding an appropriate backup handler.\n");
         return -2;
     }
+    nandroid_stats_reset();
+    uint64_t start = archive_usec();
     ret = backup_handler(mount_point, tmp, callback);
+    if (ret == 0)
+        nandroid_write_stats(backup_path, 0, name, nandroid_stats_format, archive_usec() - start, &nandroid_counters);
     if (umount_when_finished) {
         ensure_path_unmounted(mount_point);
     }
@@ -382,7 +926,6 @@ static int nandroid_backup_partition(const char* backup_path, const char* root)
 
     // see if we need a raw backup (mtd)
     char tmp[PATH_MAX];
-    int ret;
     if (strcmp(vol->fs_type, "mtd") == 0 ||
             strcmp(vol->fs_type, "bml") == 0 ||
             strcmp(vol->fs_type, "emmc") == 0) {
@@ -392,51 +935,20 @@ static int nandroid_backup_partition(const char* backup_path, const char* root)
         else
             sprintf(tmp, "%s/%s.img", backup_path, name);
 
-        ui_print("Backing up %s image...\n", name);
-        if (0 != (ret = backup_raw_partition(vol->fs_type, vol->blk_device, tmp))) {
-            ui_print("Error while backing up %s image!", name);
-            return ret;
-        }
-
-        ui_print("Backup of %s image completed.\n", name);
-        return 0;
+        if (raw_backup_queue_add(name, vol->fs_type, vol->blk_device, tmp) == 0)
+            return 0;
+        return nandroid_backup_raw(name, vol->fs_type, vol->blk_device, tmp);
     }
 
     return nandroid_backup_partition_extended(backup_path, root, 1);
 }
 
-int nandroid_backup(const char* backup_path) {
-    nandroid_backup_bitfield = 0;
-    refresh_default_backup_handler();
-
-    if (ensure_path_mounted(backup_path) != 0) {
-        return print_and_error("Can't mount backup path.\n", NANDROID_ERROR_GENERAL);
-    }
-
-    Volume* volume;
-    if (is_data_media_volume_path(backup_path))
-        volume = volume_for_path("/data");
-    else
-        volume = volume_for_path(backup_path);
-    if (NULL == volume)
-        return print_and_error("Unable to find volume for backup path.\n", NANDROID_ERROR_GENERAL);
-    int ret;
-    struct statfs sfs;
-    struct stat s;
-    if (NULL != volume) {
-        if (0 != (ret = statfs(volume->mount_point, &sfs)))
-            return print_and_error("Unable to stat backup path.\n", ret);
-        uint64_t bavail = sfs.f_bavail;
-        uint64_t bsize = sfs.f_bsize;
-        uint64_t sdcard_free = bavail * bsize;
-        uint64_t sdcard_free_mb = sdcard_free / (uint64_t)(1024 * 1024);
-        ui_print("SD Card space free: %lluMB\n", sdcard_free_mb);
-        if (sdcard_free_mb < 150)
-            ui_print("There may not be enough free space to complete backup... continuing...\n");
-    }
+// Everything nandroid_backup() saves, in order. Raw images may still be
+// dumping in the background when this returns.
+static int nandroid_backup_partitions(const char* backup_path) {
     char tmp[PATH_MAX];
-    ensure_directory(backup_path);
-    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    struct stat s;
+    int ret;
 
     if (0 != (ret = nandroid_backup_partition(backup_path, "/boot")))
         return print_and_error(NULL, ret);
@@ -447,12 +959,11 @@ int nandroid_backup(const char* backup_path) {
     Volume *vol = volume_for_path("/wimax");
     if (vol != NULL && 0 == stat(vol->blk_device, &s)) {
         char serialno[PROPERTY_VALUE_MAX];
-        ui_print("Backing up WiMAX...\n");
         serialno[0] = 0;
         property_get("ro.serialno", serialno, "");
         sprintf(tmp, "%s/wimax.%s.img", backup_path, serialno);
-        ret = backup_raw_partition(vol->fs_type, vol->blk_device, tmp);
-        if (0 != ret)
+        if (raw_backup_queue_add("wimax", vol->fs_type, vol->blk_device, tmp) != 0 &&
+                0 != nandroid_backup_raw("wimax", vol->fs_type, vol->blk_device, tmp))
             return print_and_error("Error while dumping WiMAX image!\n", NANDROID_ERROR_GENERAL);
     }
 
@@ -487,7 +998,112 @@ int nandroid_backup(const char* backup_path) {
             return print_and_error(NULL, ret);
     }
 
-    if (0 != (ret = nandroid_backup_md5_gen(backup_path)))
+    return 0;
+}
+
+// Checks the parent chosen for |backup_path|. The chain is followed by name,
+// so the parent has to sit next to the new backup.
+static int nandroid_check_parent(const char* backup_path) {
+    char tmp[PATH_MAX];
+    char label[PATH_MAX];
+    char path[PATH_MAX];
+    struct stat st;
+
+    strcpy(tmp, nandroid_backup_parent);
+    strcpy(label, basename(tmp));
+    if (nandroid_parent_path(backup_path, label, path) != 0 || strcmp(path, nandroid_backup_parent) != 0 ||
+            stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        ui_print("%s is not a backup next to %s.\n", nandroid_backup_parent, backup_path);
+        return NANDROID_ERROR_GENERAL;
+    }
+    strcpy(tmp, backup_path);
+    if (strcmp(label, basename(tmp)) == 0) {
+        ui_print("A backup can't be its own parent.\n");
+        return NANDROID_ERROR_GENERAL;
+    }
+    return nandroid_check_backup_parent(nandroid_backup_parent);
+}
+
+// Records the parent in |backup_path|, unless no partition ended up stored
+// against it (all raw, yaffs2 or dedupe), which makes this a full backup.
+static int nandroid_write_parent(const char* backup_path) {
+    char tmp[PATH_MAX];
+    char label[PATH_MAX];
+
+    strcpy(tmp, nandroid_backup_parent);
+    strcpy(label, basename(tmp));
+    if (!nandroid_backup_used_parent) {
+        ui_print("Nothing was stored against %s, this is a full backup.\n", label);
+        return 0;
+    }
+
+    sprintf(tmp, "%s/%s", backup_path, NANDROID_PARENT_FILE);
+    FILE* f = fopen(tmp, "w");
+    if (f == NULL) {
+        ui_print("Unable to create %s\n", tmp);
+        return NANDROID_ERROR_GENERAL;
+    }
+    fprintf(f, "%s\n", label);
+    if (fclose(f) != 0)
+        return NANDROID_ERROR_GENERAL;
+    ui_print("Incremental backup against %s\n", label);
+    return 0;
+}
+
+int nandroid_backup(const char* backup_path) {
+    nandroid_backup_bitfield = 0;
+    refresh_default_backup_handler();
+    // a parent only applies to the backup it was chosen for
+    strcpy(nandroid_backup_parent, next_backup_parent);
+    next_backup_parent[0] = '\0';
+    nandroid_backup_used_parent = 0;
+
+    if (ensure_path_mounted(backup_path) != 0) {
+        return print_and_error("Can't mount backup path.\n", NANDROID_ERROR_GENERAL);
+    }
+
+    Volume* volume;
+    if (is_data_media_volume_path(backup_path))
+        volume = volume_for_path("/data");
+    else
+        volume = volume_for_path(backup_path);
+    if (NULL == volume)
+        return print_and_error("Unable to find volume for backup path.\n", NANDROID_ERROR_GENERAL);
+    int ret;
+    struct statfs sfs;
+    if (NULL != volume) {
+        if (0 != (ret = statfs(volume->mount_point, &sfs)))
+            return print_and_error("Unable to stat backup path.\n", ret);
+        uint64_t bavail = sfs.f_bavail;
+        uint64_t bsize = sfs.f_bsize;
+        uint64_t sdcard_free = bavail * bsize;
+        uint64_t sdcard_free_mb = sdcard_free / (uint64_t)(1024 * 1024);
+        ui_print("SD Card space free: %lluMB\n", sdcard_free_mb);
+        if (sdcard_free_mb < 150)
+            ui_print("There may not be enough free space to complete backup... continuing...\n");
+    }
+    char tmp[PATH_MAX];
+    ensure_directory(backup_path);
+    if (nandroid_backup_parent[0] != '\0' && 0 != (ret = nandroid_check_parent(backup_path)))
+        return print_and_error(NULL, ret);
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    nandroid_backup_digest = nandroid_get_backup_digest();
+    // left over from a backup that failed before its md5 step
+    nandroid_md5_clear_records();
+
+    raw_backup_queue queue;
+    raw_backup_queue_start(&queue);
+    ret = nandroid_backup_partitions(backup_path);
+    // dumps that already started have to finish before bailing out
+    int raw_ret = raw_backup_queue_finish(ret != 0);
+    if (0 != ret)
+        return ret;
+    if (0 != raw_ret)
+        return print_and_error(NULL, raw_ret);
+    if (nandroid_backup_parent[0] != '\0' && 0 != (ret = nandroid_write_parent(backup_path)))
+        return print_and_error(NULL, ret);
+
+    if (0 != (ret = nandroid_backup_md5_gen(backup_path, nandroid_backup_digest)))
         return print_and_error(NULL, ret);
 
     sprintf(tmp, "cp /tmp/recovery.log %s/recovery.log", backup_path);
@@ -513,44 +1129,192 @@ int nandroid_backup(const char* backup_path) {
     return 0;
 }
 
-static int nandroid_dump(const char* partition) {
-    // silence our ui_print statements and other logging
-    ui_set_log_stdout(0);
+/*
+ * bu: backups streamed over adb
+ */
 
-    nandroid_backup_bitfield = 0;
-    refresh_default_backup_handler();
+// codecs the host can ask for on the bu command line
+static int bu_compression(const char* token) {
+    if (strcmp(token, "tar") == 0)
+        return ARCHIVE_COMPRESS_NONE;
+    if (strcmp(token, "tgz") == 0)
+        return ARCHIVE_COMPRESS_GZIP;
+    if (strcmp(token, "zst") == 0)
+        return ARCHIVE_COMPRESS_ZSTD;
+    if (strcmp(token, "lz4") == 0)
+        return ARCHIVE_COMPRESS_LZ4;
+    return -1;
+}
 
-    // override our default to be the basic tar dumper
-    default_backup_handler = tar_dump_wrapper;
+static int bu_is_raw(const Volume* vol) {
+    return strcmp(vol->fs_type, "mtd") == 0 ||
+            strcmp(vol->fs_type, "bml") == 0 ||
+            strcmp(vol->fs_type, "emmc") == 0;
+}
 
-    if (strcmp(partition, "boot") == 0) {
-        Volume *vol = volume_for_path("/boot");
-        // make sure the volume exists before attempting anything...
-        if (vol == NULL || vol->fs_type == NULL)
-            return 1;
-        char cmd[PATH_MAX];
-        sprintf(cmd, "cat %s", vol->blk_device);
-        return __system(cmd);
-        // return nandroid_backup_partition("-", "/boot");
+// The volume mounted at /|name|, or NULL.
+static Volume* bu_volume(const char* name, char* root) {
+    sprintf(root, "/%s", name);
+    Volume* vol = volume_for_path(root);
+    if (vol == NULL || vol->fs_type == NULL || strcmp(vol->mount_point, root) != 0) {
+        ui_print("Unknown partition %s\n", name);
+        return NULL;
     }
+    return vol;
+}
+
+// The flash utilities only take paths, so images go through a pipe whose
+// other end is |fd|.
+typedef struct {
+    const Volume* vol;
+    int fd;
+    int restore;
+    int ret;
+} bu_raw_job;
+
+static void* bu_raw_thread(void* cookie) {
+    bu_raw_job* job = (bu_raw_job*)cookie;
+    char path[PATH_MAX];
+
+    sprintf(path, "/proc/self/fd/%d", job->fd);
+    if (job->restore)
+        job->ret = restore_raw_partition(job->vol->fs_type, job->vol->blk_device, path);
+    else
+        job->ret = backup_raw_partition(job->vol->fs_type, job->vol->blk_device, path);
+    close(job->fd);
+    return NULL;
+}
+
+static int bu_backup_raw(const Volume* vol, archive_sink* out) {
+    unsigned char buf[64 * 1024];
+    bu_raw_job job;
+    pthread_t thread;
+    int fds[2];
+    int ret = 0;
 
-    if (strcmp(partition, "recovery") == 0) {
-        return __system("set -o pipefail ; dump_image recovery /proc/self/fd/1 | cat");
+    if (pipe(fds) != 0) {
+        out->close(out);
+        return -1;
+    }
+    job.vol = vol;
+    job.fd = fds[1];
+    job.restore = 0;
+    if (pthread_create(&thread, NULL, bu_raw_thread, &job) != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        out->close(out);
+        return -1;
     }
 
-    if (strcmp(partition, "data") == 0) {
-        return nandroid_backup_partition("-", "/data");
+    for (;;) {
+        ssize_t n = read(fds[0], buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n < 0)
+                ret = -1;
+            break;
+        }
+        // keep draining after an error so that the dump can finish
+        if (ret == 0 && out->write(out, buf, n) != 0)
+            ret = -1;
     }
+    close(fds[0]);
+    pthread_join(thread, NULL);
+    if (out->close(out) != 0)
+        ret = -1;
+    return ret != 0 ? ret : job.ret;
+}
+
+static int bu_dump_partition(bu_writer* w, const char* name, int compression) {
+    char root[PATH_MAX];
+    const char* excludes[2];
+    archive_options opts;
+    archive_sink* out;
+    int ret;
 
-    if (strcmp(partition, "system") == 0) {
-        return nandroid_backup_partition("-", "/system");
+    Volume* vol = bu_volume(name, root);
+    if (vol == NULL)
+        return 1;
+
+    ui_print("Backing up %s...\n", name);
+    if (bu_is_raw(vol)) {
+        if ((out = bu_writer_begin(w, name, "img")) == NULL)
+            return -1;
+        ret = bu_backup_raw(vol, out);
+    } else {
+        if (0 != (ret = ensure_path_mounted(root))) {
+            ui_print("Can't mount %s!\n", root);
+            return ret;
+        }
+        if ((out = bu_writer_begin(w, name, tar_extension(compression))) == NULL) {
+            ret = -1;
+        } else {
+            memset(&opts, 0, sizeof(opts));
+            opts.excludes = excludes;
+            opts.exclude_count = nandroid_backup_excludes(root, excludes);
+            opts.compression = compression;
+            opts.threads = nandroid_backup_threads();
+            set_perf_mode(1);
+            ret = archive_create_to_sink(root, out, &opts);
+            set_perf_mode(0);
+        }
+        ensure_path_unmounted(root);
     }
+    if (ret != 0)
+        ui_print("Error while backing up %s!\n", name);
+    return ret;
+}
 
-    return 1;
+// |args| are the partitions to back up, in order, and optionally the codecs
+// the host would like, best first.
+static int nandroid_dump(int count, char** args) {
+    static const int preferred[] = {
+        ARCHIVE_COMPRESS_ZSTD, ARCHIVE_COMPRESS_LZ4, ARCHIVE_COMPRESS_GZIP,
+    };
+    int compression = -1;
+    int partitions = 0;
+    int ret = 0;
+    int i;
+
+    // silence our ui_print statements and other logging
+    ui_set_log_stdout(0);
+    // a host that goes away shows up as a write error
+    signal(SIGPIPE, SIG_IGN);
+
+    // the codec goes into the stream, so any this build has will do
+    for (i = 0; i < count && compression < 0; i++) {
+        int c = bu_compression(args[i]);
+        if (c >= 0 && archive_compression_supported(c))
+            compression = c;
+    }
+    for (i = 0; i < (int)(sizeof(preferred) / sizeof(preferred[0])) && compression < 0; i++) {
+        if (archive_compression_supported(preferred[i]))
+            compression = preferred[i];
+    }
+    if (compression < 0)
+        compression = ARCHIVE_COMPRESS_GZIP;
+
+    bu_writer* w = bu_writer_open(STDOUT_FILENO);
+    if (w == NULL)
+        return 1;
+    for (i = 0; i < count && ret == 0; i++) {
+        if (bu_compression(args[i]) >= 0)
+            continue;
+        ret = bu_dump_partition(w, args[i], compression);
+        partitions++;
+    }
+    if (partitions == 0)
+        ret = 1;
+    // a stream without its end marker won't restore
+    if (bu_writer_finish(w, ret == 0) != 0 && ret == 0)
+        ret = -1;
+    return ret;
 }
 
 static int unyaffs_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
     char tmp[PATH_MAX];
+    nandroid_stats_format = "yaffs2";
     sprintf(tmp, "cd %s ; unyaffs %s ; exit $?", backup_path, backup_file_image);
     FILE *fp = __popen(tmp, "r");
     if (fp == NULL) {
@@ -567,44 +1331,104 @@ static int unyaffs_wrapper(const char* backup_file_image, const char* backup_pat
     return __pclose(fp);
 }
 
-static int do_tar_extract(char* command, int callback) {
-    char buf[PATH_MAX];
+// Sizes the progress bar for restoring |prefix| and its segments; the native
+// extractor reports progress in archive bytes.
+static void compute_archive_stats(const char* prefix) {
+    char path[PATH_MAX];
+    struct stat st;
+    int i;
+
+    nandroid_files_count = 0;
+    nandroid_files_total = 0;
+    nandroid_bytes_total = stat(prefix, &st) == 0 ? st.st_size : 0;
+    for (i = 0; ; i++) {
+        archive_segment_path(path, sizeof(path), prefix, i);
+        if (stat(path, &st) != 0)
+            break;
+        nandroid_bytes_total += st.st_size;
+    }
+
+    ui_reset_progress();
+    ui_show_progress(1, 0);
+}
+
+// file writers of a restore, 0 = online cores
+static int nandroid_restore_threads() {
+    char value[PROPERTY_VALUE_MAX];
+    property_get("ro.cwm.restore_threads", value, "0");
+    return atoi(value);
+}
 
-    set_perf_mode(1);
-    FILE *fp = __popen(command, "r");
-    if (fp == NULL) {
-        ui_print("Unable to execute tar command.\n");
-        set_perf_mode(0);
+static int tar_native_extract(const char* backup_file_image, const char* backup_path, int compression, int callback) {
+    char tmp[PATH_MAX];
+    archive_options opts;
+    int ret;
+
+    if (!archive_compression_supported(compression)) {
+        ui_print("This recovery can't read %s backups.\n", tar_extension(compression));
         return -1;
     }
 
-    while (fgets(buf, PATH_MAX, fp) != NULL) {
-        buf[PATH_MAX - 1] = '\0';
-        if (callback)
-            nandroid_callback(buf);
+    nandroid_stats_format = tar_extension(compression);
+    memset(&opts, 0, sizeof(opts));
+    opts.compression = compression;
+    opts.threads = nandroid_restore_threads();
+    opts.counters = &nandroid_counters;
+    if (callback) {
+        compute_archive_stats(backup_file_image);
+        opts.progress = nandroid_archive_callback;
     }
 
+    // member names are relative to the parent of the mount point
+    strcpy(tmp, backup_path);
+    set_perf_mode(1);
+    ret = archive_extract(backup_file_image, dirname(tmp), &opts);
     set_perf_mode(0);
-    return __pclose(fp);
+    return ret;
 }
 
-static int tar_gzip_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+// the stream nandroid_undump() restores the current partition from
+static archive_source* bu_source = NULL;
+static int bu_source_compression = ARCHIVE_COMPRESS_NONE;
+
+static int bu_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; set -o pipefail ; cat %s* | pigz -d -c | tar -xpv ; exit $?", backup_path, backup_file_image);
+    archive_options opts;
+    int ret;
+
+    nandroid_stats_format = tar_extension(bu_source_compression);
+    memset(&opts, 0, sizeof(opts));
+    opts.compression = bu_source_compression;
+    opts.threads = nandroid_restore_threads();
+    opts.counters = &nandroid_counters;
 
-    return do_tar_extract(tmp, callback);
+    strcpy(tmp, backup_path);
+    set_perf_mode(1);
+    ret = archive_extract_from_source(bu_source, dirname(tmp), &opts);
+    set_perf_mode(0);
+    return ret;
 }
 
-static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; set -o pipefail ; cat %s* | tar -xpv ; exit $?", backup_path, backup_file_image);
+static int tar_gzip_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return tar_native_extract(backup_file_image, backup_path, ARCHIVE_COMPRESS_GZIP, callback);
+}
 
-    return do_tar_extract(tmp, callback);
+static int tar_zstd_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return tar_native_extract(backup_file_image, backup_path, ARCHIVE_COMPRESS_ZSTD, callback);
+}
+
+static int tar_lz4_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return tar_native_extract(backup_file_image, backup_path, ARCHIVE_COMPRESS_LZ4, callback);
+}
+
+static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return tar_native_extract(backup_file_image, backup_path, ARCHIVE_COMPRESS_NONE, callback);
 }
 
 static int dedupe_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
     char tmp[PATH_MAX];
     char blob_dir[PATH_MAX];
+    nandroid_stats_format = "dup";
     strcpy(blob_dir, backup_file_image);
     char *bd = dirname(blob_dir);
     strcpy(blob_dir, bd);
@@ -628,13 +1452,6 @@ static int dedupe_extract_wrapper(const char* backup_file_image, const char* bac
     return __pclose(fp);
 }
 
-static int tar_undump_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; tar -xpv ", backup_path);
-
-    return __system(tmp);
-}
-
 static nandroid_restore_handler get_restore_handler(const char *backup_path) {
     Volume *v = volume_for_path(backup_path);
     if (v == NULL) {
@@ -662,13 +1479,98 @@ static nandroid_restore_handler get_restore_handler(const char *backup_path) {
     return tar_extract_wrapper;
 }
 
+// Looks for |name| in any of the formats backups are written in. Returns the
+// handler to restore |path| with and sets |*filesystem|, or returns NULL.
+static nandroid_restore_handler find_backup_archive(const char* backup_path, const char* name, char* path,
+                                                    const char** filesystem) {
+    const char *filesystems[] = { "yaffs2", "ext2", "ext3", "ext4", "vfat", "rfs", "f2fs", NULL };
+    struct stat file_info;
+    int i;
+
+    for (i = 0; filesystems[i] != NULL; i++) {
+        *filesystem = filesystems[i];
+        sprintf(path, "%s/%s.%s.img", backup_path, name, filesystems[i]);
+        if (0 == stat(path, &file_info))
+            return unyaffs_wrapper;
+        sprintf(path, "%s/%s.%s.tar", backup_path, name, filesystems[i]);
+        if (0 == stat(path, &file_info))
+            return tar_extract_wrapper;
+        sprintf(path, "%s/%s.%s.tar.gz", backup_path, name, filesystems[i]);
+        if (0 == stat(path, &file_info))
+            return tar_gzip_extract_wrapper;
+        sprintf(path, "%s/%s.%s.tar.zst", backup_path, name, filesystems[i]);
+        if (0 == stat(path, &file_info))
+            return tar_zstd_extract_wrapper;
+        sprintf(path, "%s/%s.%s.tar.lz4", backup_path, name, filesystems[i]);
+        if (0 == stat(path, &file_info))
+            return tar_lz4_extract_wrapper;
+        sprintf(path, "%s/%s.%s.dup", backup_path, name, filesystems[i]);
+        if (0 == stat(path, &file_info))
+            return dedupe_extract_wrapper;
+    }
+    *filesystem = NULL;
+    return NULL;
+}
+
+static void remove_restored_entry(const char* name, void* cookie) {
+    char path[PATH_MAX];
+    // names come from our own index, but never leave the volume
+    if (strcmp(name, "..") == 0 || strncmp(name, "../", 3) == 0 || strstr(name, "/../") != NULL)
+        return;
+    snprintf(path, sizeof(path), "%s/%s", (const char*)cookie, name);
+    dirUnlinkHierarchy(path);
+}
+
+// An incremental backup only holds what changed since its parent: restores
+// the chain of parents of |name| oldest first and removes whatever the
+// backup in |backup_path| lists as deleted, so its archive can go on top.
+static int restore_backup_parents(const char* backup_path, const char* name, const char* filesystem,
+                                  const char* mount_point, int callback, int depth) {
+    char index[PATH_MAX];
+    char label[PATH_MAX];
+    char parent[PATH_MAX];
+    char archive[PATH_MAX];
+    char root[PATH_MAX];
+    const char* parent_filesystem;
+    int ret;
+
+    // full backups and dedupe/yaffs2 images have no parent
+    sprintf(index, "%s/%s.%s.idx", backup_path, name, filesystem);
+    if (archive_index_parent(index, label, sizeof(label)) != 0)
+        return 0;
+
+    if (depth == NANDROID_MAX_PARENTS || nandroid_parent_path(backup_path, label, parent) != 0) {
+        ui_print("Invalid parent backup %s\n", label);
+        return NANDROID_ERROR_GENERAL;
+    }
+    nandroid_restore_handler handler = find_backup_archive(parent, name, archive, &parent_filesystem);
+    if (handler == NULL) {
+        ui_print("Parent backup %s has no %s!\n", label, name);
+        return NANDROID_ERROR_GENERAL;
+    }
+    if (0 != (ret = restore_backup_parents(parent, name, parent_filesystem, mount_point, callback, depth + 1)))
+        return ret;
+    ui_print("Restoring %s from %s...\n", name, label);
+    if (0 != (ret = handler(archive, mount_point, callback)))
+        return ret;
+
+    // tar member names are relative to the parent of the mount point
+    strcpy(archive, mount_point);
+    strcpy(root, dirname(archive));
+    if (archive_index_removed(index, remove_restored_entry, root) != 0) {
+        ui_print("Unable to read %s\n", index);
+        return NANDROID_ERROR_GENERAL;
+    }
+    return 0;
+}
+
 static int nandroid_restore_partition_extended(const char* backup_path, const char* mount_point, int umount_when_finished) {
     int ret = 0;
     char* name = basename(mount_point);
 
     nandroid_restore_handler restore_handler = NULL;
-    const char *filesystems[] = { "yaffs2", "ext2", "ext3", "ext4", "vfat", "rfs", "f2fs", NULL };
     const char* backup_filesystem = NULL;
+    const char* archive_filesystem = NULL;
     Volume *vol = volume_for_path(mount_point);
     const char *device = NULL;
     if (vol != NULL)
@@ -684,44 +1586,15 @@ static int nandroid_restore_partition_extended(const char* backup_path, const ch
         strcpy(tmp, "/proc/self/fd/0");
     } else if (0 != (ret = stat(tmp, &file_info))) {
         // can't find the backup, it may be the new backup format?
-        // iterate through the backup types
         printf("couldn't find default\n");
-        const char *filesystem;
-        int i = 0;
-        while ((filesystem = filesystems[i]) != NULL) {
-            sprintf(tmp, "%s/%s.%s.img", backup_path, name, filesystem);
-            if (0 == (ret = stat(tmp, &file_info))) {
-                backup_filesystem = filesystem;
-                restore_handler = unyaffs_wrapper;
-                break;
-            }
-            sprintf(tmp, "%s/%s.%s.tar", backup_path, name, filesystem);
-            if (0 == (ret = stat(tmp, &file_info))) {
-                backup_filesystem = filesystem;
-                restore_handler = tar_extract_wrapper;
-                break;
-            }
-            sprintf(tmp, "%s/%s.%s.tar.gz", backup_path, name, filesystem);
-            if (0 == (ret = stat(tmp, &file_info))) {
-                backup_filesystem = filesystem;
-                restore_handler = tar_gzip_extract_wrapper;
-                break;
-            }
-            sprintf(tmp, "%s/%s.%s.dup", backup_path, name, filesystem);
-            if (0 == (ret = stat(tmp, &file_info))) {
-                backup_filesystem = filesystem;
-                restore_handler = dedupe_extract_wrapper;
-                break;
-            }
-            i++;
-        }
-
+        restore_handler = find_backup_archive(backup_path, name, tmp, &backup_filesystem);
         if (backup_filesystem == NULL || restore_handler == NULL) {
             ui_print("%s.img not found. Skipping restore of %s.\n", name, mount_point);
             return 0;
         } else {
             printf("Found new backup image: %s\n", tmp);
         }
+        archive_filesystem = backup_filesystem;
     }
     // If the fs_type of this volume is "auto" or mount_point is /data
     // and is_data_media, let's revert
@@ -766,7 +1639,7 @@ static int nandroid_restore_partition_extended(const char* backup_path, const ch
 
     // override restore handler for undump
     if (strcmp(backup_path, "-") == 0) {
-        restore_handler = tar_undump_wrapper;
+        restore_handler = bu_extract_wrapper;
     }
 
     if (restore_handler == NULL) {
@@ -774,10 +1647,16 @@ static int nandroid_restore_partition_extended(const char* backup_path, const ch
         return -2;
     }
 
-    if (0 != (ret = restore_handler(tmp, mount_point, callback))) {
+    // the parents of an incremental backup count towards its restore
+    nandroid_stats_reset();
+    uint64_t start = archive_usec();
+    if ((archive_filesystem != NULL &&
+            0 != (ret = restore_backup_parents(backup_path, name, archive_filesystem, mount_point, callback, 0))) ||
+            0 != (ret = restore_handler(tmp, mount_point, callback))) {
         ui_print("Error while restoring %s!\n", mount_point);
         return ret;
     }
+    nandroid_write_stats(backup_path, 1, name, nandroid_stats_format, archive_usec() - start, &nandroid_counters);
 
     if (umount_when_finished) {
         ensure_path_unmounted(mount_point);
@@ -811,10 +1690,18 @@ static int nandroid_restore_partition(const char* backup_path, const char* root)
             sprintf(tmp, "%s%s.img", backup_path, root);
 
         ui_print("Restoring %s image...\n", name);
+        uint64_t start = archive_usec();
         if (0 != (ret = restore_raw_partition(vol->fs_type, vol->blk_device, tmp))) {
             ui_print("Error while flashing %s image!\n", name);
             return ret;
         }
+        archive_counters counters;
+        struct stat st;
+        memset(&counters, 0, sizeof(counters));
+        counters.write_usec = archive_usec() - start;
+        if (stat(tmp, &st) == 0)
+            counters.bytes_in = st.st_size;
+        nandroid_write_stats(backup_path, 1, name, "img", counters.write_usec, &counters);
         return 0;
     }
     return nandroid_restore_partition_extended(backup_path, root, 1);
@@ -841,6 +1728,19 @@ int nandroid_restore(const char* backup_path, unsigned char flags) {
     if (0 != (ret = nandroid_restore_md5_check(backup_path, flags)))
         return print_and_error(NULL, ret);
 
+    // an incremental backup is only as good as the ones it builds on
+    char parent[PATH_MAX];
+    int depth = 0;
+    strcpy(tmp, backup_path);
+    while (0 == nandroid_read_parent(tmp, parent)) {
+        if (++depth > NANDROID_MAX_PARENTS)
+            return print_and_error("Too many parent backups.\n", NANDROID_ERROR_GENERAL);
+        ui_print("Checking parent backup %s...\n", parent);
+        if (0 != (ret = nandroid_restore_md5_check(parent, flags)))
+            return print_and_error(NULL, ret);
+        strcpy(tmp, parent);
+    }
+
     if (restore_boot && NULL != volume_for_path("/boot") && 0 != (ret = nandroid_restore_partition(backup_path, "/boot")))
         return print_and_error(NULL, ret);
 
@@ -896,43 +1796,138 @@ int nandroid_restore(const char* backup_path, unsigned char flags) {
     return 0;
 }
 
-static int nandroid_undump(const char* partition) {
-    nandroid_files_total = 0;
+static int bu_restore_raw(const Volume* vol, archive_source* in) {
+    unsigned char buf[64 * 1024];
+    bu_raw_job job;
+    pthread_t thread;
+    int fds[2];
+    int ret = 0;
 
-    int ret;
+    if (pipe(fds) != 0)
+        return -1;
+    job.vol = vol;
+    job.fd = fds[0];
+    job.restore = 1;
+    if (pthread_create(&thread, NULL, bu_raw_thread, &job) != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
 
-    if (strcmp(partition, "boot") == 0) {
-        Volume *vol = volume_for_path("/boot");
-        // make sure the volume exists before attempting anything...
-        if (vol == NULL || vol->fs_type == NULL)
-            return 1;
-        char cmd[PATH_MAX];
-        sprintf(cmd, "cat /proc/self/fd/0 > %s", vol->blk_device);
-        return __system(cmd);
-        // return __system("flash_image boot /proc/self/fd/0");
+    for (;;) {
+        ssize_t n = in->read(in, buf, sizeof(buf));
+        if (n <= 0) {
+            if (n < 0)
+                ret = -1;
+            break;
+        }
+        ssize_t done = 0;
+        while (done < n) {
+            ssize_t w = write(fds[1], buf + done, n - done);
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w <= 0)
+                break;
+            done += w;
+        }
+        if (done < n) {
+            ret = -1;
+            break;
+        }
     }
+    close(fds[1]);
+    pthread_join(thread, NULL);
+    return ret != 0 ? ret : job.ret;
+}
+
+// Restores |name| from |in|. A NULL |format| is the dump of an older
+// recovery: raw images as they are and filesystems as plain tar.
+static int bu_undump_partition(archive_source* in, const char* name, const char* format) {
+    char root[PATH_MAX];
+    int compression;
+    int ret;
 
-    if (strcmp(partition, "recovery") == 0) {
-        if (0 != (ret = nandroid_restore_partition("-", "/recovery")))
+    Volume* vol = bu_volume(name, root);
+    if (vol == NULL)
+        return 1;
+
+    if (bu_is_raw(vol)) {
+        if (format != NULL && strcmp(format, "img") != 0) {
+            ui_print("Can't restore %s from a %s backup.\n", name, format);
+            return 1;
+        }
+        ui_print("Erasing %s before restore...\n", name);
+        if (0 != (ret = format_volume(root))) {
+            ui_print("Error while erasing %s image!\n", name);
             return ret;
+        }
+        ui_print("Restoring %s image...\n", name);
+        if (0 != (ret = bu_restore_raw(vol, in)))
+            ui_print("Error while flashing %s image!\n", name);
+        return ret;
     }
 
-    if (strcmp(partition, "system") == 0) {
-        if (0 != (ret = nandroid_restore_partition("-", "/system")))
-            return ret;
+    for (compression = ARCHIVE_COMPRESS_NONE; format != NULL && compression <= ARCHIVE_COMPRESS_LZ4; compression++) {
+        if (strcmp(format, tar_extension(compression)) == 0)
+            break;
     }
+    if (compression > ARCHIVE_COMPRESS_LZ4) {
+        ui_print("Can't restore %s from a %s backup.\n", name, format);
+        return 1;
+    }
+    if (!archive_compression_supported(compression)) {
+        ui_print("This recovery can't read %s backups.\n", format);
+        return 1;
+    }
+    bu_source = in;
+    bu_source_compression = compression;
+    return nandroid_restore_partition_extended("-", root, 1);
+}
 
-    if (strcmp(partition, "data") == 0) {
-        if (0 != (ret = nandroid_restore_partition("-", "/data")))
-            return ret;
+// Restores the partitions of the stream on stdin, or only |partition| when
+// it is not NULL.
+static int nandroid_undump(const char* partition) {
+    char name[PATH_MAX];
+    char format[32];
+    int restored = 0;
+    int ret;
+
+    nandroid_files_total = 0;
+    signal(SIGPIPE, SIG_IGN);
+
+    bu_reader* r = bu_reader_open(STDIN_FILENO);
+    if (r == NULL)
+        return 1;
+
+    if (!bu_reader_framed(r)) {
+        // older dumps carry a single partition and don't name it
+        if (partition == NULL) {
+            printf("nothing to restore!\n");
+            ret = 1;
+        } else {
+            ret = bu_undump_partition(bu_reader_source(r), partition, NULL);
+        }
+    } else {
+        while ((ret = bu_reader_next(r, name, sizeof(name), format, sizeof(format))) > 0) {
+            if (partition != NULL && strcmp(partition, name) != 0)
+                continue;
+            if (0 != (ret = bu_undump_partition(bu_reader_source(r), name, format)))
+                break;
+            restored++;
+        }
+        if (ret == 0 && partition != NULL && restored == 0) {
+            ui_print("No %s in this backup.\n", partition);
+            ret = 1;
+        }
     }
+    bu_reader_close(r);
 
     sync();
-    return 0;
+    return ret;
 }
 
 static int nandroid_usage() {
-    printf("Usage: nandroid backup\n");
+    printf("Usage: nandroid backup [parent directory]\n");
     printf("Usage: nandroid restore <directory>\n");
     printf("Usage: nandroid dump <partition>\n");
     printf("Usage: nandroid undump <partition>\n");
@@ -940,10 +1935,10 @@ static int nandroid_usage() {
 }
 
 static int bu_usage() {
-    printf("Usage: bu <fd> backup partition\n");
-    printf("Usage: Prior to restore:\n");
-    printf("Usage: echo -n <partition> > /tmp/ro.bu.restore\n");
+    printf("Usage: bu <fd> backup [tar|tgz|zst|lz4] <partition>...\n");
     printf("Usage: bu <fd> restore\n");
+    printf("Usage: To restore one partition only, first:\n");
+    printf("Usage: echo -n <partition> > /tmp/ro.bu.restore\n");
     return 1;
 }
 
@@ -951,19 +1946,18 @@ int bu_main(int argc, char** argv) {
     load_volume_table();
 
     if (strcmp(argv[2], "backup") == 0) {
-        if (argc != 4) {
+        if (argc < 4) {
             return bu_usage();
         }
 
         int fd = atoi(argv[1]);
-        char* partition = argv[3];
 
         if (fd != STDOUT_FILENO) {
             dup2(fd, STDOUT_FILENO);
             close(fd);
         }
 
-        int ret = nandroid_dump(partition);
+        int ret = nandroid_dump(argc - 3, &argv[3]);
         sleep(10);
         return ret;
     } else if (strcmp(argv[2], "restore") == 0) {
@@ -977,24 +1971,21 @@ int bu_main(int argc, char** argv) {
             close(fd);
         }
 
+        // bu streams name their partitions, so this only picks one of them;
+        // older dumps can't be restored without it
         char partition[100];
+        const char* filter = NULL;
         FILE* f = fopen("/tmp/ro.bu.restore", "r");
-        if (f == NULL) {
-            printf("cannot open ro.bu.restore\n");
-            return bu_usage();
-        }
-
-        if (fgets(partition, sizeof(partition), f) == NULL) {
+        if (f != NULL) {
+            if (fgets(partition, sizeof(partition), f) != NULL) {
+                partition[strcspn(partition, "\n")] = '\0';
+                if (partition[0] != '\0')
+                    filter = partition;
+            }
             fclose(f);
-            printf("nothing to restore!\n");
-            return bu_usage();
         }
 
-        size_t len = strlen(partition);
-        if (partition[len - 1] == '\n')
-            partition[len - 1] = '\0';
-
-        return nandroid_undump(partition);
+        return nandroid_undump(filter);
     }
 
     return bu_usage();
@@ -1009,8 +2000,10 @@ int nandroid_main(int argc, char** argv) {
         return nandroid_usage();
 
     if (strcmp("backup", argv[1]) == 0) {
-        if (argc != 2)
+        if (argc > 3)
             return nandroid_usage();
+        if (argc == 3)
+            nandroid_set_backup_parent(argv[2]);
 
         nandroid_generate_timestamp_path(backup_path);
         return nandroid_backup(backup_path);
@@ -1027,7 +2020,7 @@ int nandroid_main(int argc, char** argv) {
     if (strcmp("dump", argv[1]) == 0) {
         if (argc != 3)
             return nandroid_usage();
-        return nandroid_dump(argv[2]);
+        return nandroid_dump(1, &argv[2]);
     }
 
     if (strcmp("undump", argv[1]) == 0) {
@@ -21,17 +21,47 @@ int nandroid_main(int argc, char** argv);
 int bu_main(int argc, char** argv);
 
 int nandroid_backup(const char* backup_path);
+// Makes the next nandroid_backup() store only what changed since the backup
+// in |parent_path|, which has to be in the same directory. NULL clears it.
+void nandroid_set_backup_parent(const char* parent_path);
+// Returns 0 if a backup can be stored against |parent_path|: the default
+// format is a tar one and |parent_path| has a tar index to compare with.
+// Prints why not otherwise.
+int nandroid_check_backup_parent(const char* parent_path);
+// Fills |child| with an incremental backup that builds on |backup_path| and
+// returns 0, or returns -1 if nothing does. Such a backup can't be restored
+// without it.
+int nandroid_find_backup_child(const char* backup_path, char* child);
 int nandroid_restore(const char* backup_path, unsigned char flags);
 void nandroid_dedupe_gc(const char* blob_dir);
 void nandroid_force_backup_format(const char* fmt);
 unsigned int nandroid_get_default_backup_format();
+// zst and lz4 need recovery built with their codecs
+int nandroid_backup_format_supported(unsigned int fmt);
+unsigned int nandroid_get_backup_digest();
 
 #define NANDROID_BACKUP_FORMAT_TAR 0
 #define NANDROID_BACKUP_FORMAT_DUP 1
 #define NANDROID_BACKUP_FORMAT_TGZ 2
+#define NANDROID_BACKUP_FORMAT_ZST 3
+#define NANDROID_BACKUP_FORMAT_LZ4 4
+#define NANDROID_BACKUP_FORMAT_COUNT 5
+
+// checksums written for new backups, see nandroid_md5.h
+#define NANDROID_DIGEST_MD5    0
+#define NANDROID_DIGEST_SHA256 1
 
 #define NANDROID_ERROR_GENERAL 1
 
+// Every backup and restore appends a line per partition to this file in the
+// backup directory:
+//   <backup|restore> <name> <format> seconds=<wall time> entries= read=
+//       written= ratio= read_s= compress_s= hash_s= write_s=
+// read and written are bytes, ratio is archive over data size and the *_s
+// fields are the time spent in each stage, which overlap. Fields that were
+// not measured, like most of them for dedupe backups, are left out.
+#define NANDROID_STATS_FILE "nandroid.stats"
+
 #define NANDROID_NONE   0
 #define NANDROID_BOOT   1
 #define NANDROID_SYSTEM 2
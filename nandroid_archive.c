@@ -0,0 +1,1052 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <libgen.h>
+#include <limits.h>
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+// strlcpy() where the host libc has none
+#include "cutils/memory.h"
+#include "nandroid_archive.h"
+#include "nandroid_compress.h"
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_NAME_SIZE 100
+#define TAR_READ_SIZE (256 * 1024)
+// intermediate progress updates while streaming large files
+#define TAR_PROGRESS_INTERVAL (4 * 1024 * 1024)
+
+/*
+ * split sink
+ */
+
+// Small writes (tar headers and padding, the lz4 frame header...) are
+// collected here and go out together with the next large one in a single
+// writev().
+#define SPLIT_BUFFER_SIZE (64 * 1024)
+
+// f_type of the filesystems archive_split_size() knows about
+#define MSDOS_MAGIC 0x4d44
+#define EXT4_MAGIC 0xef53
+#define F2FS_MAGIC 0xf2f52010
+#define EXFAT_MAGIC 0x2011bab0
+#define NTFS_MAGIC 0x5346544e
+
+struct split_sink {
+    archive_sink base;
+    char prefix[PATH_MAX];
+    char path[PATH_MAX]; // current segment
+    uint64_t split_size;
+    uint64_t written; // bytes in the current segment
+    int index;        // current segment, -1 before the first write
+    int fd;
+    const EVP_MD* digest; // NULL when segments aren't hashed
+    EVP_MD_CTX* md;       // of the current segment
+    archive_segment_fn segment_done;
+    void* cookie;
+    archive_counters* counters;
+    archive_counters unused; // counters when the caller doesn't want them
+    unsigned char* buf;      // not yet written part of the current segment
+    size_t buffered;
+};
+
+static int writev_fully(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Writes what is buffered followed by |len| bytes of |data|.
+static int split_flush(struct split_sink* s, const void* data, size_t len) {
+    struct iovec iov[2];
+    int count = 0;
+
+    if (s->buffered > 0) {
+        iov[count].iov_base = s->buf;
+        iov[count].iov_len = s->buffered;
+        count++;
+    }
+    if (len > 0) {
+        iov[count].iov_base = (void*)data;
+        iov[count].iov_len = len;
+        count++;
+    }
+    if (count == 0)
+        return 0;
+
+    uint64_t start = archive_usec();
+    if (writev_fully(s->fd, iov, count) != 0) {
+        fprintf(stderr, "Error writing %s: %s\n", s->prefix, strerror(errno));
+        return -1;
+    }
+    archive_count(&s->counters->write_usec, archive_usec() - start);
+    archive_count(&s->counters->bytes_out, s->buffered + len);
+    s->buffered = 0;
+    return 0;
+}
+
+static int split_close_segment(struct split_sink* s) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    if (s->fd < 0)
+        return 0;
+    if (split_flush(s, NULL, 0) != 0) {
+        close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    if (s->md != NULL)
+        EVP_DigestFinal_ex(s->md, md, &md_len);
+    if (close(s->fd) != 0) {
+        fprintf(stderr, "Error closing %s segment: %s\n", s->prefix, strerror(errno));
+        s->fd = -1;
+        return -1;
+    }
+    s->fd = -1;
+    if (s->segment_done != NULL && s->md != NULL)
+        s->segment_done(s->path, md, md_len, s->cookie);
+    return 0;
+}
+
+void archive_segment_path(char* path, size_t size, const char* prefix, int index) {
+    int len = snprintf(path, size, "%s.", prefix);
+    int z;
+
+    if (len < 0 || (size_t)len + index / 26 + 2 > size) {
+        path[0] = '\0';
+        return;
+    }
+    // "split -a 1" naming for the first 26, so older recoveries can still
+    // "cat prefix*"; after .z come .za ... .zz, .zza ..., which sort right
+    for (z = 0; z < index / 26; z++)
+        path[len++] = 'z';
+    path[len++] = 'a' + index % 26;
+    path[len] = '\0';
+}
+
+uint64_t archive_split_size(const char* path) {
+    struct statfs sfs;
+    if (statfs(path, &sfs) != 0)
+        return ARCHIVE_DEFAULT_SPLIT_SIZE;
+    switch ((uint32_t)sfs.f_type) {
+        case MSDOS_MAGIC:
+            return ARCHIVE_VFAT_SPLIT_SIZE;
+        case EXT4_MAGIC:
+        case F2FS_MAGIC:
+        case EXFAT_MAGIC:
+        case NTFS_MAGIC:
+            return 0;
+    }
+    return ARCHIVE_DEFAULT_SPLIT_SIZE;
+}
+
+static int split_open_next(struct split_sink* s) {
+    if (split_close_segment(s) != 0)
+        return -1;
+
+    archive_segment_path(s->path, sizeof(s->path), s->prefix, ++s->index);
+    s->fd = open(s->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (s->fd < 0) {
+        fprintf(stderr, "Unable to create %s: %s\n", s->path, strerror(errno));
+        return -1;
+    }
+    s->written = 0;
+    if (s->md != NULL && !EVP_DigestInit_ex(s->md, s->digest, NULL)) {
+        // just means the segment gets hashed later on
+        EVP_MD_CTX_destroy(s->md);
+        s->md = NULL;
+    }
+    return 0;
+}
+
+static int write_fully(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int split_write(archive_sink* sink, const void* data, size_t len) {
+    struct split_sink* s = (struct split_sink*)sink;
+    const char* p = (const char*)data;
+
+    while (len > 0) {
+        if (s->fd < 0 || (s->split_size != 0 && s->written == s->split_size)) {
+            if (split_open_next(s) != 0)
+                return -1;
+        }
+
+        size_t n = len;
+        if (s->split_size != 0 && n > s->split_size - s->written)
+            n = s->split_size - s->written;
+        // hash while the data is at hand instead of reading the backup back
+        if (s->md != NULL) {
+            uint64_t start = archive_usec();
+            EVP_DigestUpdate(s->md, p, n);
+            archive_count(&s->counters->hash_usec, archive_usec() - start);
+        }
+        if (s->buffered + n <= SPLIT_BUFFER_SIZE) {
+            memcpy(s->buf + s->buffered, p, n);
+            s->buffered += n;
+        } else if (split_flush(s, p, n) != 0) {
+            return -1;
+        }
+        s->written += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int split_close(archive_sink* sink) {
+    struct split_sink* s = (struct split_sink*)sink;
+    int ret = split_close_segment(s);
+    if (s->md != NULL)
+        EVP_MD_CTX_destroy(s->md);
+    free(s->buf);
+    free(s);
+    return ret;
+}
+
+archive_sink* split_sink_open(const char* prefix, uint64_t split_size, const EVP_MD* digest,
+                              archive_segment_fn segment_done, void* cookie,
+                              archive_counters* counters) {
+    struct split_sink* s = (struct split_sink*)calloc(1, sizeof(struct split_sink));
+    if (s == NULL)
+        return NULL;
+    if ((s->buf = (unsigned char*)malloc(SPLIT_BUFFER_SIZE)) == NULL) {
+        free(s);
+        return NULL;
+    }
+    s->base.write = split_write;
+    s->base.close = split_close;
+    strlcpy(s->prefix, prefix, sizeof(s->prefix));
+    s->split_size = split_size;
+    s->index = -1;
+    s->fd = -1;
+    s->digest = digest;
+    if (digest != NULL)
+        s->md = EVP_MD_CTX_create();
+    s->segment_done = segment_done;
+    s->cookie = cookie;
+    s->counters = counters != NULL ? counters : &s->unused;
+    return &s->base;
+}
+
+/*
+ * fd sink
+ */
+
+struct fd_sink {
+    archive_sink base;
+    int fd;
+};
+
+static int fd_write(archive_sink* sink, const void* data, size_t len) {
+    struct fd_sink* s = (struct fd_sink*)sink;
+    if (write_fully(s->fd, data, len) != 0) {
+        fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int fd_close(archive_sink* sink) {
+    free(sink);
+    return 0;
+}
+
+archive_sink* fd_sink_open(int fd) {
+    struct fd_sink* s = (struct fd_sink*)calloc(1, sizeof(struct fd_sink));
+    if (s == NULL)
+        return NULL;
+    s->base.write = fd_write;
+    s->base.close = fd_close;
+    s->fd = fd;
+    return &s->base;
+}
+
+/*
+ * index
+ */
+
+#define INDEX_MAGIC "archive-index 1"
+#define INDEX_PARENT "parent "
+#define INDEX_LINE_SIZE (PATH_MAX + 128)
+
+struct index_entry {
+    char* name;
+    char type;
+    unsigned int mode;
+    unsigned int uid;
+    unsigned int gid;
+    unsigned long long size;
+    long long mtime;
+    int seen; // still exists in the tree being archived
+};
+
+// The parent's index, hashed by name.
+struct archive_index {
+    struct index_entry* entries;
+    int count;
+    int* slots; // entry + 1, 0 when free
+    unsigned int mask;
+};
+
+static char index_type(mode_t mode) {
+    if (S_ISREG(mode))
+        return 'f';
+    if (S_ISDIR(mode))
+        return 'd';
+    if (S_ISLNK(mode))
+        return 'l';
+    return 'o';
+}
+
+static unsigned int index_hash(const char* name) {
+    unsigned int h = 2166136261U;
+    while (*name != '\0')
+        h = (h ^ (unsigned char)*name++) * 16777619U;
+    return h;
+}
+
+// Splits an entry line into its fields; |*name| points into |line|.
+static int index_parse_line(char* line, struct index_entry* e, char** name) {
+    int n = 0;
+    size_t len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n')
+        line[--len] = '\0';
+    if (line[0] == '-' && line[1] == ' ') {
+        e->type = '-';
+        *name = line + 2;
+        return 0;
+    }
+    if (sscanf(line, "%c %o %u %u %llu %lld %n", &e->type, &e->mode, &e->uid, &e->gid,
+               &e->size, &e->mtime, &n) != 6 || n == 0)
+        return -1;
+    *name = line + n;
+    return 0;
+}
+
+static void index_free(struct archive_index* index) {
+    int i;
+    if (index == NULL)
+        return;
+    for (i = 0; i < index->count; i++)
+        free(index->entries[i].name);
+    free(index->entries);
+    free(index->slots);
+    free(index);
+}
+
+static struct index_entry* index_find(struct archive_index* index, const char* name) {
+    unsigned int i = index_hash(name) & index->mask;
+    while (index->slots[i] != 0) {
+        struct index_entry* e = &index->entries[index->slots[i] - 1];
+        if (strcmp(e->name, name) == 0)
+            return e;
+        i = (i + 1) & index->mask;
+    }
+    return NULL;
+}
+
+static struct archive_index* index_load(const char* path) {
+    char line[INDEX_LINE_SIZE];
+    int capacity = 0;
+    int i;
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return NULL;
+
+    struct archive_index* index = (struct archive_index*)calloc(1, sizeof(struct archive_index));
+    if (index == NULL || fgets(line, sizeof(line), f) == NULL || strncmp(line, INDEX_MAGIC "\n", sizeof(line)) != 0)
+        goto error;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        struct index_entry e;
+        char* name;
+        if (strncmp(line, INDEX_PARENT, strlen(INDEX_PARENT)) == 0)
+            continue;
+        memset(&e, 0, sizeof(e));
+        if (index_parse_line(line, &e, &name) != 0)
+            goto error;
+        // removals only matter to the restore of this very archive
+        if (e.type == '-')
+            continue;
+        if (index->count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            struct index_entry* entries = (struct index_entry*)realloc(index->entries, capacity * sizeof(struct index_entry));
+            if (entries == NULL)
+                goto error;
+            index->entries = entries;
+        }
+        if ((e.name = strdup(name)) == NULL)
+            goto error;
+        index->entries[index->count++] = e;
+    }
+    if (ferror(f))
+        goto error;
+    fclose(f);
+    f = NULL;
+
+    // at most half full
+    index->mask = 1023;
+    while (index->mask / 2 < (unsigned int)index->count)
+        index->mask = index->mask * 2 + 1;
+    if ((index->slots = (int*)calloc(index->mask + 1, sizeof(int))) == NULL)
+        goto error;
+    for (i = 0; i < index->count; i++) {
+        unsigned int h = index_hash(index->entries[i].name) & index->mask;
+        while (index->slots[h] != 0)
+            h = (h + 1) & index->mask;
+        index->slots[h] = i + 1;
+    }
+    return index;
+
+error:
+    fprintf(stderr, "Unable to load archive index %s\n", path);
+    if (f != NULL)
+        fclose(f);
+    index_free(index);
+    return NULL;
+}
+
+int archive_index_parent(const char* index, char* label, size_t size) {
+    char line[INDEX_LINE_SIZE];
+    int ret = -1;
+    FILE* f = fopen(index, "r");
+    if (f == NULL)
+        return -1;
+    if (fgets(line, sizeof(line), f) != NULL && strcmp(line, INDEX_MAGIC "\n") == 0) {
+        ret = 1;
+        // the parent, if any, comes right after the magic
+        if (fgets(line, sizeof(line), f) != NULL && strncmp(line, INDEX_PARENT, strlen(INDEX_PARENT)) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            strlcpy(label, line + strlen(INDEX_PARENT), size);
+            ret = 0;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+int archive_index_removed(const char* index, archive_removed_fn fn, void* cookie) {
+    char line[INDEX_LINE_SIZE];
+    FILE* f = fopen(index, "r");
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        struct index_entry e;
+        char* name;
+        if (line[0] != '-' || index_parse_line(line, &e, &name) != 0)
+            continue;
+        fn(name, cookie);
+    }
+    int ret = ferror(f) ? -1 : 0;
+    fclose(f);
+    return ret;
+}
+
+/*
+ * tar writer
+ */
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char padding[12];
+};
+
+struct hardlink {
+    dev_t dev;
+    ino_t ino;
+    char* name;
+};
+
+struct tar_writer {
+    archive_sink* out;
+    const archive_options* opts;
+    unsigned char* buf;
+    uint64_t bytes;
+    uint64_t last_progress;
+    struct hardlink* links;
+    int link_count;
+    int link_capacity;
+    int* link_slots; // links hashed by inode: link + 1, 0 when free
+    unsigned int link_mask;
+    FILE* index;                 // NULL unless opts->index is set
+    struct archive_index* parent; // NULL for a full archive
+    archive_counters* counters;
+};
+
+// Numeric fields are octal; values that do not fit use the GNU base-256
+// extension, which busybox and GNU tar both understand.
+static void tar_number(char* field, size_t size, uint64_t value) {
+    if (value < (1ULL << (3 * (size - 1)))) {
+        snprintf(field, size, "%0*llo", (int)(size - 1), (unsigned long long)value);
+        return;
+    }
+    size_t i;
+    for (i = size - 1; i > 0; i--) {
+        field[i] = value & 0xff;
+        value >>= 8;
+    }
+    field[0] = (char)0x80;
+}
+
+static int tar_write_header(struct tar_writer* tw, struct tar_header* h) {
+    unsigned int sum = 0;
+    size_t i;
+    const unsigned char* p = (const unsigned char*)h;
+
+    memcpy(h->magic, "ustar ", 6);
+    memcpy(h->version, " ", 2);
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    for (i = 0; i < sizeof(*h); i++)
+        sum += p[i];
+    snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+
+    return tw->out->write(tw->out, h, sizeof(*h));
+}
+
+// GNU ././@LongLink record for names that do not fit the 100 byte field.
+static int tar_write_longlink(struct tar_writer* tw, char type, const char* name) {
+    struct tar_header h;
+    size_t len = strlen(name) + 1;
+    size_t pad = (TAR_BLOCK_SIZE - (len % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+    static const char zeros[TAR_BLOCK_SIZE];
+
+    memset(&h, 0, sizeof(h));
+    strcpy(h.name, "././@LongLink");
+    tar_number(h.mode, sizeof(h.mode), 0);
+    tar_number(h.uid, sizeof(h.uid), 0);
+    tar_number(h.gid, sizeof(h.gid), 0);
+    tar_number(h.size, sizeof(h.size), len);
+    tar_number(h.mtime, sizeof(h.mtime), 0);
+    h.typeflag = type;
+    if (tar_write_header(tw, &h) != 0)
+        return -1;
+    if (tw->out->write(tw->out, name, len) != 0)
+        return -1;
+    return tw->out->write(tw->out, zeros, pad);
+}
+
+static int tar_write_entry_header(struct tar_writer* tw, const char* name, const struct stat* st,
+                                  char type, const char* link, uint64_t size) {
+    struct tar_header h;
+
+    if (strlen(name) > TAR_NAME_SIZE && tar_write_longlink(tw, 'L', name) != 0)
+        return -1;
+    if (link != NULL && strlen(link) > TAR_NAME_SIZE && tar_write_longlink(tw, 'K', link) != 0)
+        return -1;
+
+    memset(&h, 0, sizeof(h));
+    strncpy(h.name, name, sizeof(h.name));
+    tar_number(h.mode, sizeof(h.mode), st->st_mode & 07777);
+    tar_number(h.uid, sizeof(h.uid), st->st_uid);
+    tar_number(h.gid, sizeof(h.gid), st->st_gid);
+    tar_number(h.size, sizeof(h.size), size);
+    tar_number(h.mtime, sizeof(h.mtime), st->st_mtime);
+    h.typeflag = type;
+    if (link != NULL)
+        strncpy(h.linkname, link, sizeof(h.linkname));
+    if (type == '3' || type == '4') {
+        tar_number(h.devmajor, sizeof(h.devmajor), major(st->st_rdev));
+        tar_number(h.devminor, sizeof(h.devminor), minor(st->st_rdev));
+    }
+    return tar_write_header(tw, &h);
+}
+
+static void tar_progress(struct tar_writer* tw, const char* name) {
+    if (tw->opts->progress == NULL)
+        return;
+    if (name == NULL && tw->bytes - tw->last_progress < TAR_PROGRESS_INTERVAL)
+        return;
+    tw->last_progress = tw->bytes;
+    tw->opts->progress(name, tw->bytes, tw->opts->cookie);
+}
+
+static unsigned int hardlink_hash(dev_t dev, ino_t ino) {
+    uint64_t h = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)ino;
+    h *= 0x9e3779b97f4a7c15ULL;
+    return (unsigned int)(h >> 32);
+}
+
+static void hardlink_slot(struct tar_writer* tw, int link) {
+    unsigned int i = hardlink_hash(tw->links[link].dev, tw->links[link].ino) & tw->link_mask;
+    while (tw->link_slots[i] != 0)
+        i = (i + 1) & tw->link_mask;
+    tw->link_slots[i] = link + 1;
+}
+
+// Returns the name a previously archived hard link to the same inode was
+// stored under, or records this one and returns NULL.
+static const char* tar_find_hardlink(struct tar_writer* tw, const struct stat* st, const char* name) {
+    unsigned int i;
+    int j;
+
+    if (tw->link_slots != NULL) {
+        i = hardlink_hash(st->st_dev, st->st_ino) & tw->link_mask;
+        while (tw->link_slots[i] != 0) {
+            struct hardlink* l = &tw->links[tw->link_slots[i] - 1];
+            if (l->dev == st->st_dev && l->ino == st->st_ino)
+                return l->name;
+            i = (i + 1) & tw->link_mask;
+        }
+    }
+
+    if (tw->link_count == tw->link_capacity) {
+        int capacity = tw->link_capacity ? tw->link_capacity * 2 : 16;
+        // at most half full
+        int* slots = (int*)calloc(capacity * 2, sizeof(int));
+        if (slots == NULL)
+            return NULL;
+        struct hardlink* links = (struct hardlink*)realloc(tw->links, capacity * sizeof(struct hardlink));
+        if (links == NULL) {
+            free(slots);
+            return NULL;
+        }
+        tw->links = links;
+        tw->link_capacity = capacity;
+        free(tw->link_slots);
+        tw->link_slots = slots;
+        tw->link_mask = capacity * 2 - 1;
+        for (j = 0; j < tw->link_count; j++)
+            hardlink_slot(tw, j);
+    }
+    tw->links[tw->link_count].dev = st->st_dev;
+    tw->links[tw->link_count].ino = st->st_ino;
+    tw->links[tw->link_count].name = strdup(name);
+    hardlink_slot(tw, tw->link_count);
+    tw->link_count++;
+    return NULL;
+}
+
+static int tar_write_file(struct tar_writer* tw, const char* path, const char* name, const struct stat* st) {
+    static const char zeros[TAR_BLOCK_SIZE];
+    uint64_t size = st->st_size;
+    uint64_t done = 0;
+    int ret = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (tar_write_entry_header(tw, name, st, '0', NULL, size) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // The header already promised |size| bytes, so a file that grows is
+    // truncated and one that shrinks is padded with zeros.
+    while (done < size) {
+        size_t want = TAR_READ_SIZE;
+        if (want > size - done)
+            want = size - done;
+        uint64_t start = archive_usec();
+        ssize_t n = read(fd, tw->buf, want);
+        archive_count(&tw->counters->read_usec, archive_usec() - start);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n > 0)
+            archive_count(&tw->counters->bytes_in, n);
+        if (n < 0) {
+            fprintf(stderr, "Error reading %s: %s\n", path, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (n == 0) {
+            fprintf(stderr, "%s: file shrank by %llu bytes; padding with zeros\n",
+                    path, (unsigned long long)(size - done));
+            memset(tw->buf, 0, want);
+            n = want;
+        }
+        if (tw->out->write(tw->out, tw->buf, n) != 0) {
+            ret = -1;
+            break;
+        }
+        done += n;
+        tw->bytes += n;
+        tar_progress(tw, NULL);
+    }
+    close(fd);
+
+    if (ret == 0 && (size % TAR_BLOCK_SIZE) != 0)
+        ret = tw->out->write(tw->out, zeros, TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE));
+    return ret;
+}
+
+static int is_excluded(const archive_options* opts, const char* name) {
+    int i;
+    for (i = 0; i < opts->exclude_count; i++) {
+        if (fnmatch(opts->excludes[i], name, 0) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Lists |name| in the index and returns 1 if it is a regular file the
+// parent already has exactly like this.
+static int tar_index_entry(struct tar_writer* tw, const char* name, const struct stat* st) {
+    char type = index_type(st->st_mode);
+    unsigned long long size = S_ISREG(st->st_mode) ? st->st_size : 0;
+    int unchanged = 0;
+
+    if (tw->index == NULL || strchr(name, '\n') != NULL)
+        return 0;
+    if (tw->parent != NULL) {
+        struct index_entry* e = index_find(tw->parent, name);
+        if (e != NULL) {
+            e->seen = 1;
+            // the restore has to clear the way for a different kind of entry
+            if (e->type != type)
+                fprintf(tw->index, "- %s\n", name);
+            // like rsync, trust size and mtime rather than reading the file
+            unchanged = type == 'f' && e->type == type && e->size == size && e->mtime == st->st_mtime &&
+                        e->mode == (st->st_mode & 07777) && e->uid == st->st_uid && e->gid == st->st_gid;
+        }
+    }
+    fprintf(tw->index, "%c %o %u %u %llu %lld %s\n", type, (unsigned int)(st->st_mode & 07777),
+            (unsigned int)st->st_uid, (unsigned int)st->st_gid, size, (long long)st->st_mtime, name);
+    return unchanged;
+}
+
+// Returns 1 if |name| or any directory above it is excluded.
+static int tar_index_excluded(const archive_options* opts, const char* name) {
+    char tmp[PATH_MAX];
+    char* p;
+    strlcpy(tmp, name, sizeof(tmp));
+    for (p = strchr(tmp, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        int excluded = is_excluded(opts, tmp);
+        *p = '/';
+        if (excluded)
+            return 1;
+    }
+    return is_excluded(opts, tmp);
+}
+
+// Lists everything the parent had that is gone now. Entries that are
+// excluded from this archive are left alone rather than removed.
+static void tar_index_removed(struct tar_writer* tw) {
+    int i;
+    for (i = 0; i < tw->parent->count; i++) {
+        struct index_entry* e = &tw->parent->entries[i];
+        if (!e->seen && !tar_index_excluded(tw->opts, e->name))
+            fprintf(tw->index, "- %s\n", e->name);
+    }
+}
+
+static int tar_write_tree(struct tar_writer* tw, const char* path, const char* name) {
+    struct stat st;
+    char entry_name[PATH_MAX];
+    int ret = 0;
+
+    if (lstat(path, &st) != 0) {
+        fprintf(stderr, "Unable to stat %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    archive_count(&tw->counters->entries, 1);
+
+    if (tar_index_entry(tw, name, &st)) {
+        // the parent's copy is restored first; later links to it can
+        // still be archived as links
+        if (st.st_nlink > 1)
+            tar_find_hardlink(tw, &st, name);
+        tw->bytes += st.st_size;
+        tar_progress(tw, name);
+        return 0;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        snprintf(entry_name, sizeof(entry_name), "%s/", name);
+        if (tar_write_entry_header(tw, entry_name, &st, '5', NULL, 0) != 0)
+            return -1;
+        tar_progress(tw, entry_name);
+
+        DIR* dp = opendir(path);
+        if (dp == NULL) {
+            fprintf(stderr, "Unable to open directory %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        struct dirent* ep;
+        while (ret == 0 && (ep = readdir(dp)) != NULL) {
+            if (strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0)
+                continue;
+            char child_path[PATH_MAX];
+            char child_name[PATH_MAX];
+            snprintf(child_path, sizeof(child_path), "%s/%s", path, ep->d_name);
+            snprintf(child_name, sizeof(child_name), "%s/%s", name, ep->d_name);
+            if (is_excluded(tw->opts, child_name))
+                continue;
+            ret = tar_write_tree(tw, child_path, child_name);
+        }
+        closedir(dp);
+        return ret;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        if (st.st_nlink > 1) {
+            const char* target = tar_find_hardlink(tw, &st, name);
+            if (target != NULL) {
+                ret = tar_write_entry_header(tw, name, &st, '1', target, 0);
+                tar_progress(tw, name);
+                return ret;
+            }
+        }
+        ret = tar_write_file(tw, path, name, &st);
+    } else if (S_ISLNK(st.st_mode)) {
+        char link[PATH_MAX];
+        ssize_t len = readlink(path, link, sizeof(link) - 1);
+        if (len < 0) {
+            fprintf(stderr, "Unable to read link %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        link[len] = '\0';
+        ret = tar_write_entry_header(tw, name, &st, '2', link, 0);
+    } else if (S_ISCHR(st.st_mode)) {
+        ret = tar_write_entry_header(tw, name, &st, '3', NULL, 0);
+    } else if (S_ISBLK(st.st_mode)) {
+        ret = tar_write_entry_header(tw, name, &st, '4', NULL, 0);
+    } else if (S_ISFIFO(st.st_mode)) {
+        ret = tar_write_entry_header(tw, name, &st, '6', NULL, 0);
+    } else {
+        // sockets can't be archived, tar skips them as well
+        fprintf(stderr, "%s: socket ignored\n", path);
+        return 0;
+    }
+
+    tar_progress(tw, name);
+    return ret;
+}
+
+int archive_compression_supported(int compression) {
+    switch (compression) {
+        case ARCHIVE_COMPRESS_NONE:
+        case ARCHIVE_COMPRESS_GZIP:
+            return 1;
+#ifdef USE_ZSTD
+        case ARCHIVE_COMPRESS_ZSTD:
+            return 1;
+#endif
+#ifdef USE_LZ4
+        case ARCHIVE_COMPRESS_LZ4:
+            return 1;
+#endif
+    }
+    return 0;
+}
+
+static archive_sink* compress_sink_open(archive_sink* out, const archive_options* opts,
+                                        archive_counters* counters) {
+    switch (opts->compression) {
+        case ARCHIVE_COMPRESS_GZIP:
+            return gzip_sink_open(out, opts->level, opts->threads, counters);
+#ifdef USE_ZSTD
+        case ARCHIVE_COMPRESS_ZSTD:
+            return zstd_sink_open(out, opts->level, opts->threads, counters);
+#endif
+#ifdef USE_LZ4
+        case ARCHIVE_COMPRESS_LZ4:
+            return lz4_sink_open(out, opts->level, counters);
+#endif
+    }
+    fprintf(stderr, "Compression %d is not supported by this build\n", opts->compression);
+    return NULL;
+}
+
+int archive_create_to_sink(const char* source, archive_sink* out, const archive_options* opts) {
+    struct tar_writer tw;
+    archive_counters unused;
+    archive_counters* counters = opts->counters != NULL ? opts->counters : &unused;
+    char tmp[PATH_MAX];
+    char name[PATH_MAX];
+    int ret;
+    int i;
+
+    if (out == NULL)
+        return -1;
+
+    memset(&unused, 0, sizeof(unused));
+    if (opts->compression != ARCHIVE_COMPRESS_NONE) {
+        archive_sink* compressed = compress_sink_open(out, opts, counters);
+        if (compressed == NULL) {
+            out->close(out);
+            return -1;
+        }
+        out = compressed;
+    }
+
+    memset(&tw, 0, sizeof(tw));
+    tw.out = out;
+    tw.opts = opts;
+    tw.counters = counters;
+    tw.buf = (unsigned char*)malloc(TAR_READ_SIZE);
+    if (tw.buf == NULL) {
+        out->close(out);
+        return -1;
+    }
+    if (opts->index != NULL) {
+        if (opts->parent_index != NULL && (tw.parent = index_load(opts->parent_index)) == NULL) {
+            free(tw.buf);
+            out->close(out);
+            return -1;
+        }
+        if ((tw.index = fopen(opts->index, "w")) == NULL) {
+            fprintf(stderr, "Unable to create %s: %s\n", opts->index, strerror(errno));
+            index_free(tw.parent);
+            free(tw.buf);
+            out->close(out);
+            return -1;
+        }
+        fprintf(tw.index, INDEX_MAGIC "\n");
+        if (tw.parent != NULL)
+            fprintf(tw.index, INDEX_PARENT "%s\n", opts->parent_label);
+    }
+
+    // member names are relative to the parent, e.g. "data/app/foo.apk"
+    strlcpy(tmp, source, sizeof(tmp));
+    strlcpy(name, basename(tmp), sizeof(name));
+    ret = tar_write_tree(&tw, source, name);
+
+    if (ret == 0) {
+        // end of archive: two zero blocks
+        static const char zeros[TAR_BLOCK_SIZE * 2];
+        ret = out->write(out, zeros, sizeof(zeros));
+    }
+    if (out->close(out) != 0)
+        ret = -1;
+
+    if (tw.index != NULL) {
+        if (ret == 0 && tw.parent != NULL)
+            tar_index_removed(&tw);
+        if (ferror(tw.index))
+            ret = -1;
+        if (fclose(tw.index) != 0)
+            ret = -1;
+        // a partial index would make the next backup skip files
+        if (ret != 0)
+            unlink(opts->index);
+    }
+    index_free(tw.parent);
+
+    for (i = 0; i < tw.link_count; i++)
+        free(tw.links[i].name);
+    free(tw.links);
+    free(tw.link_slots);
+    free(tw.buf);
+    return ret;
+}
+
+// Walks |parent_fd|/|name| like tar_write_tree() without reading any file.
+static void measure_tree(int parent_fd, const char* name, const char* entry_name,
+                         const archive_options* opts, archive_stats* stats) {
+    struct stat st;
+    if (fstatat(parent_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return;
+    stats->entries++;
+    if (S_ISREG(st.st_mode)) {
+        stats->bytes += st.st_size;
+        return;
+    }
+    if (!S_ISDIR(st.st_mode))
+        return;
+
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY);
+    DIR* dp = fd < 0 ? NULL : fdopendir(fd);
+    if (dp == NULL) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    struct dirent* ep;
+    while ((ep = readdir(dp)) != NULL) {
+        if (strcmp(ep->d_name, ".") == 0 || strcmp(ep->d_name, "..") == 0)
+            continue;
+        char child_name[PATH_MAX];
+        snprintf(child_name, sizeof(child_name), "%s/%s", entry_name, ep->d_name);
+        if (is_excluded(opts, child_name))
+            continue;
+        measure_tree(dirfd(dp), ep->d_name, child_name, opts, stats);
+    }
+    closedir(dp);
+}
+
+void archive_measure(const char* source, const archive_options* opts, archive_stats* stats) {
+    char tmp[PATH_MAX];
+    char name[PATH_MAX];
+
+    memset(stats, 0, sizeof(*stats));
+    strlcpy(tmp, source, sizeof(tmp));
+    strlcpy(name, basename(tmp), sizeof(name));
+    measure_tree(AT_FDCWD, source, name, opts, stats);
+}
+
+int archive_create(const char* source, const char* output_prefix, const archive_options* opts) {
+    return archive_create_to_sink(source, split_sink_open(output_prefix, opts->split_size, opts->digest,
+                                                          opts->segment_done, opts->cookie, opts->counters),
+                                  opts);
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NANDROID_ARCHIVE_H
+#define _NANDROID_ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <openssl/evp.h>
+
+// Native replacement for the "tar | pigz | split" backup pipeline.
+// Nothing in here touches the recovery UI, so it can be linked into host
+// tools; callers get progress through archive_progress_fn.
+
+// A byte sink. Sinks are stacked (tar -> compressor -> split files) and
+// closing the top sink closes the ones underneath it.
+typedef struct archive_sink archive_sink;
+struct archive_sink {
+    // Returns 0 on success, -1 on error.
+    int (*write)(archive_sink* sink, const void* data, size_t len);
+    // Flushes, releases the sink and returns 0 if everything written made it
+    // to disk.
+    int (*close)(archive_sink* sink);
+};
+
+// The other direction: a stream to restore from that isn't a set of files,
+// like the bu stream coming in over adb. Owned by the caller.
+typedef struct archive_source archive_source;
+struct archive_source {
+    // Reads up to |len| bytes. Returns how many, 0 at the end and -1 on
+    // error.
+    ssize_t (*read)(archive_source* source, void* data, size_t len);
+};
+
+// Where the time of one archive_create()/archive_extract() went. Stages run
+// concurrently, so the times can add up to more than the wall time, and
+// compress_usec is summed over all compression workers.
+typedef struct {
+    uint64_t entries;           // files, directories, links...
+    uint64_t bytes_in;          // create: file data read; extract: archive read
+    uint64_t bytes_out;         // create: archive written; extract: file data
+    uint64_t read_usec;
+    uint64_t compress_usec;     // (de)compression
+    uint64_t hash_usec;         // segment digests
+    uint64_t write_usec;
+} archive_counters;
+
+// Same segment size the old "split -b 1000000000" pipeline used.
+#define ARCHIVE_DEFAULT_SPLIT_SIZE 1000000000ULL
+// largest file vfat can hold
+#define ARCHIVE_VFAT_SPLIT_SIZE 4294967295ULL
+
+// Called with the digest of every segment once it has been closed
+// successfully.
+typedef void (*archive_segment_fn)(const char* path, const unsigned char* md, unsigned int md_len, void* cookie);
+
+// Writes to |prefix|.a, |prefix|.b, ... starting a new segment every
+// |split_size| bytes (0 disables splitting, and everything goes to |prefix|.a).
+// Each segment is hashed with |digest| as it is written unless that is NULL.
+// |segment_done| and |counters| may be NULL.
+archive_sink* split_sink_open(const char* prefix, uint64_t split_size, const EVP_MD* digest,
+                              archive_segment_fn segment_done, void* cookie,
+                              archive_counters* counters);
+
+// Names segment |index| of |prefix|: .a to .z, then .za to .zz, .zza...
+// so that "cat prefix*" still puts them in order.
+void archive_segment_path(char* path, size_t size, const char* prefix, int index);
+
+// Segment size for backups written to |path|'s filesystem: as large as vfat
+// allows there, 0 (a single segment) where files can be as large as they
+// need, ARCHIVE_DEFAULT_SPLIT_SIZE where it's not known.
+uint64_t archive_split_size(const char* path);
+
+// Writes to an already open file descriptor, which is not closed.
+archive_sink* fd_sink_open(int fd);
+
+enum {
+    ARCHIVE_COMPRESS_NONE = 0,
+    ARCHIVE_COMPRESS_GZIP,
+    ARCHIVE_COMPRESS_ZSTD,      // built with USE_ZSTD only
+    ARCHIVE_COMPRESS_LZ4,       // built with USE_LZ4 only
+};
+
+// Returns 1 if |compression| can be written and read by this build.
+int archive_compression_supported(int compression);
+
+// |filename| is non-NULL once per archived entry and NULL for intermediate
+// updates while a large file is streamed. |bytes| is the running total of
+// file data read from the source tree, or skipped as unchanged.
+typedef void (*archive_progress_fn)(const char* filename, uint64_t bytes, void* cookie);
+
+typedef struct {
+    int compression;            // ARCHIVE_COMPRESS_*
+    int level;                  // compression level, 0 = codec default
+    int threads;                // compression workers, 0 = online cores
+    uint64_t split_size;        // see split_sink_open()
+    const char** excludes;      // fnmatch patterns relative to the archive root
+    int exclude_count;
+    archive_progress_fn progress;
+    const EVP_MD* digest;       // see split_sink_open()
+    archive_segment_fn segment_done;
+    void* cookie;               // passed to progress and segment_done
+    const char* index;          // see "Incremental archives" below
+    const char* parent_index;
+    const char* parent_label;
+    archive_counters* counters; // added to when set, never cleared
+} archive_options;
+
+// Archives |source| (e.g. "/data") as a GNU tar stream with member names
+// relative to its parent directory ("data/..."), just like
+// "cd $(dirname source); tar -cp $(basename source)".
+// The (optionally compressed) stream is split into segments named
+// |output_prefix|.a, |output_prefix|.b, ...
+// Returns 0 on success.
+int archive_create(const char* source, const char* output_prefix, const archive_options* opts);
+
+// Same, but streams into an existing sink, which is closed on return.
+int archive_create_to_sink(const char* source, archive_sink* out, const archive_options* opts);
+
+// Restores an archive written by archive_create() (or by tar, optionally
+// piped through gzip/pigz and split) into |dest|, like
+// "cd dest; cat input_prefix* | tar -xp". Segments are read ahead and
+// inflated on their own threads while opts->threads writers (0 = online
+// cores) create the files; large files are preallocated from their size in
+// the tar header. opts->compression and the progress callback are used, the
+// latter with the bytes of the archive (not its contents) read so far.
+// Returns 0 on success.
+int archive_extract(const char* input_prefix, const char* dest, const archive_options* opts);
+
+// Same, but reads the archive from |in| until its end.
+int archive_extract_from_source(archive_source* in, const char* dest, const archive_options* opts);
+
+typedef struct {
+    uint64_t entries;           // files, directories, links...
+    uint64_t bytes;             // regular file data
+} archive_stats;
+
+// Walks |source| the way archive_create() would, honouring opts->excludes,
+// to size a progress bar. Unreadable entries are skipped.
+void archive_measure(const char* source, const archive_options* opts, archive_stats* stats);
+
+// Incremental archives. With opts->index set, archive_create() also writes
+// a text listing of the tree to that file:
+//   archive-index 1
+//   parent <label>                                (incremental archives only)
+//   <f|d|l|o> <mode> <uid> <gid> <size> <mtime> <name>
+//   - <name>                                      (removed since the parent)
+// With opts->parent_index set as well, regular files whose size, mtime,
+// mode and owner match the parent's listing are left out of the archive,
+// and opts->parent_label is recorded so the parent can be found again.
+// Restoring one means restoring the parent, removing the "-" names and
+// extracting the archive on top.
+
+// Copies the parent label of |index| into |label|. Returns 0 if it has one,
+// 1 for a full archive and -1 if |index| can't be read.
+int archive_index_parent(const char* index, char* label, size_t size);
+
+typedef void (*archive_removed_fn)(const char* name, void* cookie);
+
+// Calls |fn| with every name |index| lists as removed. Returns 0 on success.
+int archive_index_removed(const char* index, archive_removed_fn fn, void* cookie);
+
+#endif
@@ -0,0 +1,496 @@
+// Times the nandroid backup and restore paths on a synthetic tree.
+//
+//   nandroid_bench [-n file_count] [-d small|mixed|large] [-m max_file_kb]
+//                  [-i image_mb] [-t threads] [-D] work_dir [format...]
+//
+// Formats are tar, tgz, zst, lz4, dup and raw (all the ones this build
+// supports by default). A tree is generated under work_dir/src and, for
+// raw, a partly used image in work_dir/src.img standing in for a
+// partition. Each backup and restore runs in its own child process so the
+// peak RSS and the syscall counts are its own; every run ends with a
+// sync, so MB/s is to disk, not to the page cache. Without -D (drop
+// caches before each run, needs root) the source is read from a warm
+// cache, like a second backup in a row.
+//
+// Restores are checked against the source by their file count and bytes.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <openssl/evp.h>
+
+#include "nandroid_archive.h"
+#include "dedupe/dedupe.h"
+
+int mmc_raw_dump_internal(const char* in_file, const char *out_file);
+
+#define BENCH_FILES_PER_DIR 100
+// share of each generated file that is random, the rest is repeated text
+// and compresses well, roughly what /data looks like
+#define BENCH_RANDOM_PERCENT 50
+
+enum {
+    BENCH_TAR = 0,
+    BENCH_TGZ,
+    BENCH_ZST,
+    BENCH_LZ4,
+    BENCH_DUP,
+    BENCH_RAW,
+    BENCH_FORMAT_COUNT,
+};
+
+static const char* format_names[] = { "tar", "tgz", "zst", "lz4", "dup", "raw" };
+static const int format_compression[] = {
+    ARCHIVE_COMPRESS_NONE, ARCHIVE_COMPRESS_GZIP, ARCHIVE_COMPRESS_ZSTD, ARCHIVE_COMPRESS_LZ4, -1, -1,
+};
+
+struct bench_result {
+    int ret;
+    double seconds;
+    long peak_rss_kb;
+    uint64_t read_calls;
+    uint64_t write_calls;
+    long context_switches;
+};
+
+static const char* work;
+static int threads;
+static int drop_caches;
+static uint64_t tree_files;
+static uint64_t tree_bytes;
+static uint64_t image_bytes;
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// small: app data, databases and prefs. mixed: mostly small files with a
+// few large ones, like a whole /data. large: apks and media.
+static size_t pick_size(const char* dist, size_t max) {
+    uint32_t r = rng() % 100;
+    if (strcmp(dist, "small") == 0)
+        return r < 90 ? rng() % 4096 : rng() % 65536;
+    if (strcmp(dist, "large") == 0)
+        return max / 2 + rng() % (max / 2 + 1);
+    if (r < 70)
+        return rng() % 16384;
+    if (r < 95)
+        return rng() % (max / 8 + 1);
+    return max / 2 + rng() % (max / 2 + 1);
+}
+
+static int write_file(const char* path, size_t size) {
+    static const char text[] = "the quick brown fox jumps over the lazy dog 0123456789\n";
+    static char buf[65536];
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    while (size > 0) {
+        size_t n = size < sizeof(buf) ? size : sizeof(buf);
+        size_t i;
+        if (rng() % 100 < BENCH_RANDOM_PERCENT) {
+            for (i = 0; i < n; i += 4) {
+                uint32_t v = rng();
+                memcpy(buf + i, &v, n - i < 4 ? n - i : 4);
+            }
+        } else {
+            for (i = 0; i < n; i++)
+                buf[i] = text[i % (sizeof(text) - 1)];
+        }
+        if (write(fd, buf, n) != (ssize_t)n) {
+            close(fd);
+            return -1;
+        }
+        size -= n;
+    }
+    return close(fd);
+}
+
+static int make_tree(int count, const char* dist, size_t max) {
+    char path[PATH_MAX];
+    int i;
+
+    snprintf(path, sizeof(path), "%s/src", work);
+    mkdir(path, 0755);
+    for (i = 0; i < count; i++) {
+        size_t size = pick_size(dist, max);
+        if (i % BENCH_FILES_PER_DIR == 0) {
+            snprintf(path, sizeof(path), "%s/src/%d", work, i / BENCH_FILES_PER_DIR);
+            mkdir(path, 0755);
+        }
+        snprintf(path, sizeof(path), "%s/src/%d/%d", work, i / BENCH_FILES_PER_DIR, i);
+        if (write_file(path, size)) {
+            fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        tree_bytes += size;
+    }
+    tree_files = count;
+    return 0;
+}
+
+// The first 40% of the image is data, the rest never written, like a
+// partition that isn't full.
+static int make_image(uint64_t size) {
+    static char buf[1024 * 1024];
+    char path[PATH_MAX];
+    uint64_t used = size / 10 * 4;
+    uint64_t done;
+    size_t i;
+
+    snprintf(path, sizeof(path), "%s/src.img", work);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    for (done = 0; done < used; done += sizeof(buf)) {
+        for (i = 0; i < sizeof(buf); i += 4) {
+            uint32_t v = rng();
+            memcpy(buf + i, &v, 4);
+        }
+        if (write(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+            close(fd);
+            return -1;
+        }
+    }
+    // written out as zeros rather than left as a hole, a real partition
+    // has to be read in full
+    memset(buf, 0, sizeof(buf));
+    for (; done < size; done += sizeof(buf)) {
+        if (write(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+            close(fd);
+            return -1;
+        }
+    }
+    image_bytes = size;
+    return close(fd);
+}
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    return remove(path);
+}
+
+static void remove_tree(const char* path) {
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static uint64_t du_bytes;
+
+static int du_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    if (type == FTW_F)
+        du_bytes += st->st_blocks * 512;
+    return 0;
+}
+
+// space actually used, so holes in raw images don't count
+static uint64_t disk_usage(const char* path) {
+    du_bytes = 0;
+    nftw(path, du_entry, 16, FTW_PHYS);
+    return du_bytes;
+}
+
+static void read_io_counts(struct bench_result* r) {
+    char line[128];
+    unsigned long long v;
+    FILE* f = fopen("/proc/self/io", "r");
+    if (f == NULL)
+        return;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "syscr: %llu", &v) == 1)
+            r->read_calls = v;
+        else if (sscanf(line, "syscw: %llu", &v) == 1)
+            r->write_calls = v;
+    }
+    fclose(f);
+}
+
+static int run_backup(int format) {
+    char src[PATH_MAX];
+    char out[PATH_MAX];
+
+    snprintf(out, sizeof(out), "%s/backup", work);
+    mkdir(out, 0755);
+    if (format == BENCH_RAW) {
+        snprintf(src, sizeof(src), "%s/src.img", work);
+        snprintf(out, sizeof(out), "%s/backup/src.img", work);
+        return mmc_raw_dump_internal(src, out);
+    }
+    snprintf(src, sizeof(src), "%s/src", work);
+    if (format == BENCH_DUP) {
+        char blobs[PATH_MAX];
+        snprintf(blobs, sizeof(blobs), "%s/backup/blobs", work);
+        snprintf(out, sizeof(out), "%s/backup/src.dup", work);
+        char* argv[] = { "dedupe", "c", src, blobs, out, NULL };
+        return dedupe_main(5, argv);
+    }
+
+    archive_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.compression = format_compression[format];
+    opts.threads = threads;
+    opts.split_size = ARCHIVE_DEFAULT_SPLIT_SIZE;
+    // nandroid hashes every segment as it's written
+    opts.digest = EVP_md5();
+    snprintf(out, sizeof(out), "%s/backup/src.tar", work);
+    return archive_create(src, out, &opts);
+}
+
+static int run_restore(int format) {
+    char in[PATH_MAX];
+    char dest[PATH_MAX];
+
+    snprintf(dest, sizeof(dest), "%s/restore", work);
+    mkdir(dest, 0755);
+    if (format == BENCH_RAW) {
+        snprintf(in, sizeof(in), "%s/backup/src.img", work);
+        snprintf(dest, sizeof(dest), "%s/restore/src.img", work);
+        return mmc_raw_dump_internal(in, dest);
+    }
+    if (format == BENCH_DUP) {
+        char blobs[PATH_MAX];
+        snprintf(in, sizeof(in), "%s/backup/src.dup", work);
+        snprintf(blobs, sizeof(blobs), "%s/backup/blobs", work);
+        snprintf(dest, sizeof(dest), "%s/restore/src", work);
+        char* argv[] = { "dedupe", "x", in, blobs, dest, NULL };
+        return dedupe_main(5, argv);
+    }
+
+    archive_options opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.compression = format_compression[format];
+    opts.threads = threads;
+    snprintf(in, sizeof(in), "%s/backup/src.tar", work);
+    return archive_extract(in, dest, &opts);
+}
+
+static void drop_page_cache(void) {
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd < 0 || write(fd, "3", 1) != 1)
+        fprintf(stderr, "Unable to drop caches: %s\n", strerror(errno));
+    if (fd >= 0)
+        close(fd);
+}
+
+static int measure(int format, int restore, struct bench_result* r) {
+    int fds[2];
+    int status;
+
+    sync();
+    if (drop_caches)
+        drop_page_cache();
+    if (pipe(fds))
+        return -1;
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        struct bench_result child;
+        struct rusage ru;
+        close(fds[0]);
+        // dedupe lists every file it handles
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            close(null);
+        }
+        memset(&child, 0, sizeof(child));
+        double start = now();
+        child.ret = restore ? run_restore(format) : run_backup(format);
+        sync();
+        child.seconds = now() - start;
+        // covers the worker threads as well
+        getrusage(RUSAGE_SELF, &ru);
+        child.peak_rss_kb = ru.ru_maxrss;
+        child.context_switches = ru.ru_nvcsw + ru.ru_nivcsw;
+        read_io_counts(&child);
+        write(fds[1], &child, sizeof(child));
+        _exit(0);
+    }
+    close(fds[1]);
+    ssize_t n = read(fds[0], r, sizeof(*r));
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+    return n == (ssize_t)sizeof(*r) ? 0 : -1;
+}
+
+static void print_result(const char* name, const char* op, const struct bench_result* r, uint64_t bytes,
+                         uint64_t files, uint64_t output) {
+    char fps[16] = "-";
+    if (files > 0)
+        snprintf(fps, sizeof(fps), "%.0f", files / r->seconds);
+    printf("%-4s %-7s %8.3fs %9.1f %9s %8.1f %10llu %10llu %8ld %9.1f\n", name, op, r->seconds,
+           bytes / 1048576.0 / r->seconds, fps, r->peak_rss_kb / 1024.0,
+           (unsigned long long)r->read_calls, (unsigned long long)r->write_calls, r->context_switches,
+           output / 1048576.0);
+}
+
+// Returns 0 if the restore brought back as many files and bytes as the
+// source has.
+static int verify_restore(int format) {
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (format == BENCH_RAW) {
+        snprintf(path, sizeof(path), "%s/restore/src.img", work);
+        return stat(path, &st) == 0 && (uint64_t)st.st_size == image_bytes ? 0 : -1;
+    }
+    archive_options opts;
+    archive_stats stats;
+    memset(&opts, 0, sizeof(opts));
+    memset(&stats, 0, sizeof(stats));
+    snprintf(path, sizeof(path), "%s/restore/src", work);
+    archive_measure(path, &opts, &stats);
+    // entries count the directories too
+    return stats.bytes == tree_bytes && stats.entries == tree_files + 1 +
+           (tree_files + BENCH_FILES_PER_DIR - 1) / BENCH_FILES_PER_DIR ? 0 : -1;
+}
+
+static int bench_format(int format) {
+    struct bench_result r;
+    char path[PATH_MAX];
+    const char* name = format_names[format];
+    int raw = format == BENCH_RAW;
+    uint64_t bytes = raw ? image_bytes : tree_bytes;
+    uint64_t files = raw ? 0 : tree_files;
+    int ret = 0;
+
+    snprintf(path, sizeof(path), "%s/backup", work);
+    if (measure(format, 0, &r) || r.ret) {
+        printf("%-4s backup  failed\n", name);
+        remove_tree(path);
+        return -1;
+    }
+    print_result(name, "backup", &r, bytes, files, disk_usage(path));
+
+    if (measure(format, 1, &r) || r.ret) {
+        printf("%-4s restore failed\n", name);
+        ret = -1;
+    } else {
+        snprintf(path, sizeof(path), "%s/restore", work);
+        print_result(name, "restore", &r, bytes, files, disk_usage(path));
+        if (verify_restore(format)) {
+            printf("%-4s restore doesn't match the source\n", name);
+            ret = -1;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/restore", work);
+    remove_tree(path);
+    snprintf(path, sizeof(path), "%s/backup", work);
+    remove_tree(path);
+    return ret;
+}
+
+static void usage(char** argv) {
+    fprintf(stderr, "usage: %s [-n file_count] [-d small|mixed|large] [-m max_file_kb] [-i image_mb]\n"
+                    "       [-t threads] [-D] work_dir [tar|tgz|zst|lz4|dup|raw...]\n", argv[0]);
+}
+
+int main(int argc, char** argv) {
+    int count = 5000;
+    const char* dist = "mixed";
+    size_t max = 2048 * 1024;
+    uint64_t image = 256ULL * 1024 * 1024;
+    int selected[BENCH_FORMAT_COUNT];
+    char path[PATH_MAX];
+    int failed = 0;
+    int opt;
+    int i;
+    int f;
+
+    while ((opt = getopt(argc, argv, "n:d:m:i:t:D")) != -1) {
+        switch (opt) {
+            case 'n': count = atoi(optarg); break;
+            case 'd': dist = optarg; break;
+            case 'm': max = (size_t)atoi(optarg) * 1024; break;
+            case 'i': image = strtoull(optarg, NULL, 10) * 1024 * 1024; break;
+            case 't': threads = atoi(optarg); break;
+            case 'D': drop_caches = 1; break;
+            default:
+                usage(argv);
+                return 1;
+        }
+    }
+    if (optind >= argc || count <= 0 || max == 0) {
+        usage(argv);
+        return 1;
+    }
+    work = argv[optind++];
+
+    memset(selected, 0, sizeof(selected));
+    for (i = optind; i < argc; i++) {
+        for (f = 0; f < BENCH_FORMAT_COUNT; f++) {
+            if (strcmp(argv[i], format_names[f]) == 0)
+                break;
+        }
+        if (f == BENCH_FORMAT_COUNT) {
+            usage(argv);
+            return 1;
+        }
+        selected[f] = 1;
+    }
+    if (optind == argc) {
+        for (f = 0; f < BENCH_FORMAT_COUNT; f++)
+            selected[f] = 1;
+    }
+    for (f = 0; f < BENCH_FORMAT_COUNT; f++) {
+        if (selected[f] && format_compression[f] >= 0 && !archive_compression_supported(format_compression[f])) {
+            if (optind < argc)
+                fprintf(stderr, "%s is not supported by this build\n", format_names[f]);
+            selected[f] = 0;
+        }
+    }
+
+    mkdir(work, 0755);
+    snprintf(path, sizeof(path), "%s/restore", work);
+    remove_tree(path);
+    snprintf(path, sizeof(path), "%s/backup", work);
+    remove_tree(path);
+    if (make_tree(count, dist, max))
+        return 1;
+    if (selected[BENCH_RAW] && make_image(image)) {
+        fprintf(stderr, "Unable to write the image: %s\n", strerror(errno));
+        return 1;
+    }
+    sync();
+    printf("%llu files, %llu bytes (%s), %llu byte image\n", (unsigned long long)tree_files,
+           (unsigned long long)tree_bytes, dist, (unsigned long long)image_bytes);
+    printf("%-4s %-7s %9s %9s %9s %8s %10s %10s %8s %9s\n", "fmt", "op", "time", "MB/s", "files/s",
+           "rss MB", "read calls", "writecalls", "ctxsw", "output MB");
+
+    for (f = 0; f < BENCH_FORMAT_COUNT; f++) {
+        if (selected[f] && bench_format(f))
+            failed = 1;
+    }
+
+    snprintf(path, sizeof(path), "%s/src", work);
+    remove_tree(path);
+    snprintf(path, sizeof(path), "%s/src.img", work);
+    unlink(path);
+    return failed;
+}
@@ -0,0 +1,544 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef USE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "nandroid_archive.h"
+#include "nandroid_compress.h"
+
+#define GZIP_DICT_SIZE 32768
+#define GZIP_DEFAULT_LEVEL 6
+// worst case for one incompressible block plus the flush marker
+#define GZIP_OUT_SIZE (GZIP_BLOCK_SIZE + (GZIP_BLOCK_SIZE >> 8) + 64)
+
+enum {
+    SLOT_FREE = 0,
+    SLOT_FILLED,
+    SLOT_DONE,
+};
+
+struct gzip_slot {
+    int state;
+    int last;
+    unsigned char* in;
+    size_t in_len;
+    unsigned char dict[GZIP_DICT_SIZE];
+    size_t dict_len;
+    unsigned char* out;
+    size_t out_len;
+    uLong crc;
+};
+
+struct gzip_sink {
+    archive_sink base;
+    archive_sink* out;
+    int level;
+    archive_counters* counters;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t* workers;
+    int nworkers;
+    pthread_t writer;
+
+    struct gzip_slot* slots;
+    int nslots;
+    long submitted;     // slots handed to the workers
+    long next_compress; // next slot a worker should pick up
+    long next_write;    // next slot the writer thread waits for
+    int finishing;
+    int error;
+
+    // block being filled by the producer
+    struct gzip_slot* cur;
+    // tail of the previous block, used as dictionary for the next one
+    unsigned char dict[GZIP_DICT_SIZE];
+    size_t dict_len;
+
+    uLong crc;
+    uint64_t total_in;
+};
+
+int archive_online_cpus() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+uint64_t archive_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void archive_count(uint64_t* counter, uint64_t value) {
+    __sync_fetch_and_add(counter, value);
+}
+
+static int deflate_slot(z_stream* strm, struct gzip_slot* slot) {
+    int ret;
+    deflateReset(strm);
+    if (slot->dict_len > 0)
+        deflateSetDictionary(strm, slot->dict, slot->dict_len);
+
+    strm->next_in = slot->in;
+    strm->avail_in = slot->in_len;
+    strm->next_out = slot->out;
+    strm->avail_out = GZIP_OUT_SIZE;
+    // Non-final blocks end on a byte boundary so they can be concatenated.
+    ret = deflate(strm, slot->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (ret != Z_STREAM_END && ret != Z_OK)
+        return -1;
+    if (strm->avail_in != 0 || strm->avail_out == 0)
+        return -1;
+    slot->out_len = strm->next_out - slot->out;
+    slot->crc = crc32(0L, slot->in, slot->in_len);
+    return 0;
+}
+
+static void* gzip_worker(void* cookie) {
+    struct gzip_sink* gz = (struct gzip_sink*)cookie;
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, gz->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        pthread_mutex_lock(&gz->lock);
+        gz->error = 1;
+        pthread_cond_broadcast(&gz->cond);
+        pthread_mutex_unlock(&gz->lock);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&gz->lock);
+    for (;;) {
+        while (gz->next_compress == gz->submitted && !gz->finishing && !gz->error)
+            pthread_cond_wait(&gz->cond, &gz->lock);
+        if (gz->error || gz->next_compress == gz->submitted)
+            break;
+        struct gzip_slot* slot = &gz->slots[gz->next_compress % gz->nslots];
+        gz->next_compress++;
+        pthread_mutex_unlock(&gz->lock);
+
+        uint64_t start = archive_usec();
+        int ret = deflate_slot(&strm, slot);
+        archive_count(&gz->counters->compress_usec, archive_usec() - start);
+
+        pthread_mutex_lock(&gz->lock);
+        if (ret != 0) {
+            fprintf(stderr, "gzip: deflate failed\n");
+            gz->error = 1;
+        }
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&gz->cond);
+    }
+    pthread_mutex_unlock(&gz->lock);
+
+    deflateEnd(&strm);
+    return NULL;
+}
+
+// Writes finished blocks in submission order so the output is one valid
+// deflate stream regardless of which worker finished first.
+static void* gzip_writer(void* cookie) {
+    struct gzip_sink* gz = (struct gzip_sink*)cookie;
+
+    pthread_mutex_lock(&gz->lock);
+    for (;;) {
+        struct gzip_slot* slot = &gz->slots[gz->next_write % gz->nslots];
+        while (!gz->error && !(gz->next_write < gz->submitted && slot->state == SLOT_DONE) &&
+                !(gz->finishing && gz->next_write == gz->submitted))
+            pthread_cond_wait(&gz->cond, &gz->lock);
+        if (gz->error || gz->next_write == gz->submitted)
+            break;
+        pthread_mutex_unlock(&gz->lock);
+
+        int ret = gz->out->write(gz->out, slot->out, slot->out_len);
+
+        pthread_mutex_lock(&gz->lock);
+        if (ret != 0)
+            gz->error = 1;
+        gz->crc = crc32_combine(gz->crc, slot->crc, slot->in_len);
+        slot->state = SLOT_FREE;
+        gz->next_write++;
+        pthread_cond_broadcast(&gz->cond);
+    }
+    pthread_mutex_unlock(&gz->lock);
+    return NULL;
+}
+
+// Waits for the next slot to become free and makes it the current block.
+static struct gzip_slot* gzip_acquire_slot(struct gzip_sink* gz) {
+    struct gzip_slot* slot;
+    pthread_mutex_lock(&gz->lock);
+    slot = &gz->slots[gz->submitted % gz->nslots];
+    while (slot->state != SLOT_FREE && !gz->error)
+        pthread_cond_wait(&gz->cond, &gz->lock);
+    pthread_mutex_unlock(&gz->lock);
+    if (gz->error)
+        return NULL;
+
+    slot->in_len = 0;
+    slot->last = 0;
+    memcpy(slot->dict, gz->dict, gz->dict_len);
+    slot->dict_len = gz->dict_len;
+    return slot;
+}
+
+static void gzip_submit_slot(struct gzip_sink* gz, struct gzip_slot* slot, int last) {
+    // remember the tail of this block as dictionary for the next one
+    if (slot->in_len >= GZIP_DICT_SIZE) {
+        memcpy(gz->dict, slot->in + slot->in_len - GZIP_DICT_SIZE, GZIP_DICT_SIZE);
+        gz->dict_len = GZIP_DICT_SIZE;
+    } else {
+        size_t keep = GZIP_DICT_SIZE - slot->in_len;
+        if (keep > gz->dict_len)
+            keep = gz->dict_len;
+        memmove(gz->dict, gz->dict + gz->dict_len - keep, keep);
+        memcpy(gz->dict + keep, slot->in, slot->in_len);
+        gz->dict_len = keep + slot->in_len;
+    }
+
+    pthread_mutex_lock(&gz->lock);
+    slot->last = last;
+    slot->state = SLOT_FILLED;
+    gz->submitted++;
+    pthread_cond_broadcast(&gz->cond);
+    pthread_mutex_unlock(&gz->lock);
+}
+
+static int gzip_write(archive_sink* sink, const void* data, size_t len) {
+    struct gzip_sink* gz = (struct gzip_sink*)sink;
+    const unsigned char* p = (const unsigned char*)data;
+
+    gz->total_in += len;
+    while (len > 0) {
+        // A full block is only submitted once more data arrives, so that the
+        // block still pending at close time can be flagged as the last one.
+        if (gz->cur != NULL && gz->cur->in_len == GZIP_BLOCK_SIZE) {
+            gzip_submit_slot(gz, gz->cur, 0);
+            gz->cur = NULL;
+        }
+        if (gz->cur == NULL && (gz->cur = gzip_acquire_slot(gz)) == NULL)
+            return -1;
+
+        size_t n = GZIP_BLOCK_SIZE - gz->cur->in_len;
+        if (n > len)
+            n = len;
+        memcpy(gz->cur->in + gz->cur->in_len, p, n);
+        gz->cur->in_len += n;
+        p += n;
+        len -= n;
+    }
+
+    return gz->error ? -1 : 0;
+}
+
+static void put_le32(unsigned char* p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static void gzip_free(struct gzip_sink* gz) {
+    int i;
+    if (gz->slots != NULL) {
+        for (i = 0; i < gz->nslots; i++) {
+            free(gz->slots[i].in);
+            free(gz->slots[i].out);
+        }
+        free(gz->slots);
+    }
+    free(gz->workers);
+    pthread_mutex_destroy(&gz->lock);
+    pthread_cond_destroy(&gz->cond);
+    free(gz);
+}
+
+static int gzip_close(archive_sink* sink) {
+    struct gzip_sink* gz = (struct gzip_sink*)sink;
+    int i;
+    int ret = 0;
+
+    if (gz->cur == NULL)
+        gz->cur = gzip_acquire_slot(gz);
+    if (gz->cur != NULL)
+        gzip_submit_slot(gz, gz->cur, 1);
+
+    pthread_mutex_lock(&gz->lock);
+    gz->finishing = 1;
+    pthread_cond_broadcast(&gz->cond);
+    pthread_mutex_unlock(&gz->lock);
+
+    for (i = 0; i < gz->nworkers; i++)
+        pthread_join(gz->workers[i], NULL);
+    pthread_join(gz->writer, NULL);
+
+    if (!gz->error) {
+        unsigned char trailer[8];
+        put_le32(trailer, gz->crc);
+        put_le32(trailer + 4, (uint32_t)gz->total_in);
+        if (gz->out->write(gz->out, trailer, sizeof(trailer)) != 0)
+            gz->error = 1;
+    }
+
+    ret = gz->error ? -1 : 0;
+    if (gz->out->close(gz->out) != 0)
+        ret = -1;
+    gzip_free(gz);
+    return ret;
+}
+
+archive_sink* gzip_sink_open(archive_sink* out, int level, int threads, archive_counters* counters) {
+    int i;
+    struct gzip_sink* gz = (struct gzip_sink*)calloc(1, sizeof(struct gzip_sink));
+    if (gz == NULL)
+        return NULL;
+
+    gz->base.write = gzip_write;
+    gz->base.close = gzip_close;
+    gz->out = out;
+    gz->level = level > 0 ? level : GZIP_DEFAULT_LEVEL;
+    gz->counters = counters;
+    gz->nworkers = threads > 0 ? threads : archive_online_cpus();
+    // two blocks per worker keeps everybody busy while the writer drains
+    gz->nslots = gz->nworkers * 2;
+    gz->crc = crc32(0L, Z_NULL, 0);
+    pthread_mutex_init(&gz->lock, NULL);
+    pthread_cond_init(&gz->cond, NULL);
+
+    gz->slots = (struct gzip_slot*)calloc(gz->nslots, sizeof(struct gzip_slot));
+    gz->workers = (pthread_t*)calloc(gz->nworkers, sizeof(pthread_t));
+    if (gz->slots == NULL || gz->workers == NULL)
+        goto error;
+    for (i = 0; i < gz->nslots; i++) {
+        gz->slots[i].in = (unsigned char*)malloc(GZIP_BLOCK_SIZE);
+        gz->slots[i].out = (unsigned char*)malloc(GZIP_OUT_SIZE);
+        if (gz->slots[i].in == NULL || gz->slots[i].out == NULL)
+            goto error;
+    }
+
+    // gzip header: deflate, no name, unix
+    unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    put_le32(header + 4, (uint32_t)time(NULL));
+    if (out->write(out, header, sizeof(header)) != 0)
+        goto error;
+
+    for (i = 0; i < gz->nworkers; i++) {
+        if (pthread_create(&gz->workers[i], NULL, gzip_worker, gz) != 0)
+            break;
+    }
+    if (i == 0 || pthread_create(&gz->writer, NULL, gzip_writer, gz) != 0) {
+        pthread_mutex_lock(&gz->lock);
+        gz->error = 1;
+        pthread_cond_broadcast(&gz->cond);
+        pthread_mutex_unlock(&gz->lock);
+        gz->nworkers = i;
+        for (i = 0; i < gz->nworkers; i++)
+            pthread_join(gz->workers[i], NULL);
+        goto error;
+    }
+    gz->nworkers = i;
+
+    return &gz->base;
+
+error:
+    fprintf(stderr, "gzip: unable to start compressor\n");
+    gzip_free(gz);
+    return NULL;
+}
+
+#ifdef USE_ZSTD
+/*
+ * zstd sink
+ */
+
+// zstd's own default, already faster and smaller than gzip -6
+#define ZSTD_DEFAULT_LEVEL 3
+
+struct zstd_sink {
+    archive_sink base;
+    archive_sink* out;
+    ZSTD_CCtx* cctx;
+    unsigned char* buf;
+    size_t buf_size;
+    archive_counters* counters;
+};
+
+// Feeds |data| to the compressor with |mode| and writes whatever comes out.
+static int zstd_feed(struct zstd_sink* zs, const void* data, size_t len, ZSTD_EndDirective mode) {
+    ZSTD_inBuffer in = { data, len, 0 };
+    size_t remaining;
+    do {
+        ZSTD_outBuffer out = { zs->buf, zs->buf_size, 0 };
+        uint64_t start = archive_usec();
+        remaining = ZSTD_compressStream2(zs->cctx, &out, &in, mode);
+        archive_count(&zs->counters->compress_usec, archive_usec() - start);
+        if (ZSTD_isError(remaining)) {
+            fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(remaining));
+            return -1;
+        }
+        if (out.pos > 0 && zs->out->write(zs->out, zs->buf, out.pos) != 0)
+            return -1;
+    } while (mode == ZSTD_e_end ? remaining != 0 : in.pos < in.size);
+    return 0;
+}
+
+static int zstd_write(archive_sink* sink, const void* data, size_t len) {
+    return zstd_feed((struct zstd_sink*)sink, data, len, ZSTD_e_continue);
+}
+
+static int zstd_close(archive_sink* sink) {
+    struct zstd_sink* zs = (struct zstd_sink*)sink;
+    int ret = zstd_feed(zs, NULL, 0, ZSTD_e_end);
+    if (zs->out->close(zs->out) != 0)
+        ret = -1;
+    ZSTD_freeCCtx(zs->cctx);
+    free(zs->buf);
+    free(zs);
+    return ret;
+}
+
+archive_sink* zstd_sink_open(archive_sink* out, int level, int threads, archive_counters* counters) {
+    struct zstd_sink* zs = (struct zstd_sink*)calloc(1, sizeof(struct zstd_sink));
+    if (zs == NULL)
+        return NULL;
+    zs->base.write = zstd_write;
+    zs->base.close = zstd_close;
+    zs->out = out;
+    zs->counters = counters;
+    zs->buf_size = ZSTD_CStreamOutSize();
+    zs->buf = (unsigned char*)malloc(zs->buf_size);
+    zs->cctx = ZSTD_createCCtx();
+    if (zs->buf == NULL || zs->cctx == NULL ||
+            ZSTD_isError(ZSTD_CCtx_setParameter(zs->cctx, ZSTD_c_compressionLevel,
+                                                level > 0 ? level : ZSTD_DEFAULT_LEVEL))) {
+        fprintf(stderr, "zstd: unable to start compressor\n");
+        ZSTD_freeCCtx(zs->cctx);
+        free(zs->buf);
+        free(zs);
+        return NULL;
+    }
+    // fails on a libzstd built without ZSTD_MULTITHREAD, which then
+    // compresses on the calling thread
+    ZSTD_CCtx_setParameter(zs->cctx, ZSTD_c_nbWorkers, threads > 0 ? threads : archive_online_cpus());
+    return &zs->base;
+}
+#endif
+
+#ifdef USE_LZ4
+/*
+ * lz4 sink
+ */
+
+// input handed to LZ4F_compressUpdate() at once, bounds the output buffer
+#define LZ4_CHUNK_SIZE (256 * 1024)
+
+struct lz4_sink {
+    archive_sink base;
+    archive_sink* out;
+    LZ4F_cctx* cctx;
+    unsigned char* buf;
+    size_t buf_size;
+    archive_counters* counters;
+};
+
+static int lz4_check(size_t ret) {
+    if (LZ4F_isError(ret)) {
+        fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(ret));
+        return -1;
+    }
+    return 0;
+}
+
+static int lz4_write(archive_sink* sink, const void* data, size_t len) {
+    struct lz4_sink* ls = (struct lz4_sink*)sink;
+    const unsigned char* p = (const unsigned char*)data;
+    while (len > 0) {
+        size_t n = len < LZ4_CHUNK_SIZE ? len : LZ4_CHUNK_SIZE;
+        uint64_t start = archive_usec();
+        size_t produced = LZ4F_compressUpdate(ls->cctx, ls->buf, ls->buf_size, p, n, NULL);
+        archive_count(&ls->counters->compress_usec, archive_usec() - start);
+        if (lz4_check(produced) != 0)
+            return -1;
+        if (produced > 0 && ls->out->write(ls->out, ls->buf, produced) != 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int lz4_close(archive_sink* sink) {
+    struct lz4_sink* ls = (struct lz4_sink*)sink;
+    uint64_t start = archive_usec();
+    size_t produced = LZ4F_compressEnd(ls->cctx, ls->buf, ls->buf_size, NULL);
+    archive_count(&ls->counters->compress_usec, archive_usec() - start);
+    int ret = lz4_check(produced);
+    if (ret == 0 && ls->out->write(ls->out, ls->buf, produced) != 0)
+        ret = -1;
+    if (ls->out->close(ls->out) != 0)
+        ret = -1;
+    LZ4F_freeCompressionContext(ls->cctx);
+    free(ls->buf);
+    free(ls);
+    return ret;
+}
+
+archive_sink* lz4_sink_open(archive_sink* out, int level, archive_counters* counters) {
+    LZ4F_preferences_t prefs;
+    struct lz4_sink* ls = (struct lz4_sink*)calloc(1, sizeof(struct lz4_sink));
+    if (ls == NULL)
+        return NULL;
+    ls->base.write = lz4_write;
+    ls->base.close = lz4_close;
+    ls->out = out;
+    ls->counters = counters;
+
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.compressionLevel = level;
+    prefs.frameInfo.blockSizeID = LZ4F_max1MB;
+    prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+    ls->buf_size = LZ4F_compressBound(LZ4_CHUNK_SIZE, &prefs);
+    if (ls->buf_size < LZ4F_HEADER_SIZE_MAX)
+        ls->buf_size = LZ4F_HEADER_SIZE_MAX;
+    ls->buf = (unsigned char*)malloc(ls->buf_size);
+    if (ls->buf == NULL || LZ4F_isError(LZ4F_createCompressionContext(&ls->cctx, LZ4F_VERSION)))
+        goto error;
+    size_t produced = LZ4F_compressBegin(ls->cctx, ls->buf, ls->buf_size, &prefs);
+    if (lz4_check(produced) != 0 || out->write(out, ls->buf, produced) != 0)
+        goto error;
+    return &ls->base;
+
+error:
+    fprintf(stderr, "lz4: unable to start compressor\n");
+    if (ls->cctx != NULL)
+        LZ4F_freeCompressionContext(ls->cctx);
+    free(ls->buf);
+    free(ls);
+    return NULL;
+}
+#endif
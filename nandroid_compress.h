@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NANDROID_COMPRESS_H
+#define _NANDROID_COMPRESS_H
+
+#include "nandroid_archive.h"
+
+// Input is cut into blocks of this size and each block is deflated on its own
+// worker thread, primed with the previous 32k as dictionary (the pigz scheme).
+#define GZIP_BLOCK_SIZE (128 * 1024)
+
+// Number of online cores, used to size the compression worker pools.
+int archive_online_cpus();
+
+// Monotonic clock in microseconds, for the archive_counters timings.
+uint64_t archive_usec();
+
+// Adds |value| to one of the archive_counters fields; the stages of one
+// archive run on several threads.
+void archive_count(uint64_t* counter, uint64_t value);
+
+// Returns a sink that gzip compresses everything written to it into |out|
+// using |threads| workers (0 = one per online core). Closing the returned
+// sink also closes |out|. The output is a single gzip member and can be
+// read by gzip, pigz and busybox. Time spent compressing is added to
+// |counters|->compress_usec, summed over the workers.
+archive_sink* gzip_sink_open(archive_sink* out, int level, int threads, archive_counters* counters);
+
+#ifdef USE_ZSTD
+// A single zstd frame, compressed by |threads| libzstd workers (0 = one per
+// online core) when libzstd was built with ZSTD_MULTITHREAD.
+archive_sink* zstd_sink_open(archive_sink* out, int level, int threads, archive_counters* counters);
+#endif
+
+#ifdef USE_LZ4
+// A single lz4 frame with a content checksum, readable by "lz4 -d". lz4
+// outruns the storage on one core, so there are no workers.
+archive_sink* lz4_sink_open(archive_sink* out, int level, archive_counters* counters);
+#endif
+
+#endif
@@ -0,0 +1,1317 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef USE_LZ4
+#include <lz4frame.h>
+#endif
+
+// strlcpy() where the host libc has none
+#include "cutils/memory.h"
+#include "nandroid_archive.h"
+#include "nandroid_compress.h"
+
+#define TAR_BLOCK_SIZE 512
+// longest long name or pax header read into memory
+#define TAR_PAX_MAX (4 * PATH_MAX)
+// segments are read and decoded in blocks of this size
+#define EXTRACT_BLOCK_SIZE (1024 * 1024)
+// blocks in flight between the reader, the decoder and the tar parser
+#define EXTRACT_QUEUE_BLOCKS 8
+// head of the next segment that is read ahead while the current one is
+// being read
+#define EXTRACT_SEGMENT_READAHEAD (4 * 1024 * 1024)
+// Files up to this size are buffered and written by the worker pool, larger
+// ones are streamed to disk by the parser itself.
+#define EXTRACT_ASYNC_MAX (1024 * 1024)
+// file data buffered for the workers at most
+#define EXTRACT_ASYNC_BYTES (16 * 1024 * 1024)
+// files at least this large get their blocks allocated up front
+#define EXTRACT_PREALLOC_MIN (64 * 1024)
+#define EXTRACT_PROGRESS_INTERVAL (4 * 1024 * 1024)
+// flash storage stops scaling long before the cores run out
+#define MAX_EXTRACT_THREADS 4
+
+/*
+ * block queue
+ */
+
+struct block {
+    unsigned char* data;
+    size_t len;
+    uint64_t consumed; // archive bytes read once this block is done
+};
+
+// Bounded FIFO between two threads. The producer closes it at the end of its
+// input; either side closes it with |error| set to make the other bail out.
+struct block_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct block blocks[EXTRACT_QUEUE_BLOCKS];
+    int head;
+    int count;
+    int closed;
+    int error;
+};
+
+static void queue_init(struct block_queue* q) {
+    memset(q, 0, sizeof(*q));
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+}
+
+static void queue_destroy(struct block_queue* q) {
+    while (q->count > 0) {
+        free(q->blocks[q->head].data);
+        q->head = (q->head + 1) % EXTRACT_QUEUE_BLOCKS;
+        q->count--;
+    }
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->cond);
+}
+
+// Takes ownership of |data|. Returns -1 if the consumer gave up.
+static int queue_push(struct block_queue* q, unsigned char* data, size_t len, uint64_t consumed) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == EXTRACT_QUEUE_BLOCKS && !q->error)
+        pthread_cond_wait(&q->cond, &q->lock);
+    if (q->error) {
+        pthread_mutex_unlock(&q->lock);
+        free(data);
+        return -1;
+    }
+    struct block* b = &q->blocks[(q->head + q->count) % EXTRACT_QUEUE_BLOCKS];
+    b->data = data;
+    b->len = len;
+    b->consumed = consumed;
+    q->count++;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+// Returns 1 with the next block in |b|, 0 at the end and -1 on error.
+static int queue_pop(struct block_queue* q, struct block* b) {
+    int ret;
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed && !q->error)
+        pthread_cond_wait(&q->cond, &q->lock);
+    if (q->error) {
+        ret = -1;
+    } else if (q->count == 0) {
+        ret = 0;
+    } else {
+        *b = q->blocks[q->head];
+        q->head = (q->head + 1) % EXTRACT_QUEUE_BLOCKS;
+        q->count--;
+        pthread_cond_broadcast(&q->cond);
+        ret = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+static void queue_close(struct block_queue* q, int error) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    if (error)
+        q->error = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * segment reader and decoders
+ */
+
+struct segment_reader {
+    const char* prefix;   // unless reading from |source|
+    archive_source* source;
+    struct block_queue* out;
+    archive_counters* counters;
+};
+
+// Opens segment |index| of |prefix|, or |prefix| itself for -1.
+static int open_segment(const char* prefix, int index, char* path, size_t size) {
+    if (index < 0)
+        strlcpy(path, prefix, size);
+    else
+        archive_segment_path(path, size, prefix, index);
+    int fd = open(path, O_RDONLY);
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fd, 0, EXTRACT_SEGMENT_READAHEAD, POSIX_FADV_WILLNEED);
+    }
+#endif
+    return fd;
+}
+
+// Reads |prefix| itself (empty for split backups) and then |prefix|.a,
+// |prefix|.b... the way "cat prefix*" did, staying up to a queue ahead of
+// the parser. The next segment is opened and its head read ahead as soon as
+// the current one is, so the switch between them doesn't stall the restore.
+static void* reader_thread(void* cookie) {
+    struct segment_reader* r = (struct segment_reader*)cookie;
+    char path[PATH_MAX];
+    char next_path[PATH_MAX];
+    uint64_t consumed = 0;
+    int found = 0;
+    int index;
+    int fd;
+    int next_fd = open_segment(r->prefix, -1, next_path, sizeof(next_path));
+
+    for (index = -1; ; index++) {
+        fd = next_fd;
+        strlcpy(path, next_path, sizeof(path));
+        next_fd = open_segment(r->prefix, index + 1, next_path, sizeof(next_path));
+        if (fd < 0) {
+            if (index < 0)
+                continue;
+            break;
+        }
+        found = 1;
+        for (;;) {
+            unsigned char* data = (unsigned char*)malloc(EXTRACT_BLOCK_SIZE);
+            size_t len = 0;
+            ssize_t n = 0;
+            if (data == NULL) {
+                close(fd);
+                goto error;
+            }
+            uint64_t start = archive_usec();
+            while (len < EXTRACT_BLOCK_SIZE) {
+                n = read(fd, data + len, EXTRACT_BLOCK_SIZE - len);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    break;
+                len += n;
+            }
+            archive_count(&r->counters->read_usec, archive_usec() - start);
+            archive_count(&r->counters->bytes_in, len);
+            if (n < 0) {
+                fprintf(stderr, "Error reading %s: %s\n", path, strerror(errno));
+                free(data);
+                close(fd);
+                goto error;
+            }
+            consumed += len;
+            if (len == 0) {
+                free(data);
+            } else if (queue_push(r->out, data, len, consumed) != 0) {
+                close(fd);
+                if (next_fd >= 0)
+                    close(next_fd);
+                return NULL;
+            }
+            if (len < EXTRACT_BLOCK_SIZE)
+                break;
+        }
+        close(fd);
+    }
+
+    if (next_fd >= 0)
+        close(next_fd);
+    if (!found)
+        fprintf(stderr, "Unable to open %s\n", r->prefix);
+    queue_close(r->out, !found);
+    return NULL;
+
+error:
+    if (next_fd >= 0)
+        close(next_fd);
+    queue_close(r->out, 1);
+    return NULL;
+}
+
+// Queues everything r->source yields.
+static void* source_thread(void* cookie) {
+    struct segment_reader* r = (struct segment_reader*)cookie;
+    uint64_t consumed = 0;
+    ssize_t n = 0;
+
+    do {
+        unsigned char* data = (unsigned char*)malloc(EXTRACT_BLOCK_SIZE);
+        size_t len = 0;
+        if (data == NULL) {
+            queue_close(r->out, 1);
+            return NULL;
+        }
+        // sources like sockets return little at a time, fill the block
+        uint64_t start = archive_usec();
+        while (len < EXTRACT_BLOCK_SIZE && (n = r->source->read(r->source, data + len, EXTRACT_BLOCK_SIZE - len)) > 0)
+            len += n;
+        archive_count(&r->counters->read_usec, archive_usec() - start);
+        archive_count(&r->counters->bytes_in, len);
+        consumed += len;
+        if (len == 0)
+            free(data);
+        else if (queue_push(r->out, data, len, consumed) != 0)
+            return NULL;
+    } while (n > 0);
+
+    if (n < 0)
+        fprintf(stderr, "Error reading archive\n");
+    queue_close(r->out, n < 0);
+    return NULL;
+}
+
+// Output side of a decoder: fills blocks and queues them once full.
+struct block_output {
+    struct block_queue* q;
+    unsigned char* data;
+    size_t len;
+};
+
+// Returns where the next |*room| bytes of output go, or NULL.
+static unsigned char* output_space(struct block_output* o, size_t* room) {
+    if (o->data == NULL) {
+        if ((o->data = (unsigned char*)malloc(EXTRACT_BLOCK_SIZE)) == NULL)
+            return NULL;
+        o->len = 0;
+    }
+    *room = EXTRACT_BLOCK_SIZE - o->len;
+    return o->data + o->len;
+}
+
+// Accounts for |n| bytes written to output_space(), queueing the block once
+// it is full or |flush| is set.
+static int output_commit(struct block_output* o, size_t n, uint64_t consumed, int flush) {
+    o->len += n;
+    if (o->data == NULL || (o->len < EXTRACT_BLOCK_SIZE && !(flush && o->len > 0)))
+        return 0;
+    int ret = queue_push(o->q, o->data, o->len, consumed);
+    o->data = NULL;
+    return ret;
+}
+
+// The decoders below read compressed blocks from |in| until the end of the
+// input and return 0 if it held complete streams. Their time goes to
+// |counters|->compress_usec.
+
+// Concatenated gzip members, as written by "cat a.gz b.gz", are inflated one
+// after the other.
+static int decode_gzip(struct block_queue* in, struct block_output* out, archive_counters* counters) {
+    z_stream z;
+    struct block b;
+    int ended = 0;
+    int failed = 0;
+    int pop;
+
+    memset(&z, 0, sizeof(z));
+    memset(&b, 0, sizeof(b));
+    if (inflateInit2(&z, MAX_WBITS + 16) != Z_OK)
+        return -1;
+    while (!failed && (pop = queue_pop(in, &b)) == 1) {
+        z.next_in = b.data;
+        z.avail_in = b.len;
+        // a full output block may leave more output pending
+        do {
+            size_t room;
+            if (ended && z.avail_in > 0) {
+                inflateReset(&z);
+                ended = 0;
+            }
+            if ((z.next_out = output_space(out, &room)) == NULL) {
+                failed = 1;
+                break;
+            }
+            z.avail_out = room;
+            uint64_t start = archive_usec();
+            int zret = inflate(&z, Z_NO_FLUSH);
+            archive_count(&counters->compress_usec, archive_usec() - start);
+            if (zret == Z_STREAM_END) {
+                ended = 1;
+            } else if (zret != Z_OK && zret != Z_BUF_ERROR) {
+                fprintf(stderr, "gzip: %s\n", z.msg != NULL ? z.msg : "corrupt data");
+                failed = 1;
+                break;
+            }
+            if (output_commit(out, room - z.avail_out, b.consumed, 0) != 0) {
+                failed = 1;
+                break;
+            }
+        } while (z.avail_in > 0 || z.avail_out == 0);
+        free(b.data);
+    }
+    inflateEnd(&z);
+
+    if (failed || pop < 0)
+        return -1;
+    if (!ended) {
+        fprintf(stderr, "gzip: unexpected end of archive\n");
+        return -1;
+    }
+    return output_commit(out, 0, b.consumed, 1);
+}
+
+#ifdef USE_ZSTD
+static int decode_zstd(struct block_queue* in, struct block_output* out, archive_counters* counters) {
+    struct block b;
+    size_t hint = 1;
+    int failed = 0;
+    int pop;
+
+    memset(&b, 0, sizeof(b));
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    if (dctx == NULL)
+        return -1;
+    while (!failed && (pop = queue_pop(in, &b)) == 1) {
+        ZSTD_inBuffer zin = { b.data, b.len, 0 };
+        ZSTD_outBuffer zout;
+        // a full output block may leave more output pending, unless the
+        // frame just ended: another call would wait for the next one
+        do {
+            size_t room;
+            if ((zout.dst = output_space(out, &room)) == NULL) {
+                failed = 1;
+                break;
+            }
+            zout.size = room;
+            zout.pos = 0;
+            // 0 once a frame is complete; the next one starts by itself
+            uint64_t start = archive_usec();
+            hint = ZSTD_decompressStream(dctx, &zout, &zin);
+            archive_count(&counters->compress_usec, archive_usec() - start);
+            if (ZSTD_isError(hint)) {
+                fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(hint));
+                failed = 1;
+                break;
+            }
+            if (output_commit(out, zout.pos, b.consumed, 0) != 0) {
+                failed = 1;
+                break;
+            }
+        } while (zin.pos < zin.size || (zout.pos == zout.size && hint != 0));
+        free(b.data);
+    }
+    ZSTD_freeDCtx(dctx);
+
+    if (failed || pop < 0)
+        return -1;
+    if (hint != 0) {
+        fprintf(stderr, "zstd: unexpected end of archive\n");
+        return -1;
+    }
+    return output_commit(out, 0, b.consumed, 1);
+}
+#endif
+
+#ifdef USE_LZ4
+static int decode_lz4(struct block_queue* in, struct block_output* out, archive_counters* counters) {
+    LZ4F_dctx* dctx;
+    struct block b;
+    size_t hint = 1;
+    int failed = 0;
+    int pop;
+
+    memset(&b, 0, sizeof(b));
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+        return -1;
+    while (!failed && (pop = queue_pop(in, &b)) == 1) {
+        const unsigned char* p = b.data;
+        size_t left = b.len;
+        size_t produced;
+        size_t room;
+        // same as zstd above
+        do {
+            size_t used = left;
+            unsigned char* dst = output_space(out, &room);
+            if (dst == NULL) {
+                failed = 1;
+                break;
+            }
+            produced = room;
+            // 0 once a frame is complete; the next one starts by itself
+            uint64_t start = archive_usec();
+            hint = LZ4F_decompress(dctx, dst, &produced, p, &used, NULL);
+            archive_count(&counters->compress_usec, archive_usec() - start);
+            if (LZ4F_isError(hint)) {
+                fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(hint));
+                failed = 1;
+                break;
+            }
+            p += used;
+            left -= used;
+            if (output_commit(out, produced, b.consumed, 0) != 0) {
+                failed = 1;
+                break;
+            }
+        } while (left > 0 || (produced == room && hint != 0));
+        free(b.data);
+    }
+    LZ4F_freeDecompressionContext(dctx);
+
+    if (failed || pop < 0)
+        return -1;
+    if (hint != 0) {
+        fprintf(stderr, "lz4: unexpected end of archive\n");
+        return -1;
+    }
+    return output_commit(out, 0, b.consumed, 1);
+}
+#endif
+
+struct decoder {
+    int compression;
+    struct block_queue* in;
+    struct block_queue* out;
+    archive_counters* counters;
+    int ret; // what the decoder returned, once the thread is done
+};
+
+static void* decode_thread(void* cookie) {
+    struct decoder* dec = (struct decoder*)cookie;
+    struct block_output out;
+    int ret = -1;
+
+    memset(&out, 0, sizeof(out));
+    out.q = dec->out;
+    switch (dec->compression) {
+        case ARCHIVE_COMPRESS_GZIP:
+            ret = decode_gzip(dec->in, &out, dec->counters);
+            break;
+#ifdef USE_ZSTD
+        case ARCHIVE_COMPRESS_ZSTD:
+            ret = decode_zstd(dec->in, &out, dec->counters);
+            break;
+#endif
+#ifdef USE_LZ4
+        case ARCHIVE_COMPRESS_LZ4:
+            ret = decode_lz4(dec->in, &out, dec->counters);
+            break;
+#endif
+    }
+    free(out.data);
+    dec->ret = ret;
+    if (ret != 0)
+        queue_close(dec->in, 1);
+    queue_close(dec->out, ret != 0);
+    return NULL;
+}
+
+/*
+ * file writers
+ */
+
+struct entry_meta {
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+};
+
+// Never through a symlink, they get their own times.
+static void apply_times(const char* path, const struct entry_meta* meta) {
+    struct timespec times[2];
+    times[0].tv_sec = times[1].tv_sec = meta->mtime;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+}
+
+static void apply_meta(const char* path, int fd, const struct entry_meta* meta) {
+
+    // chown first, it clears the setuid bits. Filesystems without owners
+    // (vfat) fail these, tar carries on as well.
+    if (fd >= 0) {
+        fchown(fd, meta->uid, meta->gid);
+        fchmod(fd, meta->mode & 07777);
+    } else {
+        chown(path, meta->uid, meta->gid);
+        chmod(path, meta->mode & 07777);
+    }
+    apply_times(path, meta);
+}
+
+// Makes room for a new entry at |path|: replaces whatever non-directory is
+// there and creates missing parent directories.
+static void prepare_path(const char* path) {
+    char tmp[PATH_MAX];
+    struct stat st;
+    char* p;
+
+    if (lstat(path, &st) == 0) {
+        if (!S_ISDIR(st.st_mode))
+            unlink(path);
+        else
+            rmdir(path);
+        return;
+    }
+    // archives list directories before their contents, so this is rare
+    strlcpy(tmp, path, sizeof(tmp));
+    for (p = strchr(tmp + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(tmp, 0755);
+        *p = '/';
+    }
+}
+
+static int open_file(const char* path, uint64_t size) {
+    prepare_path(path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // allocating the whole file at once saves ext4/f2fs growing it one
+    // delayed allocation at a time; not every filesystem can (vfat)
+    if (size >= EXTRACT_PREALLOC_MIN)
+        fallocate(fd, 0, 0, size);
+    return fd;
+}
+
+static int write_fully(int fd, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int close_file(const char* path, int fd, const struct entry_meta* meta) {
+    apply_meta(path, fd, meta);
+    if (close(fd) != 0) {
+        fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // close() would have bumped the mtime again on some filesystems
+    apply_meta(path, -1, meta);
+    return 0;
+}
+
+struct file_job {
+    struct file_job* next;
+    char* path;
+    struct entry_meta meta;
+    unsigned char* data;
+    size_t size;
+};
+
+// Small files are handed to a pool of writers, so that creating and closing
+// thousands of them overlaps with inflating the next ones.
+struct write_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t* threads;
+    int nthreads;
+    struct file_job* head;
+    struct file_job* tail;
+    size_t queued_bytes;
+    int finishing;
+    int error;
+    archive_counters* counters;
+};
+
+static int write_job(struct file_job* job) {
+    int fd = open_file(job->path, job->size);
+    if (fd < 0)
+        return -1;
+    if (write_fully(fd, job->data, job->size) != 0) {
+        fprintf(stderr, "Error writing %s: %s\n", job->path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return close_file(job->path, fd, &job->meta);
+}
+
+// Creating and closing the file is part of the write time, for small files
+// it is most of it.
+static int write_job_counted(struct file_job* job, archive_counters* counters) {
+    uint64_t start = archive_usec();
+    int ret = write_job(job);
+    archive_count(&counters->write_usec, archive_usec() - start);
+    if (ret == 0)
+        archive_count(&counters->bytes_out, job->size);
+    return ret;
+}
+
+static void* write_worker(void* cookie) {
+    struct write_pool* pool = (struct write_pool*)cookie;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->head == NULL && !pool->finishing)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if (pool->head == NULL)
+            break;
+        struct file_job* job = pool->head;
+        int failed = pool->error;
+        pool->head = job->next;
+        if (pool->head == NULL)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        int ret = failed ? -1 : write_job_counted(job, pool->counters);
+
+        pthread_mutex_lock(&pool->lock);
+        if (ret != 0)
+            pool->error = 1;
+        pool->queued_bytes -= job->size;
+        pthread_cond_broadcast(&pool->cond);
+        free(job->path);
+        free(job->data);
+        free(job);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static int pool_start(struct write_pool* pool, int threads, archive_counters* counters) {
+    memset(pool, 0, sizeof(*pool));
+    pool->counters = counters;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->threads = (pthread_t*)calloc(threads, sizeof(pthread_t));
+    if (pool->threads == NULL)
+        return -1;
+    for (pool->nthreads = 0; pool->nthreads < threads; pool->nthreads++) {
+        if (pthread_create(&pool->threads[pool->nthreads], NULL, write_worker, pool) != 0)
+            break;
+    }
+    return pool->nthreads > 0 ? 0 : -1;
+}
+
+// Queues |job|, waiting while too much data is buffered already.
+static int pool_submit(struct write_pool* pool, struct file_job* job) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->head != NULL && pool->queued_bytes + job->size > EXTRACT_ASYNC_BYTES && !pool->error)
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    int ret = pool->error ? -1 : 0;
+    if (ret == 0) {
+        job->next = NULL;
+        if (pool->tail != NULL)
+            pool->tail->next = job;
+        else
+            pool->head = job;
+        pool->tail = job;
+        pool->queued_bytes += job->size;
+        pthread_cond_broadcast(&pool->cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+// Waits for everything queued to be written and stops the workers.
+static int pool_finish(struct write_pool* pool) {
+    int i;
+    pthread_mutex_lock(&pool->lock);
+    pool->finishing = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    return pool->error ? -1 : 0;
+}
+
+/*
+ * tar parser
+ */
+
+// Entries whose metadata can only be applied once everything else is in
+// place: directories (creating their contents changes the mtime), hard
+// links (their target may still be with the writers) and symlinks (later
+// entries, or the writers, would otherwise follow them out of |dest|).
+struct deferred {
+    char type; // '5', '1' or '2', as in the tar header
+    char* path;
+    char* target; // links only
+    struct entry_meta meta;
+};
+
+struct tar_reader {
+    struct block_queue* in;
+    struct block cur;
+    size_t pos;
+    const archive_options* opts;
+    archive_counters* counters;
+    uint64_t data_bytes;
+    uint64_t last_progress;
+
+    struct write_pool pool;
+    int use_pool;
+
+    struct deferred* deferred;
+    int deferred_count;
+    int deferred_capacity;
+};
+
+// Points |*data| at up to |len| bytes of the stream. Returns how many, 0 at
+// the end of the archive and -1 on error.
+static ssize_t tar_next(struct tar_reader* r, size_t len, const unsigned char** data) {
+    while (r->cur.data == NULL || r->pos == r->cur.len) {
+        free(r->cur.data);
+        r->cur.data = NULL;
+        r->pos = 0;
+        int ret = queue_pop(r->in, &r->cur);
+        if (ret <= 0)
+            return ret;
+    }
+    if (len > r->cur.len - r->pos)
+        len = r->cur.len - r->pos;
+    *data = r->cur.data + r->pos;
+    r->pos += len;
+    return len;
+}
+
+static int tar_read(struct tar_reader* r, void* dst, size_t len) {
+    unsigned char* p = (unsigned char*)dst;
+    while (len > 0) {
+        const unsigned char* data;
+        ssize_t n = tar_next(r, len, &data);
+        if (n <= 0)
+            return -1;
+        if (p != NULL) {
+            memcpy(p, data, n);
+            p += n;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+static int tar_skip_padding(struct tar_reader* r, uint64_t size) {
+    if ((size % TAR_BLOCK_SIZE) == 0)
+        return 0;
+    return tar_read(r, NULL, TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE));
+}
+
+static void tar_progress(struct tar_reader* r, const char* name) {
+    if (r->opts->progress == NULL)
+        return;
+    if (name == NULL && r->data_bytes - r->last_progress < EXTRACT_PROGRESS_INTERVAL)
+        return;
+    r->last_progress = r->data_bytes;
+    r->opts->progress(name, r->cur.consumed, r->opts->cookie);
+}
+
+// Octal, or the GNU base-256 extension when the top bit is set.
+static uint64_t tar_parse_number(const char* field, size_t size) {
+    uint64_t value = 0;
+    size_t i = 0;
+    if ((unsigned char)field[0] & 0x80) {
+        value = (unsigned char)field[0] & 0x7f;
+        for (i = 1; i < size; i++)
+            value = (value << 8) | (unsigned char)field[i];
+        return value;
+    }
+    while (i < size && (field[i] == ' ' || field[i] == '\0'))
+        i++;
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; i++)
+        value = (value << 3) | (field[i] - '0');
+    return value;
+}
+
+static int tar_checksum_ok(const unsigned char* h) {
+    unsigned int stored = tar_parse_number((const char*)h + 148, 8);
+    unsigned int sum = 0;
+    int ssum = 0;
+    int i;
+    for (i = 0; i < TAR_BLOCK_SIZE; i++) {
+        unsigned char c = (i >= 148 && i < 156) ? ' ' : h[i];
+        sum += c;
+        ssum += (signed char)c;
+    }
+    // some old tars summed signed chars
+    return stored == sum || stored == (unsigned int)ssum;
+}
+
+// Reads a GNU long name/link or a pax header's data into a new string.
+static char* tar_read_string(struct tar_reader* r, uint64_t size) {
+    if (size >= TAR_PAX_MAX)
+        return NULL;
+    char* s = (char*)malloc(size + 1);
+    if (s == NULL || tar_read(r, s, size) != 0 || tar_skip_padding(r, size) != 0) {
+        free(s);
+        return NULL;
+    }
+    s[size] = '\0';
+    return s;
+}
+
+// Picks path= and linkpath= out of pax extended header records.
+static void tar_parse_pax(char* data, char** name, char** link) {
+    char* p = data;
+    while (*p != '\0') {
+        char* end;
+        long len = strtol(p, &end, 10);
+        if (len <= 0 || *end != ' ' || len > (long)strlen(p))
+            break;
+        char* record = end + 1;
+        char* next = p + len;
+        next[-1] = '\0';
+        if (strncmp(record, "path=", 5) == 0) {
+            free(*name);
+            *name = strdup(record + 5);
+        } else if (strncmp(record, "linkpath=", 9) == 0) {
+            free(*link);
+            *link = strdup(record + 9);
+        }
+        p = next;
+    }
+}
+
+// Member names are relative to the destination, whatever they start with.
+static const char* tar_strip_name(const char* name) {
+    for (;;) {
+        if (name[0] == '/')
+            name++;
+        else if (name[0] == '.' && name[1] == '/')
+            name += 2;
+        else
+            return name;
+    }
+}
+
+// Rejects names that would leave the destination.
+static int tar_name_ok(const char* name) {
+    const char* p = name;
+    while (*p != '\0') {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+            return 0;
+        p = strchr(p, '/');
+        if (p == NULL)
+            break;
+        p++;
+    }
+    return name[0] != '\0';
+}
+
+static int tar_defer(struct tar_reader* r, char type, const char* path, const char* target,
+                     const struct entry_meta* meta) {
+    if (r->deferred_count == r->deferred_capacity) {
+        int capacity = r->deferred_capacity ? r->deferred_capacity * 2 : 256;
+        struct deferred* d = (struct deferred*)realloc(r->deferred, capacity * sizeof(struct deferred));
+        if (d == NULL)
+            return -1;
+        r->deferred = d;
+        r->deferred_capacity = capacity;
+    }
+    struct deferred* d = &r->deferred[r->deferred_count];
+    d->type = type;
+    d->path = strdup(path);
+    d->target = target != NULL ? strdup(target) : NULL;
+    d->meta = *meta;
+    if (d->path == NULL || (target != NULL && d->target == NULL)) {
+        free(d->path);
+        free(d->target);
+        return -1;
+    }
+    r->deferred_count++;
+    return 0;
+}
+
+static int tar_extract_file(struct tar_reader* r, const char* path, const struct entry_meta* meta, uint64_t size) {
+    if (r->use_pool && size <= EXTRACT_ASYNC_MAX) {
+        struct file_job* job = (struct file_job*)calloc(1, sizeof(struct file_job));
+        if (job == NULL)
+            return -1;
+        job->path = strdup(path);
+        job->meta = *meta;
+        job->size = size;
+        job->data = (unsigned char*)malloc(size > 0 ? size : 1);
+        if (job->path == NULL || job->data == NULL || tar_read(r, job->data, size) != 0) {
+            free(job->path);
+            free(job->data);
+            free(job);
+            return -1;
+        }
+        r->data_bytes += size;
+        return pool_submit(&r->pool, job);
+    }
+
+    uint64_t start = archive_usec();
+    int fd = open_file(path, size);
+    archive_count(&r->counters->write_usec, archive_usec() - start);
+    if (fd < 0)
+        return -1;
+    uint64_t done = 0;
+    while (done < size) {
+        const unsigned char* data;
+        size_t want = size - done > EXTRACT_BLOCK_SIZE ? EXTRACT_BLOCK_SIZE : size - done;
+        ssize_t n = tar_next(r, want, &data);
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        start = archive_usec();
+        if (write_fully(fd, data, n) != 0) {
+            fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        archive_count(&r->counters->write_usec, archive_usec() - start);
+        archive_count(&r->counters->bytes_out, n);
+        done += n;
+        r->data_bytes += n;
+        tar_progress(r, NULL);
+    }
+    start = archive_usec();
+    int ret = close_file(path, fd, meta);
+    archive_count(&r->counters->write_usec, archive_usec() - start);
+    return ret;
+}
+
+static int tar_extract_entry(struct tar_reader* r, const char* dest, const unsigned char* h,
+                             const char* name, const char* link) {
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    struct entry_meta meta;
+    struct stat st;
+    char type = h[156];
+    uint64_t size = tar_parse_number((const char*)h + 124, 12);
+    int ret = 0;
+
+    meta.mode = tar_parse_number((const char*)h + 100, 8);
+    meta.uid = tar_parse_number((const char*)h + 108, 8);
+    meta.gid = tar_parse_number((const char*)h + 116, 8);
+    meta.mtime = tar_parse_number((const char*)h + 136, 12);
+
+    name = tar_strip_name(name);
+    if (!tar_name_ok(name)) {
+        fprintf(stderr, "Skipping unsafe name %s\n", name);
+        return tar_read(r, NULL, size) == 0 && tar_skip_padding(r, size) == 0 ? 0 : -1;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dest, name);
+    archive_count(&r->counters->entries, 1);
+    // directories come with a trailing slash
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        path[--len] = '\0';
+
+    switch (type) {
+        case '0':
+        case '\0':
+        case '7':
+            ret = tar_extract_file(r, path, &meta, size);
+            if (ret == 0)
+                ret = tar_skip_padding(r, size);
+            break;
+        case '5':
+            if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+                prepare_path(path);
+                if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+                    fprintf(stderr, "Unable to create %s: %s\n", path, strerror(errno));
+                    return -1;
+                }
+            }
+            ret = tar_defer(r, type, path, NULL, &meta);
+            break;
+        case '1':
+            // hard links name another member, symlinks are kept verbatim
+            link = tar_strip_name(link);
+            if (!tar_name_ok(link)) {
+                fprintf(stderr, "Skipping unsafe link %s\n", name);
+                break;
+            }
+            snprintf(target, sizeof(target), "%s/%s", dest, link);
+            ret = tar_defer(r, type, path, target, &meta);
+            break;
+        case '2':
+            ret = tar_defer(r, type, path, link, &meta);
+            break;
+        case '3':
+        case '4':
+        case '6': {
+            mode_t kind = type == '3' ? S_IFCHR : type == '4' ? S_IFBLK : S_IFIFO;
+            dev_t dev = makedev(tar_parse_number((const char*)h + 329, 8), tar_parse_number((const char*)h + 337, 8));
+            prepare_path(path);
+            if (mknod(path, kind | (meta.mode & 07777), dev) != 0) {
+                fprintf(stderr, "Unable to create %s: %s\n", path, strerror(errno));
+                return -1;
+            }
+            apply_meta(path, -1, &meta);
+            break;
+        }
+        default:
+            fprintf(stderr, "%s: unknown type %c ignored\n", name, type);
+            ret = tar_read(r, NULL, size) == 0 ? tar_skip_padding(r, size) : -1;
+            break;
+    }
+    if (ret == 0)
+        tar_progress(r, name);
+    return ret;
+}
+
+// Whether none of the directories between |dest| and |path| is a symlink.
+// Nothing but tar_apply_deferred() creates any, so until then every path
+// below |dest| is.
+static int tar_parent_ok(const char* dest, const char* path) {
+    char tmp[PATH_MAX];
+    struct stat st;
+    char* p;
+
+    strlcpy(tmp, path, sizeof(tmp));
+    for (p = strchr(tmp + strlen(dest) + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (lstat(tmp, &st) == 0 && S_ISLNK(st.st_mode))
+            return 0;
+        *p = '/';
+    }
+    return 1;
+}
+
+// Links in archive order, then directory metadata from the deepest
+// directory up. A link is only made where the symlinks made before it don't
+// lead elsewhere, the same goes for a hard link's target.
+static int tar_apply_deferred(struct tar_reader* r, const char* dest) {
+    struct stat st;
+    int ret = 0;
+    int i;
+    for (i = 0; i < r->deferred_count; i++) {
+        struct deferred* d = &r->deferred[i];
+        if (d->type == '5')
+            continue;
+        if (!tar_parent_ok(dest, d->path) || (d->type == '1' && !tar_parent_ok(dest, d->target))) {
+            fprintf(stderr, "Skipping %s behind a symlink\n", d->path);
+            continue;
+        }
+        prepare_path(d->path);
+        if (d->type == '1') {
+            if (link(d->target, d->path) != 0) {
+                fprintf(stderr, "Unable to link %s: %s\n", d->path, strerror(errno));
+                ret = -1;
+            }
+        } else if (symlink(d->target, d->path) != 0) {
+            fprintf(stderr, "Unable to create %s: %s\n", d->path, strerror(errno));
+            ret = -1;
+        } else {
+            lchown(d->path, d->meta.uid, d->meta.gid);
+            apply_times(d->path, &d->meta);
+        }
+    }
+    for (i = r->deferred_count - 1; i >= 0; i--) {
+        struct deferred* d = &r->deferred[i];
+        // a symlink may have replaced the directory since
+        if (d->type == '5' && tar_parent_ok(dest, d->path) && lstat(d->path, &st) == 0 && S_ISDIR(st.st_mode))
+            apply_meta(d->path, -1, &d->meta);
+    }
+    return ret;
+}
+
+static int tar_extract_stream(struct tar_reader* r, const char* dest) {
+    unsigned char h[TAR_BLOCK_SIZE];
+    char* long_name = NULL;
+    char* long_link = NULL;
+    int ret = 0;
+
+    for (;;) {
+        char name[257];
+        char link[101];
+        int i;
+
+        if (tar_read(r, h, sizeof(h)) != 0) {
+            fprintf(stderr, "Unexpected end of archive\n");
+            ret = -1;
+            break;
+        }
+        for (i = 0; i < TAR_BLOCK_SIZE && h[i] == 0; i++)
+            ;
+        // end of archive; whatever follows the first zero block is padding,
+        // see tar_drain()
+        if (i == TAR_BLOCK_SIZE)
+            break;
+        if (!tar_checksum_ok(h)) {
+            fprintf(stderr, "Corrupt tar header\n");
+            ret = -1;
+            break;
+        }
+
+        uint64_t size = tar_parse_number((const char*)h + 124, 12);
+        char type = h[156];
+        if (type == 'L' || type == 'K') {
+            char* s = tar_read_string(r, size);
+            if (s == NULL) {
+                ret = -1;
+                break;
+            }
+            free(type == 'L' ? long_name : long_link);
+            if (type == 'L')
+                long_name = s;
+            else
+                long_link = s;
+            continue;
+        }
+        if (type == 'x' || type == 'g') {
+            // global headers and xattr-laden ones hold nothing we need
+            if (type == 'g' || size >= TAR_PAX_MAX) {
+                if (tar_read(r, NULL, size) != 0 || tar_skip_padding(r, size) != 0) {
+                    ret = -1;
+                    break;
+                }
+                continue;
+            }
+            char* s = tar_read_string(r, size);
+            if (s == NULL) {
+                ret = -1;
+                break;
+            }
+            tar_parse_pax(s, &long_name, &long_link);
+            free(s);
+            continue;
+        }
+
+        // ustar splits long names into prefix and name
+        if (memcmp(h + 257, "ustar", 5) == 0 && h[345] != '\0')
+            snprintf(name, sizeof(name), "%.155s/%.100s", (const char*)h + 345, (const char*)h);
+        else
+            snprintf(name, sizeof(name), "%.100s", (const char*)h);
+        snprintf(link, sizeof(link), "%.100s", (const char*)h + 157);
+
+        ret = tar_extract_entry(r, dest, h, long_name != NULL ? long_name : name,
+                                long_link != NULL ? long_link : link);
+        free(long_name);
+        free(long_link);
+        long_name = long_link = NULL;
+        if (ret != 0)
+            break;
+    }
+    free(long_name);
+    free(long_link);
+    return ret;
+}
+
+// Reads the padding after the end of the archive up to the end of the
+// stream, so that the decoder gets to check the compressed stream's trailer
+// (gzip's CRC and length, the end of the last zstd/lz4 frame). Returns 0 if
+// the stream ended cleanly.
+static int tar_drain(struct tar_reader* r) {
+    const unsigned char* data;
+    ssize_t n;
+    while ((n = tar_next(r, EXTRACT_BLOCK_SIZE, &data)) > 0)
+        ;
+    return n < 0 ? -1 : 0;
+}
+
+// Restores what |reader| reads, see archive_extract().
+static int extract(struct segment_reader* reader, const char* dest, const archive_options* opts) {
+    struct block_queue raw;
+    struct block_queue decoded;
+    struct decoder dec;
+    struct tar_reader r;
+    pthread_t reader_tid;
+    pthread_t decode_tid;
+    archive_counters unused;
+    archive_counters* counters = opts->counters != NULL ? opts->counters : &unused;
+    int compressed = opts->compression != ARCHIVE_COMPRESS_NONE;
+    int ret;
+    int i;
+
+    if (!archive_compression_supported(opts->compression)) {
+        fprintf(stderr, "Compression %d is not supported by this build\n", opts->compression);
+        return -1;
+    }
+
+    memset(&unused, 0, sizeof(unused));
+    queue_init(&raw);
+    queue_init(&decoded);
+    reader->out = &raw;
+    reader->counters = counters;
+    if (pthread_create(&reader_tid, NULL, reader->source != NULL ? source_thread : reader_thread, reader) != 0) {
+        queue_destroy(&raw);
+        queue_destroy(&decoded);
+        return -1;
+    }
+    if (compressed) {
+        dec.compression = opts->compression;
+        dec.in = &raw;
+        dec.out = &decoded;
+        dec.counters = counters;
+        if (pthread_create(&decode_tid, NULL, decode_thread, &dec) != 0) {
+            queue_close(&raw, 1);
+            pthread_join(reader_tid, NULL);
+            queue_destroy(&raw);
+            queue_destroy(&decoded);
+            return -1;
+        }
+    }
+
+    memset(&r, 0, sizeof(r));
+    r.in = compressed ? &decoded : &raw;
+    r.opts = opts;
+    r.counters = counters;
+    int threads = opts->threads > 0 ? opts->threads : archive_online_cpus();
+    if (threads > MAX_EXTRACT_THREADS)
+        threads = MAX_EXTRACT_THREADS;
+    // without workers every file is simply written by the parser
+    r.use_pool = pool_start(&r.pool, threads, counters) == 0;
+
+    ret = tar_extract_stream(&r, dest);
+    if (ret == 0)
+        ret = tar_drain(&r);
+
+    // stop the producers if the parser gave up early
+    queue_close(r.in, ret != 0);
+    if (compressed) {
+        queue_close(&raw, ret != 0);
+        pthread_join(decode_tid, NULL);
+        // a corrupt trailer only shows once the last block is decoded
+        if (dec.ret != 0)
+            ret = -1;
+    }
+    pthread_join(reader_tid, NULL);
+    free(r.cur.data);
+
+    if (pool_finish(&r.pool) != 0)
+        ret = -1;
+    if (ret == 0)
+        ret = tar_apply_deferred(&r, dest);
+    for (i = 0; i < r.deferred_count; i++) {
+        free(r.deferred[i].path);
+        free(r.deferred[i].target);
+    }
+    free(r.deferred);
+
+    queue_destroy(&raw);
+    queue_destroy(&decoded);
+    return ret;
+}
+
+int archive_extract(const char* input_prefix, const char* dest, const archive_options* opts) {
+    struct segment_reader reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.prefix = input_prefix;
+    return extract(&reader, dest, opts);
+}
+
+int archive_extract_from_source(archive_source* in, const char* dest, const archive_options* opts) {
+    struct segment_reader reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.source = in;
+    return extract(&reader, dest, opts);
+}
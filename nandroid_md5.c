@@ -15,59 +15,354 @@
  */
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <openssl/md5.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common.h"
 #include "extendedcommands.h"
 #include "nandroid.h"
+#include "nandroid_compress.h"
 #include "nandroid_md5.h"
 #include "recovery_ui.h"
 
-#define MAX_FILES_CHECKED 20
-#define HASH_LENGTH 2*MD5_DIGEST_LENGTH
-#define BUFSIZE 1024
+#define MAX_HASH_LENGTH (2 * EVP_MAX_MD_SIZE)
+// per worker read buffer; large reads keep slow sdcards streaming
+#define MD5_BUFFER_SIZE (1024 * 1024)
+#define MAX_MD5_THREADS 4
+// how often the progress bar is refreshed while hashing
+#define MD5_PROGRESS_INTERVAL_MS 250
 
 typedef struct {
     int is_missing;
     char *filename;
 } MissingFiles;
 
-static void to_md5_hash(char *str, unsigned char* md) {
+typedef struct {
+    const char *name;
+    const char *manifest;   // in the format of the matching coreutils *sum tool
+    const EVP_MD *(*md)(void);
+} digest_info;
+
+// Indexed by NANDROID_DIGEST_*, oldest first
+static const digest_info digests[] = {
+    { "MD5", "nandroid.md5", EVP_md5 },
+    { "SHA-256", "nandroid.sha256", EVP_sha256 },
+};
+#define DIGEST_COUNT (int)(sizeof(digests) / sizeof(digests[0]))
+
+const EVP_MD *nandroid_digest_md(unsigned int digest) {
+    return digest < DIGEST_COUNT ? digests[digest].md() : NULL;
+}
+
+static int is_manifest(const char *name) {
     int i;
-    for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+    for (i = 0; i < DIGEST_COUNT; i++) {
+        if (strcmp(name, digests[i].manifest) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Makes room for one more element in |*array|, which holds |count| of
+// |size| bytes and has room for |*capacity|. Returns 0 on success.
+static int grow_array(void *array, int *capacity, int count, size_t size) {
+    void **p = (void**)array;
+    void *a;
+    int n;
+
+    if (count < *capacity)
+        return 0;
+    n = *capacity > 0 ? *capacity * 2 : 64;
+    if ((a = realloc(*p, n * size)) == NULL)
+        return -1;
+    *p = a;
+    *capacity = n;
+    return 0;
+}
+
+static void to_hash(char *str, const unsigned char* md, unsigned int len) {
+    unsigned int i;
+    for (i = 0; i < len; i++)
         sprintf(&str[2*i], "%02x", (unsigned int)md[i]);
-    str[HASH_LENGTH] = '\0';
+    str[2*len] = '\0';
 }
 
-static int calculate_md5(char *str, const char *path) {
-    FILE *fd;
-    fd = fopen(path, "r");
-    if (fd != NULL) {
-        MD5_CTX c;
-        size_t i;
-        static unsigned char buf[BUFSIZE];
-        unsigned char md5dig[MD5_DIGEST_LENGTH];
-        MD5_Init(&c);
-        while ((i = fread(buf, 1, BUFSIZE, fd)) > 0)
-            MD5_Update(&c, buf, i);
-        MD5_Final(&(md5dig[0]), &c);
-        fclose(fd);
-        to_md5_hash(str, md5dig);
-    } else {
-       return 1;
+typedef struct {
+    const char *path;
+    uint64_t size;
+    char hash[MAX_HASH_LENGTH+1];
+    int ret;
+} md5_job;
+
+typedef struct {
+    const EVP_MD *md;
+    md5_job **order;    // largest first, so no thread is left with a big image at the end
+    int count;
+    int next;
+    int running;
+    uint64_t bytes_done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} md5_pool;
+
+// Hashes |path| into |hash|, adding to |pool|'s progress if there is one.
+static int hash_file(const char *path, const EVP_MD *md, char *hash, unsigned char *buf, md5_pool *pool) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    // EVP picks the ARMv8 crypto / SHA-NI code paths where the CPU has them
+    EVP_MD_CTX *c = EVP_MD_CTX_create();
+    ssize_t i;
+    unsigned char dig[EVP_MAX_MD_SIZE];
+    unsigned int len;
+    if (c == NULL || !EVP_DigestInit_ex(c, md, NULL)) {
+        if (c != NULL)
+            EVP_MD_CTX_destroy(c);
+        close(fd);
+        return 1;
+    }
+    while ((i = read(fd, buf, MD5_BUFFER_SIZE)) != 0) {
+        if (i < 0) {
+            if (errno == EINTR)
+                continue;
+            EVP_MD_CTX_destroy(c);
+            close(fd);
+            return 1;
+        }
+        EVP_DigestUpdate(c, buf, i);
+        if (pool != NULL) {
+            pthread_mutex_lock(&pool->lock);
+            pool->bytes_done += i;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    EVP_DigestFinal_ex(c, dig, &len);
+    EVP_MD_CTX_destroy(c);
+    close(fd);
+    to_hash(hash, dig, len);
+    return 0;
+}
+
+static void* md5_worker(void *cookie) {
+    md5_pool *pool = (md5_pool*)cookie;
+    unsigned char *buf = malloc(MD5_BUFFER_SIZE);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->next < pool->count) {
+        md5_job *job = pool->order[pool->next++];
+        pthread_mutex_unlock(&pool->lock);
+        job->ret = buf != NULL ? hash_file(job->path, pool->md, job->hash, buf, pool) : 1;
+        pthread_mutex_lock(&pool->lock);
+    }
+    pool->running--;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    free(buf);
+    return NULL;
+}
+
+static int compare_job_size(const void *a, const void *b) {
+    uint64_t sa = (*(md5_job**)a)->size;
+    uint64_t sb = (*(md5_job**)b)->size;
+    return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+// Hashes all |jobs| with |digest| on a few threads and drives the progress
+// bar by the bytes hashed so far. Each job's ret tells whether its hash was
+// computed.
+static void calculate_md5s(md5_job *jobs, int count, unsigned int digest) {
+    pthread_t threads[MAX_MD5_THREADS];
+    md5_job **order;
+    md5_pool pool;
+    uint64_t total = 0;
+    int nthreads;
+    int i;
+
+    for (i = 0; i < count; i++)
+        jobs[i].ret = 1;
+    if (count == 0 || (order = malloc(count * sizeof(md5_job*))) == NULL)
+        return;
+    for (i = 0; i < count; i++) {
+        struct stat st;
+        jobs[i].size = stat(jobs[i].path, &st) == 0 ? st.st_size : 0;
+        total += jobs[i].size;
+        order[i] = &jobs[i];
+    }
+    qsort(order, count, sizeof(md5_job*), compare_job_size);
+
+    memset(&pool, 0, sizeof(pool));
+    pool.md = nandroid_digest_md(digest);
+    pool.order = order;
+    pool.count = count;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    nthreads = archive_online_cpus();
+    if (nthreads > MAX_MD5_THREADS)
+        nthreads = MAX_MD5_THREADS;
+    if (nthreads > count)
+        nthreads = count;
+
+    ui_reset_progress();
+    ui_show_progress(1, 0);
+
+    pthread_mutex_lock(&pool.lock);
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[pool.running], NULL, md5_worker, &pool) == 0)
+            pool.running++;
+    }
+    int started = pool.running;
+    pthread_mutex_unlock(&pool.lock);
+    // no threads? hash here
+    if (started == 0) {
+        pool.running = 1;
+        md5_worker(&pool);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.running > 0) {
+        struct timeval now;
+        struct timespec timeout;
+        gettimeofday(&now, NULL);
+        uint64_t ns = (uint64_t)now.tv_usec * 1000 + (uint64_t)MD5_PROGRESS_INTERVAL_MS * 1000000;
+        timeout.tv_sec = now.tv_sec + ns / 1000000000;
+        timeout.tv_nsec = ns % 1000000000;
+        pthread_cond_timedwait(&pool.cond, &pool.lock, &timeout);
+        if (total > 0)
+            ui_set_progress((float)((double)pool.bytes_done / (double)total));
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+    free(order);
+    ui_reset_progress();
+}
+
+// Written from the archive writer threads, read by nandroid_backup_md5_gen()
+typedef struct {
+    char *path;
+    unsigned int digest;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    char hash[MAX_HASH_LENGTH+1];
+} md5_record;
+
+static md5_record *records = NULL;
+static int record_count = 0;
+static int record_capacity = 0;
+static pthread_mutex_t records_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void record_hash(const char *path, unsigned int digest, const char *hash) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return;
+
+    pthread_mutex_lock(&records_lock);
+    int i;
+    for (i = 0; i < record_count; i++) {
+        if (strcmp(records[i].path, path) == 0)
+            break;
+    }
+    if (i == record_count) {
+        // out of memory; the file gets hashed again later
+        if (grow_array(&records, &record_capacity, record_count, sizeof(md5_record)) != 0 ||
+                (records[i].path = strdup(path)) == NULL) {
+            pthread_mutex_unlock(&records_lock);
+            return;
+        }
+        record_count++;
     }
+    records[i].digest = digest;
+    records[i].dev = st.st_dev;
+    records[i].ino = st.st_ino;
+    records[i].size = st.st_size;
+    records[i].mtime = st.st_mtime;
+    strcpy(records[i].hash, hash);
+    pthread_mutex_unlock(&records_lock);
+}
+
+void nandroid_md5_record(const char *path, unsigned int digest, const unsigned char *md) {
+    char hash[MAX_HASH_LENGTH+1];
+    if (digest >= DIGEST_COUNT)
+        return;
+    to_hash(hash, md, EVP_MD_size(nandroid_digest_md(digest)));
+    record_hash(path, digest, hash);
+}
+
+int nandroid_md5_record_file(const char *path, unsigned int digest) {
+    char hash[MAX_HASH_LENGTH+1];
+    unsigned char *buf;
+    int ret;
 
+    if (digest >= DIGEST_COUNT || (buf = malloc(MD5_BUFFER_SIZE)) == NULL)
+        return -1;
+    ret = hash_file(path, nandroid_digest_md(digest), hash, buf, NULL);
+    free(buf);
+    if (ret != 0)
+        return -1;
+    record_hash(path, digest, hash);
     return 0;
 }
 
+void nandroid_md5_clear_records() {
+    int i;
+    pthread_mutex_lock(&records_lock);
+    for (i = 0; i < record_count; i++)
+        free(records[i].path);
+    free(records);
+    records = NULL;
+    record_count = 0;
+    record_capacity = 0;
+    pthread_mutex_unlock(&records_lock);
+}
+
+// Copies the recorded |digest| hash of |path| to |hash| if the file hasn't
+// changed since it was recorded.
+static int find_record(const char *path, unsigned int digest, char *hash) {
+    struct stat st;
+    int i;
+    int found = 0;
+    if (stat(path, &st) != 0)
+        return 0;
+
+    pthread_mutex_lock(&records_lock);
+    for (i = 0; i < record_count; i++) {
+        md5_record *r = &records[i];
+        if (strcmp(r->path, path) != 0)
+            continue;
+        if (r->digest == digest && r->dev == st.st_dev && r->ino == st.st_ino && r->size == st.st_size && r->mtime == st.st_mtime) {
+            strcpy(hash, r->hash);
+            found = 1;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&records_lock);
+    return found;
+}
+
 static int is_selected_for_restore(const char *file, const unsigned char flags) {
     int check_boot = ((flags & NANDROID_BOOT) == NANDROID_BOOT);
     int check_system = ((flags & NANDROID_SYSTEM) == NANDROID_SYSTEM);
@@ -92,7 +387,7 @@ static int is_selected_for_restore(const char *file, const unsigned char flags)
     return 0;
 }
 
-int nandroid_backup_md5_gen(const char *backup_path) {
+int nandroid_backup_md5_gen(const char *backup_path, unsigned int digest) {
     DIR *dp;
     FILE *fd;
     int i = 0;
@@ -102,8 +397,13 @@ int nandroid_backup_md5_gen(const char *backup_path) {
     int filecount = 0;
 
     // Dynamically allocated, free them at the end
-    char *filenames[MAX_FILES_CHECKED];
-    char *filepaths[MAX_FILES_CHECKED];
+    char **filenames = NULL;
+    char **filepaths = NULL;
+    int names_capacity = 0;
+    int paths_capacity = 0;
+    md5_job *jobs = NULL;
+    md5_job **pending = NULL;
+    md5_job *hashed = NULL;
 
     char path[PATH_MAX];
     snprintf(path, PATH_MAX, "%s", backup_path);
@@ -111,16 +411,26 @@ int nandroid_backup_md5_gen(const char *backup_path) {
     if (path[len-1] == '/')
         path[len-1] = '\0';
 
-    ui_print("Generating MD5 checksums...\n");
+    if (digest >= DIGEST_COUNT)
+        digest = NANDROID_DIGEST_MD5;
+    const digest_info *info = &digests[digest];
+    ui_print("Generating %s checksums...\n", info->name);
 
     // Read files available in backup path
     dp = opendir(path);
     if (dp != NULL) {
         struct dirent *ep;
-        while ((ep = readdir(dp)) && i < MAX_FILES_CHECKED) {
+        while ((ep = readdir(dp))) {
             if (strcmp(ep->d_name, ".") != 0 && strcmp(ep->d_name, "..") != 0
                     && strcmp(ep->d_name, "recovery.log") != 0
-                    && strcmp(ep->d_name, "nandroid.md5") != 0) {
+                    && strcmp(ep->d_name, NANDROID_STATS_FILE) != 0
+                    && !is_manifest(ep->d_name)) {
+                // every file has to be listed, or restores can't verify it
+                if (grow_array(&filenames, &names_capacity, i, sizeof(char*)) != 0 ||
+                        grow_array(&filepaths, &paths_capacity, i, sizeof(char*)) != 0) {
+                    ret = -1;
+                    break;
+                }
                 len = strlen(ep->d_name);
                 filenames[i] = malloc(sizeof(char[len+1]));
                 snprintf(filenames[i], len+1, "%s", ep->d_name);
@@ -134,42 +444,76 @@ int nandroid_backup_md5_gen(const char *backup_path) {
         closedir(dp);
         filecount = i;
     }
+    if (ret != 0) {
+        LOGE("Out of memory listing %s for %s generation\n", path, info->name);
+        goto out;
+    }
     if (filecount == 0) {
         ret = -1;
-        LOGE("No files found in %s for MD5 generation\n", path);
+        LOGE("No files found in %s for %s generation\n", path, info->name);
         goto out;
     }
 
-    // Prepare backup_path/nandroid.md5 for writing
+    // Prepare the manifest (backup_path/nandroid.md5 etc.) for writing
     char md5path[PATH_MAX];
-    snprintf(md5path, PATH_MAX, "%s/%s", path, "nandroid.md5");
+    snprintf(md5path, PATH_MAX, "%s/%s", path, info->manifest);
     fd = fopen(md5path, "w");
     if (fd == NULL) {
         ret = -1;
-        LOGE("Unable to create nandroid.md5\n");
+        LOGE("Unable to create %s\n", info->manifest);
         goto out;
     }
 
-    // Generate MD5s and save to nandroid.md5
-    char md5calc[HASH_LENGTH+1];
+    // Generate hashes and save to the manifest; files hashed while they were
+    // written don't need to be read again
+    int pending_count = 0;
     char tmp[PATH_MAX];
+    jobs = malloc(filecount * sizeof(md5_job));
+    pending = malloc(filecount * sizeof(md5_job*));
+    hashed = malloc(filecount * sizeof(md5_job));
+    if (jobs == NULL || pending == NULL || hashed == NULL) {
+        fclose(fd);
+        unlink(md5path);
+        ret = -1;
+        LOGE("Out of memory generating %s\n", info->manifest);
+        goto out;
+    }
     for (i = 0; i < filecount; i++) {
-        if (calculate_md5(md5calc, filepaths[i]) != 0) {
-            LOGE("Unable to generate MD5 for %s\n", filenames[i]);
+        jobs[i].path = filepaths[i];
+        jobs[i].ret = find_record(filepaths[i], digest, jobs[i].hash) ? 0 : 1;
+        if (jobs[i].ret != 0)
+            pending[pending_count++] = &jobs[i];
+    }
+    if (pending_count > 0) {
+        for (i = 0; i < pending_count; i++)
+            hashed[i].path = pending[i]->path;
+        calculate_md5s(hashed, pending_count, digest);
+        for (i = 0; i < pending_count; i++)
+            *pending[i] = hashed[i];
+    }
+    for (i = 0; i < filecount; i++) {
+        if (jobs[i].ret != 0) {
+            LOGE("Unable to generate %s for %s\n", info->name, filenames[i]);
             // Attempt to continue for other files
         } else {
-            snprintf(tmp, PATH_MAX, "%s  %s\n", md5calc, filenames[i]);
+            snprintf(tmp, PATH_MAX, "%s  %s\n", jobs[i].hash, filenames[i]);
             fputs(tmp, fd);
         }
     }
     fclose(fd);
-    ui_print("MD5 checksums generated\n");
+    ui_print("%s checksums generated\n", info->name);
 
 out:
     for (i = 0; i < filecount; i++) {
         free(filenames[i]);
         free(filepaths[i]);
     }
+    free(filenames);
+    free(filepaths);
+    free(jobs);
+    free(pending);
+    free(hashed);
+    nandroid_md5_clear_records();
 
     return ret;
 }
@@ -183,6 +527,8 @@ int nandroid_restore_md5_check(const char *backup_path, unsigned char flags) {
     int ret = 0;
     int filecount = 0;
     int md5count = 0;
+    unsigned int digest = NANDROID_DIGEST_MD5;
+    int hash_length;
     int use_ui = is_ui_initialized();
 
     if (empty_nandroid_bitmask(flags)) {
@@ -191,10 +537,16 @@ int nandroid_restore_md5_check(const char *backup_path, unsigned char flags) {
     }
 
     // Dynamically allocated, free them at the end
-    char *filenames[MAX_FILES_CHECKED];
-    char *filepaths[MAX_FILES_CHECKED];
-    char *md5files[MAX_FILES_CHECKED];
-    char *md5hashes[MAX_FILES_CHECKED];
+    char **filenames = NULL;
+    char **filepaths = NULL;
+    char **md5files = NULL;
+    char **md5hashes = NULL;
+    int names_capacity = 0;
+    int paths_capacity = 0;
+    int md5files_capacity = 0;
+    int md5hashes_capacity = 0;
+    md5_job *jobs = NULL;
+    int *job_of_file = NULL;
     int mf_allocated = 0; // for MissingFiles *mf
     int mm_allocated = 0; // for MissingFiles *mm
 
@@ -204,14 +556,19 @@ int nandroid_restore_md5_check(const char *backup_path, unsigned char flags) {
     if (path[len-1] == '/')
         path[len-1] = '\0';
 
-    ui_print("Checking MD5 sums...\n");
+    ui_print("Verifying checksums...\n");
 
     // Read files available in backup path
     dp = opendir(path);
     if (dp != NULL) {
         struct dirent *ep;
-        while ((ep = readdir(dp)) && i < MAX_FILES_CHECKED) {
+        while ((ep = readdir(dp))) {
             if (is_selected_for_restore(ep->d_name, flags)) {
+                if (grow_array(&filenames, &names_capacity, i, sizeof(char*)) != 0 ||
+                        grow_array(&filepaths, &paths_capacity, i, sizeof(char*)) != 0) {
+                    ret = -1;
+                    break;
+                }
                 len = strlen(ep->d_name);
                 filenames[i] = malloc(sizeof(char[len+1]));
                 snprintf(filenames[i], len+1, "%s", ep->d_name);
@@ -225,39 +582,58 @@ int nandroid_restore_md5_check(const char *backup_path, unsigned char flags) {
         closedir(dp);
         filecount = i;
     }
+    if (ret != 0) {
+        LOGE("Out of memory listing %s\n", path);
+        goto out;
+    }
     if (filecount == 0) {
         ret = -1;
         LOGE("No backup files found in %s\n", path);
         goto out;
     }
 
-    // Read files + hashes available in nandroid.md5
+    // Read files + hashes available in the newest manifest; the file name
+    // tells the algorithm, so older nandroid.md5 only backups still verify
     i = 0;
     char md5path[PATH_MAX];
-    snprintf(md5path, PATH_MAX, "%s/%s", path, "nandroid.md5");
-    fd = fopen(md5path, "r");
+    fd = NULL;
+    for (j = DIGEST_COUNT - 1; j >= 0 && fd == NULL; j--) {
+        digest = j;
+        snprintf(md5path, PATH_MAX, "%s/%s", path, digests[digest].manifest);
+        fd = fopen(md5path, "r");
+    }
+    hash_length = 2 * EVP_MD_size(nandroid_digest_md(digest));
     if (fd != NULL) {
         char tmp[PATH_MAX];
-        while (fgets(tmp, PATH_MAX, fd) && i < MAX_FILES_CHECKED) {
+        while (fgets(tmp, PATH_MAX, fd)) {
             if (tmp[strlen(tmp)-1] == '\n')
                 tmp[strlen(tmp)-1] = '\0';
-            if (is_selected_for_restore(tmp, flags)) {
-                md5hashes[i] = malloc(sizeof(char[HASH_LENGTH+1]));
-                snprintf(md5hashes[i], HASH_LENGTH+1, "%s", tmp);
+            if ((int)strlen(tmp) > hash_length+2 && is_selected_for_restore(tmp, flags)) {
+                if (grow_array(&md5files, &md5files_capacity, i, sizeof(char*)) != 0 ||
+                        grow_array(&md5hashes, &md5hashes_capacity, i, sizeof(char*)) != 0) {
+                    ret = -1;
+                    break;
+                }
+                md5hashes[i] = malloc(sizeof(char[hash_length+1]));
+                snprintf(md5hashes[i], hash_length+1, "%s", tmp);
 
-                // md5 hash is followed by two spaces
-                len = strlen(tmp) - (HASH_LENGTH+2);
+                // hash is followed by two spaces
+                len = strlen(tmp) - (hash_length+2);
                 md5files[i] = malloc(sizeof(char[len+1]));
-                snprintf(md5files[i], len+1, "%s", &tmp[HASH_LENGTH+2]);
+                snprintf(md5files[i], len+1, "%s", &tmp[hash_length+2]);
                 i++;
             }
         }
         fclose(fd);
         md5count = i;
     }
+    if (ret != 0) {
+        LOGE("Out of memory reading %s\n", md5path);
+        goto out;
+    }
 
 #if DEBUG_MD5_CHECKER
-    LOGI("[MD5] backup_path: %s\n", path);
+    LOGI("[MD5] backup_path: %s (%s)\n", path, digests[digest].name);
     for (i = 0; i < filecount; i++) {
         LOGI("[MD5] files in path: %s\n", filenames[i]);
     }
@@ -359,7 +735,7 @@ int nandroid_restore_md5_check(const char *backup_path, unsigned char flags) {
         ui_set_showing_back_button(0);
 
         const char* headers[totalmissing+5];
-        headers[0] = "Could not find reference MD5 for:";
+        headers[0] = "Could not find reference checksum for:";
         int hi = 1;
         for (i = 0; i < filecount; i++) {
             if (mf[i].is_missing)
@@ -384,7 +760,7 @@ int nandroid_restore_md5_check(const char *backup_path, unsigned char flags) {
     } else if (totalmissing) {
         // No UI, so no prompt possible; fail the restore
         ret = -1;
-        LOGE("Could not find reference MD5 for:\n");
+        LOGE("Could not find reference checksum for:\n");
         for (i = 0; i < filecount; i++) {
             if (mf[i].is_missing)
                 LOGE("%s\n", mf[i].filename);
@@ -393,22 +769,45 @@ int nandroid_restore_md5_check(const char *backup_path, unsigned char flags) {
         goto out;
     }
 
-    // Compare MD5s of non-missing files that are selected for restore
+    // Compare MD5s of non-missing files that are selected for restore,
+    // hashing all of them up front
     int md5matches = 0;
-    char md5calc[HASH_LENGTH+1];
+    int jobcount = 0;
+    jobs = malloc(filecount * sizeof(md5_job));
+    job_of_file = malloc(filecount * sizeof(int));
+    if (jobs == NULL || job_of_file == NULL) {
+        ret = -1;
+        LOGE("Out of memory verifying %s\n", path);
+        goto out;
+    }
+    for (i = 0; i < filecount; i++) {
+        job_of_file[i] = -1;
+        if (!is_selected_for_restore(filenames[i], flags))
+            continue;
+        for (j = 0; j < md5count; j++) {
+            if (strcmp(filenames[i], md5files[j]) == 0) {
+                job_of_file[i] = jobcount;
+                jobs[jobcount++].path = filepaths[i];
+                break;
+            }
+        }
+    }
+    calculate_md5s(jobs, jobcount, digest);
+
     for (i = 0; i < filecount; i++) {
         if (!is_selected_for_restore(filenames[i], flags))
             continue;
         for (j = 0; j < md5count; j++) {
             if (strcmp(filenames[i], md5files[j]) == 0) {
-                if (calculate_md5(md5calc, filepaths[i]) != 0) {
+                md5_job *job = &jobs[job_of_file[i]];
+                if (job->ret != 0) {
                     ret = -1;
-                    LOGE("Unable to check MD5 of %s\nAborting\n", filenames[i]);
+                    LOGE("Unable to check %s of %s\nAborting\n", digests[digest].name, filenames[i]);
                     goto out;
                 }
-                if (strcmp(md5calc, md5hashes[j]) != 0) {
+                if (strcmp(job->hash, md5hashes[j]) != 0) {
                     ret = -1;
-                    LOGE("MD5 mismatch for %s\nAborting\n", filenames[i]);
+                    LOGE("%s mismatch for %s\nAborting\n", digests[digest].name, filenames[i]);
                     goto out;
                 } else {
                     md5matches++;
@@ -417,9 +816,9 @@ int nandroid_restore_md5_check(const char *backup_path, unsigned char flags) {
         }
     }
     if (md5matches) {
-        ui_print("All MD5 checksums verified\n");
+        ui_print("All %s checksums verified\n", digests[digest].name);
     } else {
-        ui_print("No MD5 verification performed\n");
+        ui_print("No checksum verification performed\n");
     }
 
 out:
@@ -435,6 +834,12 @@ out:
         free(md5files[i]);
         free(md5hashes[i]);
     }
+    free(filenames);
+    free(filepaths);
+    free(md5files);
+    free(md5hashes);
+    free(jobs);
+    free(job_of_file);
 
     return ret;
 }
@@ -17,9 +17,24 @@
 #ifndef _NANDROID_MD5_H
 #define _NANDROID_MD5_H
 
+#include <openssl/evp.h>
+
 #define DEBUG_MD5_CHECKER 0
 
-int nandroid_backup_md5_gen(const char *backup_path);
+// Backups are verified with one of the NANDROID_DIGEST_* algorithms. Each
+// has its own manifest (nandroid.md5, nandroid.sha256) in the format of the
+// matching coreutils *sum tool, so the manifest name records the algorithm.
+const EVP_MD *nandroid_digest_md(unsigned int digest);
+
+int nandroid_backup_md5_gen(const char *backup_path, unsigned int digest);
 int nandroid_restore_md5_check(const char *backup_path, unsigned char flags);
 
+// Digests taken while the backup was being written. nandroid_backup_md5_gen()
+// uses them instead of reading a file back as long as the file is unchanged
+// since, and forgets them all when done.
+void nandroid_md5_record(const char *path, unsigned int digest, const unsigned char *md);
+// Hashes |path| right away, while a freshly dumped image is still cached.
+int nandroid_md5_record_file(const char *path, unsigned int digest);
+void nandroid_md5_clear_records();
+
 #endif
@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "nandroid_stream.h"
+
+#define BU_HEADER_SIZE 8
+// longest 'P' payload
+#define BU_PARTITION_MAX 256
+
+static void put_le32(unsigned char* p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t get_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int writev_fully(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Returns how many of |len| bytes could be read before the end of |fd|, or
+// -1 on error.
+static ssize_t read_fully(int fd, void* data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, (char*)data + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+/*
+ * writer
+ */
+
+struct bu_writer {
+    int fd;
+    int error;
+};
+
+struct partition_sink {
+    archive_sink base;
+    bu_writer* w;
+    unsigned char* buf;
+    size_t buffered;
+    uint64_t total;
+};
+
+static int write_frame(bu_writer* w, char type, const void* data, size_t len) {
+    unsigned char header[BU_HEADER_SIZE];
+    struct iovec iov[2];
+
+    if (w->error)
+        return -1;
+    memset(header, 0, sizeof(header));
+    header[0] = type;
+    put_le32(header + 4, len);
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = len;
+    if (writev_fully(w->fd, iov, len > 0 ? 2 : 1) != 0) {
+        fprintf(stderr, "Error writing backup stream: %s\n", strerror(errno));
+        w->error = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static int partition_write(archive_sink* sink, const void* data, size_t len) {
+    struct partition_sink* ps = (struct partition_sink*)sink;
+    const unsigned char* p = (const unsigned char*)data;
+
+    ps->total += len;
+    while (len > 0) {
+        // whole frames go out straight from the caller's buffer
+        if (ps->buffered == 0 && len >= BU_FRAME_SIZE) {
+            if (write_frame(ps->w, 'D', p, BU_FRAME_SIZE) != 0)
+                return -1;
+            p += BU_FRAME_SIZE;
+            len -= BU_FRAME_SIZE;
+            continue;
+        }
+        size_t n = BU_FRAME_SIZE - ps->buffered;
+        if (n > len)
+            n = len;
+        memcpy(ps->buf + ps->buffered, p, n);
+        ps->buffered += n;
+        p += n;
+        len -= n;
+        if (ps->buffered == BU_FRAME_SIZE) {
+            if (write_frame(ps->w, 'D', ps->buf, ps->buffered) != 0)
+                return -1;
+            ps->buffered = 0;
+        }
+    }
+    return 0;
+}
+
+static int partition_close(archive_sink* sink) {
+    struct partition_sink* ps = (struct partition_sink*)sink;
+    unsigned char size[8];
+    int ret = 0;
+
+    if (ps->buffered > 0)
+        ret = write_frame(ps->w, 'D', ps->buf, ps->buffered);
+    put_le32(size, (uint32_t)ps->total);
+    put_le32(size + 4, (uint32_t)(ps->total >> 32));
+    if (ret == 0)
+        ret = write_frame(ps->w, 'E', size, sizeof(size));
+    free(ps->buf);
+    free(ps);
+    return ret;
+}
+
+bu_writer* bu_writer_open(int fd) {
+    bu_writer* w = (bu_writer*)calloc(1, sizeof(bu_writer));
+    struct iovec iov;
+    if (w == NULL)
+        return NULL;
+    w->fd = fd;
+    iov.iov_base = (void*)BU_STREAM_MAGIC;
+    iov.iov_len = BU_STREAM_MAGIC_SIZE;
+    if (writev_fully(fd, &iov, 1) != 0) {
+        fprintf(stderr, "Error writing backup stream: %s\n", strerror(errno));
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+archive_sink* bu_writer_begin(bu_writer* w, const char* name, const char* format) {
+    char header[BU_PARTITION_MAX];
+    int len = snprintf(header, sizeof(header), "%s %s", name, format);
+    if (len < 0 || len >= (int)sizeof(header))
+        return NULL;
+
+    struct partition_sink* ps = (struct partition_sink*)calloc(1, sizeof(struct partition_sink));
+    if (ps == NULL)
+        return NULL;
+    ps->buf = (unsigned char*)malloc(BU_FRAME_SIZE);
+    if (ps->buf == NULL || write_frame(w, 'P', header, len) != 0) {
+        free(ps->buf);
+        free(ps);
+        return NULL;
+    }
+    ps->base.write = partition_write;
+    ps->base.close = partition_close;
+    ps->w = w;
+    return &ps->base;
+}
+
+int bu_writer_finish(bu_writer* w, int complete) {
+    int ret = complete ? write_frame(w, 'Z', NULL, 0) : -1;
+    free(w);
+    return ret;
+}
+
+/*
+ * reader
+ */
+
+struct bu_reader {
+    archive_source source; // bu_reader_source()
+    int fd;
+    int framed;
+    // what bu_reader_open() read of an older dump, handed out first
+    unsigned char head[BU_STREAM_MAGIC_SIZE];
+    size_t head_len;
+    size_t head_pos;
+    int in_partition;   // between its 'P' and 'E' frames
+    uint32_t frame_left; // data left in the current 'D' frame
+    uint64_t total;      // data of the current partition read so far
+    int error;
+};
+
+static int read_frame_header(bu_reader* r, char* type, uint32_t* len) {
+    unsigned char header[BU_HEADER_SIZE];
+    ssize_t n = read_fully(r->fd, header, sizeof(header));
+    if (n != sizeof(header)) {
+        fprintf(stderr, n < 0 ? "Error reading backup stream: %s\n" : "Backup stream ends early\n",
+                strerror(errno));
+        return -1;
+    }
+    if (header[1] != 0 || header[2] != 0 || header[3] != 0) {
+        fprintf(stderr, "Corrupt backup stream\n");
+        return -1;
+    }
+    *type = header[0];
+    *len = get_le32(header + 4);
+    return 0;
+}
+
+// Finishes the partition at its 'E' frame, checking that all of it arrived.
+static int read_partition_end(bu_reader* r, uint32_t len) {
+    unsigned char size[8];
+    if (len != sizeof(size) || read_fully(r->fd, size, sizeof(size)) != sizeof(size)) {
+        fprintf(stderr, "Corrupt backup stream\n");
+        return -1;
+    }
+    uint64_t total = get_le32(size) | ((uint64_t)get_le32(size + 4) << 32);
+    if (total != r->total) {
+        fprintf(stderr, "Backup stream lost data: %llu of %llu bytes\n",
+                (unsigned long long)r->total, (unsigned long long)total);
+        return -1;
+    }
+    r->in_partition = 0;
+    return 0;
+}
+
+static ssize_t legacy_read(bu_reader* r, void* data, size_t len) {
+    if (r->head_pos < r->head_len) {
+        size_t n = r->head_len - r->head_pos;
+        if (n > len)
+            n = len;
+        memcpy(data, r->head + r->head_pos, n);
+        r->head_pos += n;
+        return n;
+    }
+    for (;;) {
+        ssize_t n = read(r->fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        return n;
+    }
+}
+
+static ssize_t bu_source_read(archive_source* source, void* data, size_t len) {
+    bu_reader* r = (bu_reader*)source;
+    char type;
+    uint32_t frame_len;
+
+    if (!r->framed)
+        return legacy_read(r, data, len);
+    if (r->error)
+        return -1;
+    while (r->frame_left == 0) {
+        if (!r->in_partition)
+            return 0;
+        if (read_frame_header(r, &type, &frame_len) != 0)
+            goto error;
+        if (type == 'D') {
+            r->frame_left = frame_len;
+        } else if (type == 'E') {
+            if (read_partition_end(r, frame_len) != 0)
+                goto error;
+            return 0;
+        } else {
+            fprintf(stderr, "Corrupt backup stream\n");
+            goto error;
+        }
+    }
+
+    if (len > r->frame_left)
+        len = r->frame_left;
+    for (;;) {
+        ssize_t n = read(r->fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fprintf(stderr, n < 0 ? "Error reading backup stream: %s\n" : "Backup stream ends early\n",
+                    strerror(errno));
+            goto error;
+        }
+        r->frame_left -= n;
+        r->total += n;
+        return n;
+    }
+
+error:
+    r->error = 1;
+    return -1;
+}
+
+bu_reader* bu_reader_open(int fd) {
+    bu_reader* r = (bu_reader*)calloc(1, sizeof(bu_reader));
+    if (r == NULL)
+        return NULL;
+    r->source.read = bu_source_read;
+    r->fd = fd;
+    ssize_t n = read_fully(fd, r->head, sizeof(r->head));
+    if (n < 0) {
+        fprintf(stderr, "Error reading backup stream: %s\n", strerror(errno));
+        free(r);
+        return NULL;
+    }
+    r->framed = n == BU_STREAM_MAGIC_SIZE && memcmp(r->head, BU_STREAM_MAGIC, BU_STREAM_MAGIC_SIZE) == 0;
+    if (!r->framed)
+        r->head_len = n;
+    return r;
+}
+
+int bu_reader_framed(const bu_reader* r) {
+    return r->framed;
+}
+
+int bu_reader_next(bu_reader* r, char* name, size_t name_size, char* format, size_t format_size) {
+    char header[BU_PARTITION_MAX];
+    char type;
+    uint32_t len;
+
+    if (!r->framed || r->error)
+        return -1;
+    // the extractor stops at the end of the tar stream, which may leave
+    // padding, and skipped partitions are not read at all
+    while (r->in_partition) {
+        unsigned char scratch[64 * 1024];
+        if (bu_source_read(&r->source, scratch, sizeof(scratch)) < 0)
+            return -1;
+    }
+
+    if (read_frame_header(r, &type, &len) != 0) {
+        r->error = 1;
+        return -1;
+    }
+    if (type == 'Z' && len == 0)
+        return 0;
+    if (type != 'P' || len >= sizeof(header) || read_fully(r->fd, header, len) != (ssize_t)len) {
+        fprintf(stderr, "Corrupt backup stream\n");
+        r->error = 1;
+        return -1;
+    }
+    header[len] = '\0';
+    char* space = strchr(header, ' ');
+    if (space == NULL) {
+        fprintf(stderr, "Corrupt backup stream\n");
+        r->error = 1;
+        return -1;
+    }
+    *space = '\0';
+    strlcpy(name, header, name_size);
+    strlcpy(format, space + 1, format_size);
+    r->in_partition = 1;
+    r->frame_left = 0;
+    r->total = 0;
+    return 1;
+}
+
+archive_source* bu_reader_source(bu_reader* r) {
+    return &r->source;
+}
+
+void bu_reader_close(bu_reader* r) {
+    free(r);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2014 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _NANDROID_STREAM_H
+#define _NANDROID_STREAM_H
+
+#include <stddef.h>
+
+#include "nandroid_archive.h"
+
+// The stream "bu" backups send over adb. Several partitions go one after
+// the other in a single stream, each as a series of frames:
+//   BU_STREAM_MAGIC
+//   'P' "<name> <format>"     starts a partition; format is one of tar,
+//                             tar.gz, tar.zst, tar.lz4 or img
+//   'D' <data>                up to BU_FRAME_SIZE bytes of it, repeated
+//   'E' <size>                its end: the data size, 64 bit little endian
+//   ...                       more partitions
+//   'Z'                       the end of the stream
+// Every frame starts with an 8 byte header: the type, three zero bytes and
+// the payload length as 32 bit little endian. Streams without the magic are
+// the plain tar or image dumps of older recoveries.
+#define BU_STREAM_MAGIC "CWM-BU1\n"
+#define BU_STREAM_MAGIC_SIZE 8
+// Data frames are this large so that adbd gets large writes.
+#define BU_FRAME_SIZE (1024 * 1024)
+
+typedef struct bu_writer bu_writer;
+
+// Starts a stream on |fd|, which is not closed. Returns NULL on error.
+bu_writer* bu_writer_open(int fd);
+
+// Starts a partition. Everything written to the returned sink goes into its
+// data frames; closing the sink ends the partition.
+archive_sink* bu_writer_begin(bu_writer* w, const char* name, const char* format);
+
+// Ends the stream and frees |w|. The end marker is only written when
+// |complete| is set, so that restoring a failed backup fails as well.
+// Returns 0 if all of it was written.
+int bu_writer_finish(bu_writer* w, int complete);
+
+typedef struct bu_reader bu_reader;
+
+// Starts reading |fd|, which is not closed. Returns NULL if it can't be read.
+bu_reader* bu_reader_open(int fd);
+
+// Returns 1 for a bu stream and 0 for the dump of an older recovery, which
+// bu_reader_source() then returns as a whole.
+int bu_reader_framed(const bu_reader* r);
+
+// Skips whatever is left of the current partition and moves on to the next
+// one. Returns 1 with its |name| and |format|, 0 at the end of the stream
+// and -1 on error.
+int bu_reader_next(bu_reader* r, char* name, size_t name_size, char* format, size_t format_size);
+
+// The data of the current partition, which reads 0 at its end and -1 if
+// the stream ends early.
+archive_source* bu_reader_source(bu_reader* r);
+
+void bu_reader_close(bu_reader* r);
+
+#endif